@@ -0,0 +1,265 @@
+#include "bench.h"
+#include <asl/Xdl.h>
+#include <asl/TextFile.h>
+#include <asl/Path.h>
+#include <asl/Random.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+using namespace asl;
+
+namespace {
+
+// Synthetic documents shaped like the usual JSON corpora, of about `size` bytes
+
+// canada.json: GeoJSON polygons, mostly arrays of coordinate pairs
+
+String canadaLike(int size)
+{
+	Random random(false);
+	Var polygons = Var::ARRAY;
+	int n = 0;
+	while (n < size)
+	{
+		Var ring = Var::ARRAY;
+		for (int i = 0; i < 1000; i++)
+			ring << array<Var>(random(-141.0, -52.0), random(41.0, 83.0));
+		polygons << Var("type", "Feature")("properties", Var("name", "Canada"))
+			("geometry", Var("type", "Polygon")("coordinates", array<Var>(ring)));
+		n += 40 * 1000;
+	}
+	return Json::encode(Var("type", "FeatureCollection")("features", polygons));
+}
+
+// twitter.json: pretty-printed statuses with text, unicode escapes, big ids, booleans and nulls
+
+String twitterLike(int size)
+{
+	Random random(false);
+	Var statuses = Var::ARRAY;
+	int n = 0;
+	while (n < size)
+	{
+		int id = random(1000000);
+		Var user = Var("id", 100000000.0 * random(1, 100) + id)("name", "user " + String(id))
+			("screen_name", "u" + String(id))("description", "Some description of the user é ñ")
+			("followers_count", random(100000))("verified", false)("url", Var::NUL)("lang", "ja");
+		statuses << Var("created_at", "Sun Aug 31 00:29:15 +0000 2014")("id", 505874924095815681.0 + id)
+			("text", "@aym0566x \n\nnombre: é \"quoted\" https://t.co/" + String(id) + " やっと")
+			("source", "<a href=\"http://twitter.com/download/iphone\" rel=\"nofollow\">Twitter for iPhone</a>")
+			("truncated", false)("in_reply_to_status_id", Var::NUL)("user", user)("retweet_count", random(100))
+			("favorited", false)("entities", Var("hashtags", Var::ARRAY)("urls", Var::ARRAY));
+		n += 900;
+	}
+	String json = Json::encode(Var("statuses", statuses), Json::PRETTY);
+	return json.replace("\xc3\xa9", "\\u00e9");
+}
+
+// citm_catalog.json: objects keyed by numeric ids with small ints, arrays of ints and nulls
+
+String citmLike(int size)
+{
+	Random random(false);
+	Var events = Var::OBJ, areas = Var::OBJ;
+	int n = 0;
+	for (int id = 138586341; n < size; id++)
+	{
+		Var subTopics = Var::ARRAY;
+		for (int i = 0; i < 4; i++)
+			subTopics << 337184200 + random(1000);
+		events[String(id)] = Var("description", Var::NUL)("id", id)("logo", Var::NUL)("name", "Event " + String(id))
+			("subTopicIds", subTopics)("subjectCode", Var::NUL)("subtitle", Var::NUL)("topicIds", array<Var>(324846099, 107888604));
+		areas[String(id % 1000)] = Var("areaId", id % 1000)("blockIds", Var::ARRAY);
+		n += 230;
+	}
+	return Json::encode(Var("events", events)("areaNames", areas), Json::PRETTY);
+}
+
+// Returns the best throughput in MB/s of decoding `json` several times with `decode`
+
+template<class F>
+double decodeSpeed(const String& json, F decode)
+{
+	double best = 1e10;
+	for (int i = 0; i < 3; i++)
+	{
+		double t1 = now();
+		Var v = decode(json);
+		double t = now() - t1;
+		if (!v.ok())
+			return 0;
+		best = min(best, t);
+	}
+	return json.length() / best / 1e6;
+}
+
+void decodeBench(const String& name, const String& json)
+{
+	double fast = decodeSpeed(json, [](const String& s) { return Json::decode(s); });
+	double xdl = decodeSpeed(json, [](const String& s) { XdlParser parser; return parser.decode(s); });
+	printf("%-14s %6.1f MB  Json::decode %7.1f MB/s  XdlParser %7.1f MB/s  x%.1f\n", *name, json.length() / 1e6, fast,
+	       xdl, fast / max(xdl, 1e-6));
+}
+
+
+// Sums the values of all properties with a given name, at any depth
+
+struct FieldSum : public JsonHandler
+{
+	const char* field;
+	bool inField;
+	double sum;
+	int count;
+	FieldSum(const char* name) : field(name), inField(false), sum(0), count(0) {}
+	bool new_property(const JsonStr& name) { inField = name == field; return true; }
+	bool new_number(int x) { return new_number((double)x); }
+	bool new_number(double x)
+	{
+		if (inField)
+		{
+			sum += x;
+			count++;
+			inField = false;
+		}
+		return true;
+	}
+};
+
+double sumField(const Var& v, const String& field, int& count)
+{
+	double sum = 0;
+	if (v.is(Var::ARRAY))
+	{
+		for (int i = 0; i < v.length(); i++)
+			sum += sumField(v[i], field, count);
+	}
+	else if (v.is(Var::OBJ))
+	{
+		foreach2(String& name, Var& x, v)
+		{
+			if (name == field && x.is(Var::NUMBER))
+			{
+				sum += (double)x;
+				count++;
+			}
+			else
+				sum += sumField(x, field, count);
+		}
+	}
+	return sum;
+}
+
+void extractBench(const String& name, const String& json, const char* field)
+{
+	double best1 = 1e10, best2 = 1e10;
+	int count1 = 0, count2 = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		double t1 = now();
+		count1 = 0;
+		sumField(Json::decode(json), field, count1);
+		double t2 = now();
+		FieldSum handler(field);
+		Json::parse(json, handler);
+		count2 = handler.count;
+		double t3 = now();
+		best1 = min(best1, t2 - t1);
+		best2 = min(best2, t3 - t2);
+	}
+	printf("%-14s %-16s %6i found  Json::decode %7.1f MB/s  Json::parse %7.1f MB/s  x%.1f%s\n", *name, field, count2,
+	       json.length() / best1 / 1e6, json.length() / best2 / 1e6, best1 / best2, count1 != count2 ? "  MISMATCH" : "");
+}
+
+}
+
+// Extracting one field from documents with a JsonHandler against decoding them into a Var and searching it
+// args: [megabytes=16]
+
+ASL_BENCHMARK(JsonExtract)
+{
+	int size = benchArg(args, 0, 16) * 1000000;
+	extractBench("twitter-like", twitterLike(size), "followers_count");
+	extractBench("citm-like", citmLike(size), "id");
+}
+
+// Decoding throughput of Json::decode against XdlParser on synthetic corpora or given files
+// args: [megabytes=16] [files...]
+
+ASL_BENCHMARK(JsonDecode)
+{
+	int size = benchArg(args, 0, 16) * 1000000;
+	if (args.length() > 1)
+	{
+		for (int i = 1; i < args.length(); i++)
+			decodeBench(Path(args[i]).name(), TextFile(args[i]).text());
+		return;
+	}
+	decodeBench("canada-like", canadaLike(size));
+	decodeBench("twitter-like", twitterLike(size));
+	decodeBench("citm-like", citmLike(size));
+}
+
+// Formatting and parsing doubles with mydtoa/myatof against snprintf/strtod, and through Json::encode/decode
+// args: [count=10000000]
+
+ASL_BENCHMARK(DoubleFormat)
+{
+	int count = benchArg(args, 0, 10000000);
+	Random random(false);
+	Array<double> values(count);
+	for (int i = 0; i < count; i++)
+		values[i] = (i % 3 == 0) ? floor(random(-1e6, 1e6)) / 100 : // prices and the like
+		            (i % 3 == 1) ? random(-180.0, 180.0) : random(-1.0, 1.0) * exp(random(-300.0, 300.0));
+
+	String text;
+	text.resize(count * 25);
+	char* p = text.data();
+	double t1 = now();
+	for (int i = 0; i < count; i++)
+	{
+		p += mydtoa(values[i], p);
+		*p++ = ',';
+	}
+	double t2 = now();
+	text.fix(int(p - text.data()));
+	char s[32];
+	int length = 0;
+	for (int i = 0; i < count; i++)
+		length += snprintf(s, sizeof(s), "%.17g", values[i]);
+	double t3 = now();
+	printf("format  mydtoa %6.1f M/s  snprintf %%.17g %6.1f M/s  x%.1f  (%.1f vs %.1f chars)\n", count / (t2 - t1) / 1e6,
+	       count / (t3 - t2) / 1e6, (t3 - t2) / (t2 - t1), text.length() / (double)count - 1, length / (double)count);
+
+	int wrong1 = 0, wrong2 = 0;
+	t1 = now();
+	p = text.data();
+	for (int i = 0; i < count; i++)
+	{
+		if (myatof(p) != values[i])
+			wrong1++;
+		p = strchr(p, ',') + 1;
+	}
+	t2 = now();
+	p = text.data();
+	for (int i = 0; i < count; i++)
+	{
+		if (strtod(p, &p) != values[i])
+			wrong2++;
+		p++;
+	}
+	t3 = now();
+	printf("parse   myatof %6.1f M/s  strtod         %6.1f M/s  x%.1f  %i/%i not round-tripped\n", count / (t2 - t1) / 1e6,
+	       count / (t3 - t2) / 1e6, (t3 - t2) / (t2 - t1), wrong1, wrong2);
+
+	Var array = Var::ARRAY;
+	for (int i = 0; i < count; i++)
+		array << values[i];
+	t1 = now();
+	String json = Json::encode(array);
+	t2 = now();
+	Var decoded = Json::decode(json);
+	t3 = now();
+	printf("Json    encode %6.1f M/s  decode         %6.1f M/s  %.1f MB%s\n", count / (t2 - t1) / 1e6,
+	       count / (t3 - t2) / 1e6, json.length() / 1e6, decoded == array ? "" : "  MISMATCH");
+}
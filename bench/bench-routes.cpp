@@ -0,0 +1,74 @@
+#include "bench.h"
+#include <asl/HttpServer.h>
+#include <asl/Thread.h>
+
+using namespace asl;
+
+// Route dispatch with many routes: chain of request.is() checks vs the HttpServer route table
+// args: [routes=500] [iterations=200000]
+
+ASL_BENCHMARK(HttpRoutes)
+{
+	int nroutes = benchArg(args, 0, 500);
+	int iterations = benchArg(args, 1, 200000);
+	int nreq = 1000, port = 9104;
+
+	HttpServer server;
+	Array<String> patterns;
+	int hits = 0;
+	for (int i = 0; i < nroutes; i++)
+	{
+		patterns << String::f("/api/resource%i/*", i);
+		server.route("GET", String::f("/api/resource%i/:id", i), [&](HttpRequest&, HttpResponse&) { hits++; });
+	}
+
+	// parse a set of requests to real HttpRequest objects
+	Socket listener;
+	if (!listener.bind("127.0.0.1", port))
+	{
+		printf("Cannot bind port %i\n", port);
+		return;
+	}
+	listener.listen();
+	Thread client([=]() {
+		Socket s;
+		if (!s.connect("127.0.0.1", port))
+			return;
+		String reqs;
+		for (int i = 0; i < nreq; i++)
+			reqs << String::f("GET /api/resource%i/%i HTTP/1.1\r\nHost: localhost\r\n\r\n", (i * 7919) % nroutes, i);
+		s.write(*reqs, reqs.length());
+		s.waitInput(10);
+	});
+	Socket conn = listener.accept();
+	Array<HttpRequest> requests;
+	for (int i = 0; i < nreq; i++)
+	{
+		requests << HttpRequest(conn);
+		requests.last().read();
+	}
+	conn.close();
+	client.join();
+	HttpResponse response(requests[0]);
+
+	double t1 = now();
+	for (int i = 0; i < iterations; i++)
+	{
+		HttpRequest& request = requests[i % nreq];
+		for (int j = 0; j < patterns.length(); j++)
+		{
+			if (request.is("GET", patterns[j]))
+			{
+				hits++;
+				break;
+			}
+		}
+	}
+	double t2 = now();
+	for (int i = 0; i < iterations; i++)
+		server.dispatch(requests[i % nreq], response);
+	double t3 = now();
+
+	printf("%i routes  is() chain %8.3f us/request  route table %8.3f us/request  (%i hits)\n", nroutes,
+	       (t2 - t1) / iterations * 1e6, (t3 - t2) / iterations * 1e6, hits);
+}
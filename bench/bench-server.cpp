@@ -0,0 +1,187 @@
+#include "bench.h"
+#include <asl/HttpServer.h>
+
+using namespace asl;
+
+namespace {
+
+class BenchServer : public HttpServer
+{
+public:
+	void serve(HttpRequest& request, HttpResponse& response)
+	{
+		response.put("ok");
+	}
+};
+
+bool readResponse(Socket& s)
+{
+	String line = s.readLine();
+	if (!line.startsWith("HTTP/1.1 200"))
+		return false;
+	int length = 0;
+	while (line = s.readLine(), line.ok() && line != "\r")
+	{
+		if (line.toLowerCase().startsWith("content-length:"))
+			length = line.substring(15).trim();
+	}
+	return s.read(length).length() == length;
+}
+
+// Opens `nconn` keep-alive connections and sends `rounds` requests on each of them, all in flight at the same time
+
+void runClients(int port, int nconn, int rounds, const char* name)
+{
+	Array<Socket> conns;
+	for (int i = 0; i < nconn; i++)
+	{
+		Socket s;
+		if (!s.connect("127.0.0.1", port))
+			break;
+		conns << s;
+	}
+	Array<double> latency, t0(conns.length());
+	Array<bool> alive(conns.length(), true);
+	String req = "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+	double t1 = now();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (int i = 0; i < conns.length(); i++)
+		{
+			t0[i] = now();
+			if (alive[i] && conns[i].write(*req, req.length()) != req.length())
+				alive[i] = false;
+		}
+		for (int i = 0; i < conns.length(); i++)
+		{
+			if (!alive[i])
+				continue;
+			if (!conns[i].waitData(10) || !readResponse(conns[i]))
+				alive[i] = false;
+			else
+				latency << now() - t0[i];
+		}
+	}
+	double t = now() - t1;
+	int served = 0;
+	for (int i = 0; i < alive.length(); i++)
+		if (alive[i])
+			served++;
+	printf("%-8s %5i/%i connections served  %8.0f req/s  p50 %7.2f ms  p99 %7.2f ms\n", name, served, nconn,
+	       latency.length() / t, percentile(latency, 0.5) * 1e3, percentile(latency, 0.99) * 1e3);
+	foreach (Socket& s, conns)
+		s.close();
+}
+
+// Sends `total` requests on one connection, `depth` at a time in a single write, and returns requests per second
+
+double runPipelined(int port, int total, int depth)
+{
+	Socket s;
+	if (!s.connect("127.0.0.1", port))
+		return 0;
+	String req = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n", batch;
+	for (int i = 0; i < depth; i++)
+		batch += req;
+	double t1 = now();
+	int done = 0;
+	while (done < total)
+	{
+		if (s.write(*batch, batch.length()) != batch.length())
+			break;
+		int i = 0;
+		for (; i < depth; i++)
+			if (!readResponse(s))
+				break;
+		done += i;
+		if (i < depth)
+			break;
+	}
+	s.close();
+	return done / (now() - t1);
+}
+
+}
+
+// HTTP/1.1 pipelining: throughput on a single keep-alive connection with several requests in flight
+// args: [requests=20000] [depth=16]
+
+ASL_BENCHMARK(HttpPipelining)
+{
+	int total = benchArg(args, 0, 20000);
+	int depth = benchArg(args, 1, 16);
+	BenchServer server;
+	int port = 9103;
+	if (!server.bind("127.0.0.1", port))
+	{
+		printf("Cannot bind port %i\n", port);
+		return;
+	}
+	server.start(true);
+	sleep(0.2);
+	printf("depth %3i  %8.0f req/s\n", 1, runPipelined(port, total / 4, 1));
+	printf("depth %3i  %8.0f req/s\n", depth, runPipelined(port, total, depth));
+	server.stop(true);
+}
+
+// Sequential small GETs with Http::get, with a new connection per request vs pooled keep-alive connections
+// args: [requests=2000]
+
+ASL_BENCHMARK(HttpClient)
+{
+	int total = benchArg(args, 0, 2000);
+	BenchServer server;
+	int port = 9105;
+	if (!server.bind("127.0.0.1", port))
+	{
+		printf("Cannot bind port %i\n", port);
+		return;
+	}
+	server.start(true);
+	sleep(0.2);
+	String url = "http://127.0.0.1:" + String(port) + "/";
+	for (int pooled = 0; pooled < 2; pooled++)
+	{
+		Http::setConnectionPool(pooled ? 4 : 0);
+		Array<double> latency;
+		int ok = 0;
+		double t1 = now();
+		for (int i = 0; i < total; i++)
+		{
+			double t0 = now();
+			if (Http::get(url).text() == "ok")
+				ok++;
+			latency << now() - t0;
+		}
+		double t = now() - t1;
+		printf("%-8s %5i/%i ok  %8.0f req/s  p50 %7.3f ms  p99 %7.3f ms\n", pooled ? "pooled" : "new", ok, total,
+		       total / t, percentile(latency, 0.5) * 1e3, percentile(latency, 0.99) * 1e3);
+	}
+	Http::setConnectionPool(0);
+	server.stop(true);
+}
+
+// Thread-per-connection vs epoll reactor: connection capacity and latency with many concurrent keep-alive clients
+// args: [connections=1000] [rounds=5]
+
+ASL_BENCHMARK(HttpReactor)
+{
+	int nconn = benchArg(args, 0, 1000);
+	int rounds = benchArg(args, 1, 5);
+	for (int mode = 0; mode < 2; mode++)
+	{
+		BenchServer server;
+		int port = 9100 + mode;
+		if (mode == 1)
+			server.setReactor(4);
+		if (!server.bind("127.0.0.1", port))
+		{
+			printf("Cannot bind port %i\n", port);
+			continue;
+		}
+		server.start(true);
+		sleep(0.2);
+		runClients(port, nconn, rounds, mode == 0 ? "threads" : "reactor");
+		server.stop(true);
+	}
+}
@@ -0,0 +1,160 @@
+#include "bench.h"
+#include <asl/Http.h>
+#include <asl/Thread.h>
+
+using namespace asl;
+
+namespace {
+
+// A socket that counts the receive-side system calls done on it
+
+int g_syscalls = 0;
+
+struct CountingSocket_ : public Socket_
+{
+	CountingSocket_(int fd) : Socket_(fd) {}
+	Socket_* accept()
+	{
+		Socket_* s = Socket_::accept();
+		int fd = s->_handle;
+		s->_handle = -1;
+		delete s;
+		return new CountingSocket_(fd);
+	}
+	int readRaw(void* data, int size)
+	{
+		g_syscalls++;
+		return Socket_::readRaw(data, size);
+	}
+	int availableRaw()
+	{
+		g_syscalls++;
+		return Socket_::availableRaw();
+	}
+	bool waitInput(double t)
+	{
+		if (buffered() == 0)
+			g_syscalls++; // select
+		return Socket_::waitInput(t);
+	}
+};
+
+}
+
+// Parses pipelined HTTP requests from a connection and reports receive syscalls and time per request
+// args: [requests=10000]
+
+ASL_BENCHMARK(SocketReadLine)
+{
+	int nreq = benchArg(args, 0, 10000);
+	int port = 9102;
+	Socket server(new CountingSocket_(-1));
+	if (!server.bind("127.0.0.1", port))
+	{
+		printf("Cannot bind port %i\n", port);
+		return;
+	}
+	server.listen();
+
+	String req = "GET /index.html?a=1 HTTP/1.1\r\nHost: localhost\r\nUser-Agent: asl-bench\r\n"
+		"Accept: text/html,application/xhtml+xml\r\nAccept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate\r\nConnection: keep-alive\r\n\r\n";
+	String batch;
+	for (int i = 0; i < 100; i++)
+		batch += req;
+
+	Thread client([=]() {
+		Socket s;
+		if (!s.connect("127.0.0.1", port))
+			return;
+		for (int i = 0; i < nreq; i += 100)
+			s.write(*batch, batch.length());
+		s.waitInput(10);
+		s.close();
+	});
+
+	Socket conn = server.accept();
+	g_syscalls = 0;
+	double t1 = now();
+	int parsed = 0;
+	for (; parsed < nreq; parsed++)
+	{
+		HttpRequest request(conn);
+		request.read();
+		if (request.method() != "GET" || request.header("Connection") != "keep-alive")
+			break;
+	}
+	double t = now() - t1;
+	conn.close();
+	client.join();
+	server.close();
+	printf("%i requests parsed  %6.2f syscalls/request  %6.2f us/request\n", parsed, (double)g_syscalls / max(parsed, 1),
+	       t / max(parsed, 1) * 1e6);
+}
+
+// Sends datagrams over loopback from a thread and receives them one per call or in batches
+
+static void udpRun(bool batched, int npackets, int batchSize, int port)
+{
+	PacketSocket receiver;
+	if (!receiver.bind("127.0.0.1", port))
+	{
+		printf("Cannot bind port %i\n", port);
+		return;
+	}
+	double sendTime = 0;
+	Thread sender([=, &sendTime]() {
+		PacketSocket s;
+		InetAddress to("127.0.0.1", port);
+		ByteArray data(64, 'x');
+		PacketBatch batch(batchSize, 64);
+		double t1 = now();
+		for (int i = 0; i < npackets;)
+		{
+			if (!batched)
+			{
+				s.sendTo(to, data);
+				i++;
+				continue;
+			}
+			batch.clear();
+			for (int j = 0; j < batchSize && i + j < npackets; j++)
+				batch.add(to, data);
+			i += batch.length();
+			s.sendBatch(batch);
+		}
+		sendTime = now() - t1;
+	});
+
+	PacketBatch batch(batchSize, 2048);
+	ByteArray buffer(2048);
+	InetAddress from;
+	int received = 0, calls = 0;
+	double t1 = 0, t2 = 0;
+	while (received < npackets && receiver.waitInput(0.5))
+	{
+		if (received == 0)
+			t1 = now();
+		int n = batched ? receiver.readBatch(batch) : (receiver.readFrom(from, buffer.data(), buffer.length()) >= 0 ? 1 : -1);
+		if (n <= 0)
+			break;
+		received += n;
+		calls++;
+		t2 = now();
+	}
+	sender.join();
+	double t = max(t2 - t1, 1e-6);
+	printf("%-6s sent %8.0f packets/s  received %i/%i  %8.0f packets/s  %5.1f packets/call\n", batched ? "batch" : "single",
+	       npackets / max(sendTime, 1e-6), received, npackets, received / t, (double)received / max(calls, 1));
+}
+
+// Compares UDP throughput with one datagram per system call against readBatch()/sendBatch()
+// args: [packets=200000] [batch=64]
+
+ASL_BENCHMARK(UdpBatch)
+{
+	int npackets = benchArg(args, 0, 200000);
+	int batchSize = benchArg(args, 1, 64);
+	udpRun(false, npackets, batchSize, 9108);
+	udpRun(true, npackets, batchSize, 9108);
+}
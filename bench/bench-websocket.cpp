@@ -0,0 +1,166 @@
+#include "bench.h"
+#include <asl/WebSocket.h>
+#include <asl/Thread.h>
+#include <asl/TextFile.h>
+
+using namespace asl;
+
+namespace {
+
+class EchoServer : public WebSocketServer
+{
+public:
+	void serve(WebSocket& ws)
+	{
+		while (!ws.closed())
+		{
+			if (!ws.waitData(0.5))
+				continue;
+			ByteArray msg = ws.receive();
+			if (msg.length() > 0)
+				ws.send(msg);
+		}
+	}
+};
+
+class AsyncEchoServer : public WebSocketServer
+{
+public:
+	void onMessage(WebSocket& ws, const WebSocketMsg& msg)
+	{
+		ByteArray data = msg;
+		ws.send(data);
+	}
+};
+
+// Linux process status field (threads, resident memory) or "?"
+String procStatus(const char* name)
+{
+	Array<String> lines = TextFile("/proc/self/status").lines();
+	foreach(String& line, lines)
+		if (line.startsWith(name))
+			return line.substring((int)strlen(name) + 1).trimmed();
+	return "?";
+}
+
+}
+
+// Echo throughput for binary WebSocket messages: the client masks each message, the server unmasks it and sends
+// it back unmasked; one thread sends while another receives.
+// args: [megabytes per size=256] [sizes=1024 65536 1048576]
+
+ASL_BENCHMARK(WebSocketThroughput)
+{
+	int megabytes = benchArg(args, 0, 256);
+	Array<int> sizes;
+	for (int i = 1; i < args.length(); i++)
+		sizes << (int)args[i];
+	if (sizes.length() == 0)
+		sizes << 1024 << 65536 << 1048576;
+	int port = 9106;
+
+	EchoServer server;
+	if (!server.bind("127.0.0.1", port))
+	{
+		printf("Cannot bind port %i\n", port);
+		return;
+	}
+	server.start(true);
+	sleep(0.2);
+
+	foreach(int size, sizes)
+	{
+		WebSocket ws;
+		if (!ws.connect(String::f("ws://127.0.0.1:%i", port)))
+		{
+			printf("Cannot connect\n");
+			break;
+		}
+		int count = max(1, int((Long)megabytes * 1024 * 1024 / size));
+		ByteArray message(size);
+		for (int i = 0; i < size; i++)
+			message[i] = byte(i * 31);
+
+		double t0 = now();
+		Thread sender([&]() {
+			for (int i = 0; i < count; i++)
+				ws.send(message);
+		});
+		int received = 0;
+		bool ok = true;
+		while (received < count && ws.waitData(10))
+		{
+			ByteArray echo = ws.receive();
+			if (echo.length() != size || echo[size - 1] != message[size - 1])
+				ok = false;
+			received++;
+		}
+		sender.join();
+		double t = now() - t0;
+		printf("%8i bytes: %7i messages %s in %.3f s, %8.0f msg/s, %7.1f MB/s each way\n", size, received,
+			ok && received == count ? "ok" : "FAILED", t, received / t, received * (double)size / t / (1024 * 1024));
+		ws.close();
+	}
+
+	server.stop(true);
+}
+
+// Many mostly idle connections served asynchronously by a reactor server: connection time, threads and memory used,
+// and the time for every client to get an echo of one message. Both ends live in this process, so the file
+// descriptor limit must exceed twice the number of connections.
+// args: [connections=5000] [reactor threads=4]
+
+ASL_BENCHMARK(WebSocketConnections)
+{
+	int n = benchArg(args, 0, 5000);
+	int nthreads = benchArg(args, 1, 4);
+	int port = 9107;
+
+	AsyncEchoServer server;
+	server.setReactor(nthreads);
+	if (!server.bind("127.0.0.1", port))
+	{
+		printf("Cannot bind port %i\n", port);
+		return;
+	}
+	server.start(true);
+	sleep(0.2);
+	String threads0 = procStatus("Threads:"), memory0 = procStatus("VmRSS:");
+
+	Array<WebSocket*> clients;
+	double t0 = now();
+	for (int i = 0; i < n; i++)
+	{
+		WebSocket* ws = new WebSocket;
+		if (!ws->connect(String::f("ws://127.0.0.1:%i", port)))
+		{
+			printf("Cannot connect client %i\n", i);
+			delete ws;
+			break;
+		}
+		clients << ws;
+	}
+	double t1 = now();
+	for (int i = 0; i < 100 && server.clients().length() < clients.length(); i++)
+		sleep(0.05);
+	printf("%i connections in %.3f s, threads %s -> %s, memory %s -> %s\n", server.clients().length(), t1 - t0,
+		*threads0, *procStatus("Threads:"), *memory0, *procStatus("VmRSS:"));
+
+	ByteArray message(100);
+	t0 = now();
+	foreach(WebSocket* ws, clients)
+		ws->send(message);
+	int echoed = 0;
+	foreach(WebSocket* ws, clients)
+		if (ws->waitData(5) && ws->receive().length() == message.length())
+			echoed++;
+	t1 = now();
+	printf("%i/%i echoes in %.3f s, %.0f msg/s\n", echoed, clients.length(), t1 - t0, echoed / (t1 - t0));
+
+	foreach(WebSocket* ws, clients)
+	{
+		ws->close();
+		delete ws;
+	}
+	server.stop(true);
+}
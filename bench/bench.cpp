@@ -0,0 +1,44 @@
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+namespace asl {
+
+static BenchInfo benchmarks[64];
+static int numBenchmarks = 0;
+
+int addBenchmark(const char* name, void (*func)(const Array<String>&))
+{
+	BenchInfo info = { name, func };
+	benchmarks[numBenchmarks++] = info;
+	return 0;
+}
+
+}
+
+using namespace asl;
+
+int main(int narg, char* argv[])
+{
+	Array<String> args;
+	for (int i = 2; i < narg; i++)
+		args << argv[i];
+
+	for (int i = 0; i < numBenchmarks; i++)
+	{
+		if (narg < 2 || strcmp(benchmarks[i].name, argv[1]) == 0)
+		{
+			printf("%s:\n", benchmarks[i].name);
+			benchmarks[i].func(args);
+			printf("\n");
+			if (narg >= 2)
+				return EXIT_SUCCESS;
+		}
+	}
+	if (narg >= 2)
+	{
+		printf("Unknown benchmark\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
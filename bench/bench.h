@@ -0,0 +1,46 @@
+// Copyright(c) 1999-2026 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASL_BENCH_H
+#define ASL_BENCH_H
+
+#include <asl/Array.h>
+#include <asl/String.h>
+#include <asl/time.h>
+#include <stdio.h>
+
+// Minimal registry for benchmarks, each one is run as `benchmarks <Name> [args]`
+
+namespace asl {
+
+struct BenchInfo { const char* name; void (*func)(const Array<String>&); };
+
+int addBenchmark(const char* name, void (*func)(const Array<String>&));
+
+/**
+Returns the value at fraction `p` (0..1) of the sorted samples
+*/
+inline double percentile(Array<double> samples, double p)
+{
+	if (samples.length() == 0)
+		return 0;
+	samples.sort();
+	return samples[min(samples.length() - 1, int(p * samples.length()))];
+}
+
+/**
+Returns argument `i` as a number or the default value `x` if missing
+*/
+inline int benchArg(const Array<String>& args, int i, int x)
+{
+	return i < args.length() ? (int)args[i] : x;
+}
+
+}
+
+#define ASL_BENCHMARK(Name) \
+void asl_bench_##Name(const asl::Array<asl::String>& args);\
+int asl_bx_##Name = asl::addBenchmark(#Name, &asl_bench_##Name); \
+void asl_bench_##Name(const asl::Array<asl::String>& args)
+
+#endif
@@ -8,6 +8,7 @@
 #include <asl/String.h>
 #include <asl/Pointer.h>
 #include <asl/Var.h>
+#include <asl/Xdl.h>
 #include <asl/util.h>
 
 namespace asl {
@@ -101,6 +102,8 @@ Base class of HttpRequest and HttpResponse with common functionality.
 class ASL_API HttpMessage
 {
 	friend class Http;
+	friend struct HttpSinkDeflate;
+	friend struct HttpSinkInflate;
 public:
 	HttpMessage();
 
@@ -160,6 +163,11 @@ public:
 	*/
 	void put(const File& file);
 	/**
+	Sends a Var as a JSON body in chunks while it is encoded, so the first bytes go out early and the full text is
+	never held in memory; the message must not have a Content-Length.
+	*/
+	bool writeJson(const Var& data, Json::Mode mode = Json::NONE);
+	/**
 	Returns the binary body of the message.
 	*/
 	const ByteArray& body() const { return _body; }
@@ -168,7 +176,9 @@ public:
 	*/
 	String text() const { return String(_body); }
 	/**
-	Returns the message body interpreted as JSON
+	Returns the message body interpreted as JSON, or as a URL query if it is not valid JSON. A body not read in
+	advance (see `HttpServer::setStreamBodies()`) is read and decoded in blocks, without holding a JSON object or
+	array whole in memory, and the result is a null Var if it is larger than the maximum size (see `setMaxSize()`).
 	*/
 	Var json() const;
 
@@ -187,6 +197,10 @@ public:
 	*/
 	int write(const void* buffer, int n);
 	/**
+	Ends a body that was sent in chunks (without a Content-Length), flushing the compressor if used
+	*/
+	void finish();
+	/**
 	Sends the content of the given file in the message body
 	*/
 	void writeFile(const String& path, int begin = 0, int end = 0);
@@ -205,9 +219,30 @@ public:
 
 	int status() const { return _status ? _status->status : 0; }
 
+	/**
+	Reads the next part of a body that was not read in advance (a streamed request body, see
+	`HttpServer::setStreamBodies()`), up to `n` bytes into `buffer`. Returns the number of bytes read, 0 at
+	the end of the body or -1 on error.
+	~~~
+	byte buffer[16384];
+	int n;
+	while ((n = request.readBody(buffer, sizeof(buffer))) > 0)
+		file.write(buffer, n);
+	~~~
+	*/
+	int readBody(void* buffer, int n);
+	/**
+	Returns true if there is still body data to be read with `readBody(buffer, n)`
+	*/
+	bool bodyPending() const { return _bodyPending; }
+
 protected:
 	void readHeaders();
 	void readBody();
+	void beginBody();
+	String headerBlock();
+	int writeBlock(const void* buffer, int n, const String& head);
+	bool compressible(int size);
 	String _command;
 	String _proto;
 	Dic<> _headers;
@@ -221,6 +256,26 @@ protected:
 	Shared<HttpStatus> _status;
 	String _socketError;
 	int _maxSize;
+	bool _bodyPending;
+	bool _bodyStarted;
+	bool _bodyChunked;
+	Long _bodyLeft;
+	int _compressLevel;
+	int _compressMin;
+	String _encoding;
+	Shared<HttpSink> _encoder;
+};
+
+/**
+An XdlSink that writes to the body of an HttpMessage, as chunks unless it has a Content-Length. Call the message's
+`finish()` after the last write (servers do it after the handler returns).
+\ingroup HTTP
+*/
+struct ASL_API XdlSinkHttp : public XdlSink
+{
+	HttpMessage& message;
+	XdlSinkHttp(HttpMessage& m, int flushSize = 16384) : XdlSink(flushSize), message(m) {}
+	bool write(String& s);
 };
 
 
@@ -275,9 +330,15 @@ public:
 	{
 		_recursion = 0;
 		_followRedirects = true;
+		_deferBody = false;
 	}
 	
 	void read();
+
+	/**
+	Returns true if the request's Accept-Encoding header includes the given encoding (e.g. "gzip")
+	*/
+	bool acceptsEncoding(const char* name) const;
 	
 	const String& resource() const
 	{
@@ -333,6 +394,20 @@ public:
 		return _argument;
 	}
 	/**
+	Returns the value of a path parameter captured by an HttpServer route, e.g. `id` in `"/api/users/:id"`
+	*/
+	String param(const String& name) const
+	{
+		return _params.get(name, String());
+	}
+	/**
+	Returns all path parameters captured by an HttpServer route
+	*/
+	const Dic<>& params() const
+	{
+		return _params;
+	}
+	/**
 	Returns the address of the remote host (the client)
 	*/
 	const InetAddress& sender()
@@ -363,6 +438,7 @@ public:
 	*/
 	const String& query(const String& key) { return query()[key]; }
 	friend class HttpResponse;
+	friend class HttpServer;
 
 	// [deprecated]
 	ASL_DEPRECATED(const Array<String>& parts() const, "?") { return _parts; }
@@ -379,6 +455,7 @@ public:
 	bool followRedirects() const { return _followRedirects; }
 
 protected:
+	void readContent();
 	String _method;
 	String _url;
 	String _res;
@@ -389,8 +466,10 @@ protected:
 	String _fragment;
 	Dic<> _query;
 	String _argument;
+	Dic<> _params;
 	int _recursion;
 	bool _followRedirects;
+	bool _deferBody;
 };
 
 /**
@@ -444,8 +523,16 @@ public:
 	*/
 	String socketError() const { return _socketError; }
 
+	/**
+	Enables compressing the body with gzip or deflate (whichever the client accepts) at the given zlib level
+	(1-9, 0 disables), for text, JSON, JavaScript and XML bodies of at least `minSize` bytes. Bodies of unknown
+	length are compressed as they are written in chunks. Requires building with ASL_ZLIB.
+	*/
+	void setCompression(int level, int minSize = 1024);
+
 protected:
 	int _code;
+	String _acceptEncoding;
 };
 
 
@@ -514,6 +601,9 @@ Http::download("http://someserver/some/large/file.zip", "./file.zip", [=](const
 });
 ~~~
 
+When built with ASL_ZLIB, requests advertise gzip and deflate support (unless they set their own Accept-Encoding
+header) and compressed responses are decompressed transparently.
+
 Using **IPv6** addresses is supported with square brackets in the host part `[ipv6]:port`:
 
 ~~~
@@ -583,6 +673,19 @@ public:
 	* Uploads (POST) to the given URL the file specified, optionally notifying progress (uses `multipart/form-data` unless a specific `Content-Type` is given)
 	*/
 	static bool upload(const String& url, const String& path, const Dic<>& headers = Dic<>(), const Function<void, const HttpStatus&>& f = Progress());
+
+	/**
+	Enables reusing connections: after a complete response, the connection is kept open (up to `maxIdle` idle
+	connections per host, for up to `idleTimeout` seconds) and used by later requests to the same host, avoiding
+	new TCP and TLS handshakes. Idle connections closed by the server are detected and discarded before reuse.
+	Pooling is disabled by default (`maxIdle` = 0).
+	*/
+	static void setConnectionPool(int maxIdle, double idleTimeout = 30);
+
+	/**
+	Closes all idle pooled connections
+	*/
+	static void closeIdleConnections();
 };
 
 }
@@ -12,6 +12,15 @@
 namespace asl {
 
 class WebSocketServer;
+struct HttpFileCache;
+struct HttpRouteNode;
+struct HttpRoute;
+
+/**
+A request handler function for HttpServer routes
+\ingroup HTTP
+*/
+typedef Function<void, HttpRequest&, HttpResponse&> HttpHandler;
 
 /**
 This class can be used to create application-specific HTTP servers.
@@ -58,7 +67,44 @@ public:
 
 A server like that will respond to requests such as `/api/clients/132337` or `/api/icon?id=12`.
 
+Instead of a chain of `request.is()` checks, handlers can be registered as routes. Routes are compiled into a
+prefix tree, so finding the handler takes time proportional to the path length, independent of the number of
+routes. A pattern segment like `:id` captures a path parameter and a final `*` matches any remainder (available
+as `request.suffix()`). Requests not matching any route go to `serve()`.
+
+~~~
+server.route("GET", "/api/clients/:id", [&](HttpRequest& request, HttpResponse& response) {
+	response.put(getInfo(request.param("id")));
+});
+server.route("GET", "*", [&](HttpRequest& request, HttpResponse& response) { // any other path
+	response.put("No page at /" + request.suffix());
+});
+~~~
+
+Request bodies are normally read completely into memory before the handler runs. Routes registered with
+`stream = true` (or all requests, with `setStreamBodies()`) get the body unread instead, so that the handler
+can consume it piece by piece with `request.readBody(buffer, n)`, for example to hash it or write it to disk
+with constant memory. Streamed bodies are not limited by `setMaxUploadSize()`, except when decoded with `json()`.
+
+~~~
+server.route("PUT", "/upload/:name", [&](HttpRequest& request, HttpResponse& response) {
+	File file(dir + "/" + request.param("name"), File::WRITE);
+	byte buffer[16384];
+	int n;
+	while ((n = request.readBody(buffer, sizeof(buffer))) > 0)
+		file.write(buffer, n);
+	response.put("done");
+}, true);
+~~~
+
 Each request is handled in a separate thread. So, you should probably use mutexes for synchronization.
+
+Static files can be kept in memory with `setFileCache()`, so that hot assets are served without reading the
+filesystem on each request. Precompressed `.gz` and `.br` siblings of cached files (e.g. `app.js.gz`) are
+served instead when the client accepts those encodings.
+
+For many concurrent keep-alive clients, `setReactor()` (Linux) serves all connections from a small fixed pool of
+threads instead of one thread per connection.
 \ingroup HTTP
 */
 
@@ -66,6 +112,7 @@ class ASL_API HttpServer: public SocketServer
 {
 public:
 	HttpServer(int port = -1);
+	~HttpServer();
 
 	/**
 	* Sets the root directory from where files will be served by default
@@ -90,18 +137,52 @@ public:
 	*/
 	void setCrossDomain(bool on) { _cors = on; }
 
+	/**
+	Registers a handler for requests with the given method (or `"*"` for any method) and path pattern. Patterns
+	consist of literal segments, `:name` segments that capture a path parameter, and an optional final `*`
+	matching the rest of the path. Literal segments take precedence over parameters, and these over `*`.
+	If `stream` is true the request body is not read in advance but left for the handler to read with
+	`request.readBody(buffer, n)`. Returns false, registering nothing, if a `*` is followed by more segments.
+	*/
+	bool route(const String& method, const String& pattern, const HttpHandler& handler, bool stream = false);
+	/**
+	Calls the handler of the route matching the request, if any, and returns true if there was one
+	*/
+	bool dispatch(HttpRequest& request, HttpResponse& response);
+
 	/**
 	Serves a static file from the configured root folder
 	*/
 	void serveFile(HttpRequest& request, HttpResponse& response);
 
+	/**
+	Enables an in-memory cache for files served with `serveFile()` using up to `maxBytes` bytes (0 disables it).
+	Least recently used files are evicted first, and files larger than a quarter of the budget are not cached.
+	Cached files are checked for modification on disk at most every `checkInterval` seconds.
+	*/
+	void setFileCache(int maxBytes, double checkInterval = 1.0);
+
 	/**
 	Sets the maximum body size that can be received in requests
 	*/
 	void setMaxUploadSize(int size) { _maxUploadSize = size; }
 
 	/**
-	Links this socket with the given WebSocket server to process incoming WebSocket connections
+	Enables or disables streamed request bodies for requests not matching a route: the body is not read before
+	calling `serve()` and can be read incrementally with `request.readBody(buffer, n)`. Parts not read by the
+	handler are discarded, or the connection is closed if too much was left.
+	*/
+	void setStreamBodies(bool on) { _streamBodies = on; }
+
+	/**
+	Enables gzip/deflate compression of text, JSON, JavaScript and XML responses of at least `minSize` bytes for
+	clients that accept it, at zlib `level` 1-9 (0 disables it). Requires building with ASL_ZLIB.
+	*/
+	void setCompression(int level, int minSize = 1024) { _compressLevel = level; _compressMin = minSize; }
+
+	/**
+	Links this socket with the given WebSocket server to process incoming WebSocket connections. In reactor mode the
+	upgraded connections are served asynchronously with the WebSocket server's callbacks (see WebSocketServer).
 	*/
 	void link(WebSocketServer& wsserver) { _wsserver = &wsserver; }
 
@@ -113,9 +194,23 @@ protected:
 	bool _cors;
 	WebSocketServer* _wsserver;
 	int _maxUploadSize;
+	HttpFileCache* _fileCache;
+	HttpRouteNode* _routes;
+	bool _streamBodies;
+	int _compressLevel;
+	int _compressMin;
+
+	/**
+	Reads and answers one request from the client, returns false if the connection must be closed
+	*/
+	bool serveRequest(Socket& client, bool async = false);
 
 private:
+	HttpRoute* findRoute(HttpRequest& request);
+	bool serveCachedFile(HttpRequest& request, HttpResponse& response, const String& localpath);
 	void serve(Socket client);
+	bool serveInput(Socket client);
+	void serveClose(Socket client);
 };
 }
 #endif
@@ -7,6 +7,8 @@
 
 namespace asl {
 
+struct XdlSink;
+
 /**
  * \defgroup XDL XML and JSON
  * @{
@@ -17,6 +19,60 @@ namespace asl {
 #pragma warning(disable : 26812)
 #endif
 
+/**
+A string found in a JSON document parsed with Json::parse(): a pointer into the input (or into a temporary buffer if
+the string had escape sequences) and a length. It is not null-terminated and is only valid during the handler call
+that receives it.
+*/
+struct JsonStr
+{
+	const char* data;
+	int length;
+	/** Returns true if this string equals `s` */
+	bool operator==(const char* s) const { int n = (int)strlen(s); return n == length && memcmp(data, s, n) == 0; }
+	bool operator!=(const char* s) const { return !(*this == s); }
+	/** Returns a copy as a String */
+	String toString() const { return String(data, length); }
+};
+
+/**
+Receives the items of a JSON document as Json::parse() finds them, without building a Var. Each function returns
+true to continue or false to stop parsing. Subclasses reimplement the ones they need; by default items are ignored.
+
+This handler sums the `price` properties in a document, wherever they are:
+
+~~~
+struct PriceSum : public JsonHandler
+{
+	bool isPrice = false;
+	double sum = 0;
+	bool new_property(const JsonStr& name) { isPrice = name == "price"; return true; }
+	bool new_number(int x) { return new_number((double)x); }
+	bool new_number(double x) { if (isPrice) sum += x; return true; }
+};
+
+PriceSum handler;
+Json::parse(json, handler);
+~~~
+*/
+class ASL_API JsonHandler
+{
+public:
+	virtual ~JsonHandler() {}
+	virtual bool begin_object() { return true; }
+	virtual bool end_object() { return true; }
+	virtual bool begin_array() { return true; }
+	virtual bool end_array() { return true; }
+	/** A property name; the next item is its value */
+	virtual bool new_property(const JsonStr& name) { return true; }
+	virtual bool new_string(const JsonStr& s) { return true; }
+	/** An integer of up to 9 characters (other numbers are given as `double`) */
+	virtual bool new_number(int x) { return true; }
+	virtual bool new_number(double x) { return true; }
+	virtual bool new_bool(bool x) { return true; }
+	virtual bool new_null() { return true; }
+};
+
 /**
 Functions to encode/decode data as JSON. These functions use class Var to represent JSON values. JSON parsing
 supports C/C++ style comments.
@@ -85,6 +141,12 @@ struct ASL_API Json
 	*/
 	static bool write(const Var& v, const String& file, Mode mode = PRETTY);
 
+	/**
+	Encodes a var as JSON writing it to a sink (such as a file, socket or HTTP message) as it is produced,
+	without building the whole text in memory; returns false if the sink failed
+	*/
+	static bool write(const Var& v, XdlSink& sink, Mode mode = NONE);
+
 	static ASL_DEPRECATED(bool write(const String& file, const Var& v, Mode mode = PRETTY), "Use Json::write(var, file)")
 	{
 		return write(v, file, mode);
@@ -96,6 +158,12 @@ struct ASL_API Json
 	*/
 	static Var decode(const String& json);
 
+	/**
+	Parses a strict JSON document calling the handler's functions for each item found, in order, without decoding
+	it into a Var. Returns false if the document is not valid JSON or the handler stopped.
+	*/
+	static bool parse(const String& json, JsonHandler& handler);
+
 	/**
 	Encodes the given Var into a JSON-format representation. It is similar to JavaScript's
 	`JSON.stringify()`.
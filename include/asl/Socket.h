@@ -23,6 +23,19 @@ struct SocketOptionException : public Exception
 };
 
 class Socket;
+class File;
+
+/**
+A memory block to send as part of a gathered write with Socket::write(const SocketBuf*, int)
+\ingroup Sockets
+*/
+struct SocketBuf
+{
+	const void* data;
+	int length;
+	SocketBuf() : data(0), length(0) {}
+	SocketBuf(const void* d, int n) : data(d), length(n) {}
+};
 
 class ASL_API Sockets
 {
@@ -118,6 +131,10 @@ ASL_SMART_CLASS(Socket, SmartObject)
 	String _hostname;
 	int _error;
 	bool _blocking;
+	ByteArray _inbuf;   // received data not yet consumed, in [_inpos, _inend)
+	int _inpos, _inend;
+	ByteArray _outbuf;  // data held while corked
+	bool _corked;
 	virtual bool setOption(int level, int opt, const void* p, int n);
 	bool init(bool force = false);
 	Socket_();
@@ -149,6 +166,25 @@ ASL_SMART_CLASS(Socket, SmartObject)
 	virtual int available();
 	virtual int read(void* data, int size);
 	virtual int write(const void* data, int n);
+	virtual int writev(const SocketBuf* bufs, int count);
+	virtual Long sendFile(int fd, Long offset, Long count);
+	// a single send that does not block, returns 0 if the send buffer is full
+	virtual int writeSome(const void* data, int n);
+	// single receive/pending count of the underlying transport, bypassing the input buffer
+	virtual int readRaw(void* data, int size);
+	// a single receive that does not block, returns 0 if nothing can be read yet and -1 if closed
+	virtual int readRawSome(void* data, int size);
+	int readSome(void* data, int size);
+	virtual int availableRaw();
+	int buffered() const { return _inend - _inpos; }
+	int fillBuffer();
+	const byte* peek(int& n);
+	void consume(int n) { _inpos += clamp(n, 0, buffered()); }
+	// writes going through the output buffer when corked
+	int output(const void* data, int n);
+	int outputv(const SocketBuf* bufs, int count);
+	bool flush();
+	void cork(bool on);
 	ByteArray read(int n = -1);
 	void skip(int n)
 	{
@@ -156,6 +192,7 @@ ASL_SMART_CLASS(Socket, SmartObject)
 		read(a.data(), a.length());
 	}
 	virtual bool waitInput(double timeout = 60);
+	bool waitOutput(double timeout);
 	int error() const { return _error; }
 	virtual String errorMsg() const;
 };
@@ -244,7 +281,8 @@ public:
 	*/
 	void close() { _()->close(); }
 	/**
-	Reads a line of text from the socket (keep in mind this is not buffered, can be a bit inefficient, and there is a length limit of 8000 bytes)
+	Reads a line of text from the socket (there is a length limit of 16000 bytes). Reading is buffered, so data received
+	after the line is kept for subsequent reads.
 	*/
 	String readLine() { return _()->readLine(); }
 	/**
@@ -258,11 +296,45 @@ public:
 	/**
 	Writes `n` bytes from the bufffer pointed to by `data` to the socket.
 	*/
-	int write(const void* data, int n) { return _()->write(data, n); }
+	int write(const void* data, int n) { return _()->output(data, n); }
 	/**
 	Writes the byte array to the socket and returns the number of bytes actually sent.
 	*/
-	int write(const ByteArray& data) { return _()->write(data.data(), data.length()); }
+	int write(const ByteArray& data) { return _()->output(data.data(), data.length()); }
+	/**
+	Writes `count` memory blocks in a single gathered send (like `writev`) and returns the total number of bytes sent.
+	*/
+	int write(const SocketBuf* bufs, int count) { return _()->outputv(bufs, count); }
+	/**
+	Writes an array of memory blocks in a single gathered send.
+	*/
+	int write(const Array<SocketBuf>& bufs) { return _()->outputv(bufs.data(), bufs.length()); }
+	/**
+	Writes as much of the `n` bytes at `data` as fits in the socket's send buffer without blocking, and returns the
+	number of bytes sent (0 if the buffer is full) or -1 on error. It bypasses the cork buffer. After it returns 0,
+	the next call must pass the same data again: a TLS socket may have sent part of a record and kept the rest.
+	*/
+	int writeSome(const void* data, int n) { return _()->writeSome(data, n); }
+	/**
+	Reads up to `n` bytes that can be read without blocking, and returns the number of bytes read (0 if none can be
+	read yet) or -1 if the connection was closed or failed. Unlike `available()`, this is exact for TLS sockets.
+	*/
+	int readSome(void* data, int n) { return _()->readSome(data, n); }
+	/**
+	Corks or uncorks the socket: while corked, small writes are collected in memory and sent together when the
+	socket is uncorked, when `flush()` is called or when enough data accumulates. Uncorking flushes pending data.
+	*/
+	void cork(bool on = true) { _()->cork(on); }
+	/**
+	Sends the data held by a corked socket, returns false on error.
+	*/
+	bool flush() { return _()->flush(); }
+	/**
+	Sends `count` bytes of an open file starting at `offset` without copying them through user space (uses
+	`sendfile()` or `splice()` on Linux). Returns the number of bytes sent, or -1 if not supported for this socket
+	or platform (e.g. TLS sockets), in which case nothing was sent and the data must be written normally.
+	*/
+	Long sendFile(File& file, Long offset, Long count);
 	/**
 	Reads n bytes and returns them as an array of bytes, or reads all available bytes if no argument is given.
 	*/
@@ -273,11 +345,26 @@ public:
 	*/
 	void skip(int n) { _()->skip(n); }
 	/**
+	Returns the received data not yet read, waiting for some if there is none, and sets `n` to its length (0 if
+	the connection was closed). The data is not removed from the socket until `consume()` is called, so a parser
+	can take only what it needs without copying.
+	*/
+	const byte* peek(int& n) { return _()->peek(n); }
+	/**
+	Removes the first `n` bytes of the data returned by `peek()`.
+	*/
+	void consume(int n) { _()->consume(n); }
+	/**
 	Waits until there is incoming data in the socket or it is disconnected for a maximum time, and
 	returns true if some of that happened before timeout
 	*/
 	bool waitInput(double timeout = 2) { return _()->waitInput(timeout); }
 
+	/**
+	Waits until data can be written to the socket without blocking for a maximum time, and returns true if so
+	*/
+	bool waitOutput(double timeout = 2) { return _()->waitOutput(timeout); }
+
 	/**
 	Waits until there is incoming data in the socket or it is disconnected for a maximum time, and
 	returns true only if there is data to read (false may mean no data or disconnection)
@@ -374,6 +461,57 @@ public:
 	T read() { T x; *this >> x; return x; }
 };
 
+/**
+A reusable set of buffers to receive or send many datagrams in one call with PacketSocket::readBatch() and
+PacketSocket::sendBatch(). It has `count` slots of up to `size` bytes, each with its length and peer address, all
+allocated once in contiguous blocks.
+
+~~~
+PacketBatch batch(64, 1500);
+while (socket.readBatch(batch) > 0)
+{
+	for (int i = 0; i < batch.length(); i++)
+		process(batch.data(i), batch.size(i), batch.address(i));
+}
+~~~
+\ingroup Sockets
+*/
+class ASL_API PacketBatch
+{
+	friend struct PacketSocket_;
+public:
+	PacketBatch(int count = 64, int size = 2048);
+	/** Returns the number of datagrams the batch can hold */
+	int capacity() const { return _sizes.length(); }
+	/** Returns the number of datagrams in the batch (received, or added to be sent) */
+	int length() const { return _n; }
+	/** Returns the maximum size of each datagram */
+	int maxSize() const { return _size; }
+	/** Empties the batch */
+	void clear() { _n = 0; }
+	/** Returns the bytes of datagram `i` */
+	byte* data(int i) { return _data.data() + i * _size; }
+	const byte* data(int i) const { return _data.data() + i * _size; }
+	/** Returns the length of datagram `i` */
+	int size(int i) const { return _sizes[i]; }
+	/** Returns the address of the sender of datagram `i`, or where it is sent to */
+	InetAddress address(int i) const;
+	/** Adds a datagram to be sent to address `to`; returns false if the batch is full or the data too large */
+	bool add(const InetAddress& to, const void* data, int n);
+	bool add(const InetAddress& to, const ByteArray& data) { return add(to, data.data(), data.length()); }
+	bool add(const InetAddress& to, const String& data) { return add(to, data.data(), data.length()); }
+private:
+	enum { ADDR_SIZE = 128 }; // enough for any socket address
+	ByteArray _data;          // the datagrams, `_size` bytes each
+	ByteArray _addrs;         // their addresses, ADDR_SIZE bytes each
+	Array<int> _sizes;
+	Array<int> _addrLengths;
+	mutable ByteArray _headers; // system message headers, set up once
+	int _size;
+	int _n;
+	void* headers() const;
+};
+
 ASL_SMART_CLASS(PacketSocket, Socket)
 {
 	ASL_SMART_INNER_DEF(PacketSocket);
@@ -389,6 +527,8 @@ ASL_SMART_CLASS(PacketSocket, Socket)
 	}
 	void sendTo(const InetAddress& addr, const void* data, int n);
 	int readFrom(InetAddress& addr, void* data, int n);
+	int readBatch(PacketBatch& batch);
+	int sendBatch(const PacketBatch& batch);
 };
 
 /**
@@ -453,6 +593,25 @@ public:
 		n = _()->readFrom(addr, data.data(), n);
 		return n > 0? data.resize(n) : data.resize(0);
 	}
+
+	/**
+	Receives as many datagrams as are available, up to the batch capacity, waiting for at least one. Returns the
+	number received (also in `batch.length()`) or -1 on error. Datagrams larger than the batch's slots are truncated.
+	On Linux this is a single system call (`recvmmsg`).
+	*/
+	int readBatch(PacketBatch& batch)
+	{
+		return _()->readBatch(batch);
+	}
+
+	/**
+	Sends all the datagrams in the batch, each to its address, and returns how many were sent. On Linux they are
+	sent with as few system calls as possible (`sendmmsg`).
+	*/
+	int sendBatch(const PacketBatch& batch)
+	{
+		return _()->sendBatch(batch);
+	}
 };
 
 ASL_SMART_CLASS(LocalSocket, Socket)
@@ -10,6 +10,23 @@ namespace asl {
 	
 struct SockServerThread;
 struct SockClientThread;
+struct SockReactor;
+struct SockPool;
+class TlsContext;
+
+/**
+Counters of a SocketServer worker pool (see SocketServer::setThreadPool())
+\ingroup Sockets
+*/
+struct SocketServerStats
+{
+	int queued;         //!< connections currently waiting for a worker
+	int maxQueued;      //!< maximum queue length reached
+	int dispatched;     //!< jobs handed to workers
+	int rejected;       //!< connections closed because the queue was full
+	double waitTime;    //!< average time (seconds) jobs waited in the queue
+	double maxWaitTime; //!< maximum time a job waited in the queue
+};
 
 /**
 This is a reusable TCP or Unix socket server that listens to incoming connections and answers them concurrently (default) or sequentially.
@@ -59,13 +76,33 @@ void serve(Socket client)
 
 Add `&& !_requestStop` to the while condition to let the service be stoppable by SocketServer::stop().
 
+On Linux, servers with many mostly idle connections can use the event-driven mode with `setReactor()`. All client
+sockets are then watched by a single epoll thread and connections with incoming data are handed to a fixed pool
+of worker threads, which call `serveInput()`. Subclasses that only implement `serve(Socket)` still work in this
+mode, but each of their connections occupies a worker while it is being served.
+
+Instead of one thread per connection, connections can be served by a bounded pool of threads with
+`setThreadPool()`. When the pool's queue is full new connections either wait for space (backpressure on the
+accept loop) or are rejected. The reactor mode also uses this pool, and `stats()` reports its counters.
+
 \ingroup Sockets
 */
 
 class ASL_API SocketServer
 {
 	friend struct SockClientThread;
+	friend struct SockReactor;
+	friend struct SockPool;
 	SockServerThread* _thread;
+	SockPool* _pool;
+	SockReactor* _reactor;
+	bool _useReactor;
+	int _reactorThreads;
+	int _poolThreads;
+	int _poolQueue;
+	bool _poolReject;
+	void startWorkers();
+	void stopWorkers();
 protected:
 	Sockets _sockets;
 	bool _requestStop;
@@ -73,6 +110,8 @@ protected:
 	bool _running;
 	AtomicCount _numClients;
 	String _socketError;
+	double _idleTimeout;
+	double _lifetime;
 public:
 	SocketServer();
 	~SocketServer();
@@ -95,15 +134,38 @@ public:
 	*/
 	bool bindTLS(int port) { return bindTLS("0.0.0.0", port); }
 	/**
-	Sets the certificate and private key for the TLS server in PEM format.
+	Sets the certificate and private key for the TLS server in PEM format. It can be called while the server is running
+	to replace them: new connections use the new certificate and the open ones are not affected.
 	*/
 	bool useCert(const String& cert, const String& key);
+	/**
+	Makes the TLS ports bound so far use a shared TlsContext (certificates and configuration)
+	*/
+	void useTlsContext(const TlsContext& context);
+	/**
+	Sets the maximum time in seconds for TLS handshakes (10 s by default) on the TLS ports bound so far. Handshakes
+	are done in the thread serving each connection, not in the accept loop. With a thread pool or a reactor that
+	thread is a pool worker, and the handshake blocks it: a slow or stalled client can hold a worker for up to this
+	timeout. Lower it, or make the pool larger, when many clients may connect over slow links.
+	*/
+	void setHandshakeTimeout(double timeout);
 #endif
 	/**
 	This function is called in a new thread with each new incoming client connection. Implement it
 	in a subclass to make a specific server.
 	*/
 	virtual void serve(Socket client) {}
+	/**
+	In reactor mode, this is called in a worker thread when a client connection has incoming data. Return true
+	to keep the connection open and be called again when more data arrives. The default implementation calls
+	`serve(client)` and then closes the connection.
+	*/
+	virtual bool serveInput(Socket client);
+	/**
+	In reactor mode, this is called when a client connection is about to be closed, because `serveInput()` returned
+	false, the peer disconnected, it expired or the server is stopping.
+	*/
+	virtual void serveClose(Socket client) {}
 
 	void startLoop();
 	/**
@@ -117,6 +179,32 @@ public:
 	*/
 	void setSequential(bool on) { _sequential = on; }
 	/**
+	Enables the event-driven mode (only on Linux, otherwise ignored): client connections are multiplexed with
+	epoll and served by `nthreads` worker threads (the number of processors by default) through `serveInput()`.
+	Must be called before `start()`.
+	*/
+	void setReactor(int nthreads = 0);
+	/**
+	Serves connections with a pool of `nthreads` worker threads (the number of processors if 0) instead of a new
+	thread per connection. At most `maxQueue` accepted connections wait for a worker (0 = unlimited); when the queue
+	is full the accept loop waits, or if `reject` is true the new connection is closed. Must be called before `start()`.
+	*/
+	void setThreadPool(int nthreads, int maxQueue = 0, bool reject = false);
+	/**
+	Sets the time in seconds that a connection can stay idle waiting for a new request (10 by default), and the
+	maximum total lifetime of a connection (0 = unlimited). Servers implementing `serve(Socket)` should honor these
+	in their loop; in reactor mode they are applied by the server.
+	*/
+	void setKeepAlive(double idle, double lifetime = 0) { _idleTimeout = idle; _lifetime = lifetime; }
+	/**
+	Returns the counters of the worker pool (all zero if there is no pool)
+	*/
+	SocketServerStats stats() const;
+	/**
+	In reactor mode, sets an idle timeout for a specific client connection, different from the server's one (0 = none)
+	*/
+	void setIdleTimeout(const Socket& client, double idle);
+	/**
 	Returns true if this server started and has not yet stopped or still has clients running
 	*/
 	bool running() const { return _running || _numClients != 0; }
@@ -7,11 +7,69 @@
 #include <asl/Array.h>
 #include <asl/String.h>
 #include <asl/Socket.h>
+#include <asl/Pointer.h>
 
 namespace asl {
 
 class TlsSocket;
 struct TlsCore;
+struct TlsConfig;
+struct TlsContextData;
+
+/**
+Counters of TLS handshakes and session resumptions in this process (see TlsSocket::sessionStats())
+\ingroup Sockets
+*/
+struct TlsSessionStats
+{
+	Long accepted;  //!< server handshakes completed
+	Long resumed;   //!< server sessions resumed from the session cache or a session ticket
+	Long connected; //!< client handshakes completed
+	Long cached;    //!< client handshakes that offered a cached session of the same host and port
+};
+
+/**
+A TLS configuration, with certificates, keys, CA chain and random generator, that can be shared by many sockets.
+Setting it up is expensive, so sharing one context avoids doing it for every connection. Copies of a TlsContext
+refer to the same context.
+
+A server's certificate can be replaced at any time with `useCert()`: connections accepted afterwards use the new
+one, while those already established keep the previous one until they close.
+
+~~~
+TlsContext context;
+context.useCert(cert, key);
+server.useTlsContext(context);
+...
+context.useCert(renewedCert, renewedKey); // without restarting the server
+~~~
+
+Client sockets share a default context unless given one with `TlsSocket::useContext()`.
+\ingroup Sockets
+*/
+class ASL_API TlsContext
+{
+	friend struct TlsSocket_;
+public:
+	TlsContext();
+	TlsContext(const TlsContext& c);
+	TlsContext& operator=(const TlsContext& c);
+	~TlsContext();
+	/**
+	Sets the certificate and private key (PEM) used by servers with this context; returns false if they are not valid,
+	and then the previous ones are kept
+	*/
+	bool useCert(const String& cert, const String& key);
+	/**
+	Sets the CA certificates (PEM) that clients with this context use to verify servers; once set, connections to
+	servers whose certificate is not signed by one of them fail
+	*/
+	bool useCA(const String& ca);
+private:
+	Shared<TlsConfig> serverConfig() const;
+	Shared<TlsConfig> clientConfig() const;
+	Shared<TlsContextData> _d;
+};
 
 ASL_SMART_CLASS(TlsSocket, Socket)
 {
@@ -26,17 +84,42 @@ ASL_SMART_CLASS(TlsSocket, Socket)
 	Socket_* accept();
 	bool connect(const InetAddress& host);
 	void close();
-	int available();
-	int read(void* data, int size);
+	int availableRaw();
+	int readRaw(void* data, int size);
+	int readRawSome(void* data, int size);
 	int write(const void* data, int n);
+	int writev(const SocketBuf* bufs, int count);
+	Long sendFile(int, Long, Long) { return -1; }
+	int writeSome(const void* data, int n);
 	bool waitInput(double timeout = 60);
+	bool waitRaw(double timeout);
+	bool handshake();
+	void setHandshakeTimeout(double timeout);
 	String errorMsg() const;
 	bool useCert(const String& cert);
 	bool useKey(const String& key);
+	void useContext(const TlsContext& context);
+	void reset();
 };
 
 /**
 A TLS secure socket. Derives from Socket and has the same interface.
+
+Connections accepted by a listening TlsSocket are returned before the TLS handshake, which is done by the first
+operation on them (reading, writing or waiting for input), so that a slow client does not hold the accept loop. The
+handshake fails if it does not complete within the handshake timeout (see `setHandshakeTimeout()`).
+
+After the handshake, one thread can write to a connection while another one reads from it (as a WebSocket server
+does when it broadcasts): their use of the TLS state is serialized, and neither holds it while waiting for the socket.
+
+Sessions are resumed to avoid full handshakes on repeated connections: servers keep a session cache and issue
+session tickets shared by all listening sockets, and clients remember the last session of each host and port.
+Resumption rates can be checked with `sessionStats()`:
+
+~~~
+TlsSessionStats stats = TlsSocket::sessionStats();
+printf("%.0f%% resumed\n", 100.0 * stats.resumed / max(stats.accepted, Long(1)));
+~~~
 \ingroup Sockets
 */
 class ASL_API TlsSocket : public Socket
@@ -57,6 +140,37 @@ public:
 	{
 		return _()->useKey(key);
 	}
+	/**
+	Sets the TLS context to use, with its certificates: for a listening socket it applies to the connections accepted
+	from then on, and for a client it must be set before connecting
+	*/
+	void useContext(const TlsContext& context)
+	{
+		_()->useContext(context);
+	}
+	/**
+	Completes the TLS handshake of an accepted connection, if not done yet, and returns true if it succeeded
+	*/
+	bool handshake()
+	{
+		return _()->handshake();
+	}
+	/**
+	Sets the maximum time in seconds for the handshake of connections accepted by this listening socket (10 s by
+	default)
+	*/
+	void setHandshakeTimeout(double timeout)
+	{
+		_()->setHandshakeTimeout(timeout);
+	}
+	/**
+	Returns the handshake and session resumption counters of all TLS sockets
+	*/
+	static TlsSessionStats sessionStats();
+	/**
+	Forgets the sessions cached for client connections, so that the next ones do full handshakes
+	*/
+	static void clearSessions();
 };
 
 }
@@ -5,13 +5,19 @@
 #define ASL_WEBSOCKETSERVER
 #include <asl/Socket.h>
 #include <asl/Map.h>
+#include <asl/HashMap.h>
 #include <asl/String.h>
 #include <asl/SocketServer.h>
 #include <asl/Mutex.h>
+#include <asl/Pointer.h>
+#include <asl/util.h>
 
 namespace asl {
 
 class Var;
+class WebSocketServer;
+struct WebSocketSender;
+struct WebSocketDeflate;
 
 struct WebSocketMsg
 {
@@ -49,11 +55,37 @@ To connect to a TLS secure server, use the "wss:" protocol:
 ~~~
 ws.connect("wss://some-encrypted-websocketserver:443");
 ~~~
+
+When built with ASL_ZLIB, messages can be compressed with the *permessage-deflate* extension if it is enabled with
+`setCompression()` before connecting and the server accepts it:
+
+~~~
+ws.setCompression(6);
+ws.connect("ws://some-websocketserver:9000");
+ws.send(Var("items", largeArray));                  // compressed
+ws.send(jpegData.data(), jpegData.length(), WebSocket::FRAME_BINARY, false); // sent as is
+~~~
+
+Instead of blocking in `receive()`, messages can be handled with callbacks called by `poll()`, which processes the
+input available without blocking (partial frames are kept until complete). This can be integrated in an
+application's event loop:
+
+~~~
+ws.onMessage([&](const WebSocketMsg& msg) {
+	printf("received %s\n", *msg);
+});
+ws.onClose([&](int code) {
+	printf("closed with code %i\n", code);
+});
+while (ws.poll())
+	ws.wait(1);
+~~~
 \ingroup HTTP
 */
 
 class ASL_API WebSocket
 {
+	friend class WebSocketServer;
 public:
 	enum FrameType { FRAME_CONT, FRAME_TEXT, FRAME_BINARY, FRAME_CLOSE=8, FRAME_PING, FRAME_PONG };
 	/**
@@ -61,6 +93,7 @@ public:
 	*/
 	WebSocket();
 	WebSocket(const Socket& s, bool isclient = true);
+	~WebSocket();
 	/**
 	Connecto to a WebSocket server at the given host and port (the port can be in the `host` string separated with ':')
 	*/
@@ -74,12 +107,42 @@ public:
 	*/
 	WebSocketMsg receive();
 
-	void send(const byte* p, int len, FrameType = FRAME_TEXT);
+	/**
+	Receives the next part of the current message into `buffer`, up to `n` bytes, as it arrives instead of waiting
+	for the whole message (compressed messages are decompressed progressively). Returns the number of bytes copied,
+	0 at the end of the message (then the next call starts reading the next message), or -1 if the connection is
+	closed. It only blocks if no data is available. Messages read this way are not limited by `setMaxMessageSize()`.
+
+	~~~
+	byte buffer[16384];
+	int n;
+	while ((n = ws.receive(buffer, sizeof(buffer))) > 0)
+		file.write(buffer, n);
+	~~~
+	*/
+	int receive(void* buffer, int n);
+
+	/**
+	Returns the type of the last message received (text or binary)
+	*/
+	FrameType messageType() const { return _messageType; }
+
+	/**
+	Sets the maximum size of messages received with `receive()` or `poll()` (default 100 MB); if a peer sends a
+	larger message the connection is closed with status 1009
+	*/
+	void setMaxMessageSize(int size) { _maxMessage = size; }
+
+	/**
+	Sends a message to the peer; if `compress` is false it is not compressed even if compression was negotiated
+	(useful for data that is already compressed)
+	*/
+	void send(const byte* p, int len, FrameType = FRAME_TEXT, bool compress = true);
 
 	/**
 	Sends a binary message to the peer
 	*/
-	void send(const ByteArray& m) { send(m.data(), m.length(), FRAME_BINARY); }
+	void send(const ByteArray& m, bool compress = true) { send(m.data(), m.length(), FRAME_BINARY, compress); }
 	/**
 	Sends a text message to the peer
 	*/
@@ -105,6 +168,27 @@ public:
 	/** Checks if there is some input available */
 	bool hasInput();
 
+	/**
+	Sets a function to be called with each message received by `poll()`
+	*/
+	void onMessage(const Function<void, const WebSocketMsg&>& f) { _onMessage = f; }
+
+	/**
+	Sets a function to be called with the close status code when `poll()` finds the connection closed
+	*/
+	void onClose(const Function<void, int>& f) { _onClose = f; }
+
+	/**
+	Processes the input available without blocking, calling the message callback for each complete message, and
+	returns false if the connection is closed
+	*/
+	bool poll();
+
+	/**
+	Returns the underlying socket (for example to watch its handle in an event loop)
+	*/
+	Socket& socket() { return _socket; }
+
 	/** Returns the close status code if the socket was closed */
 	int code() const { return _code; }
 
@@ -118,13 +202,78 @@ public:
 	*/
 	bool connected() { return !closed(); }
 
+	/**
+	Returns the number of broadcast messages dropped for this client because its send queue was full
+	*/
+	int dropped() const { return _dropped; }
+
+	/**
+	Enables the permessage-deflate extension (RFC 7692) at zlib `level` 1-9 (0 disables it); call it before `connect()`.
+	Messages shorter than `minSize` bytes are sent uncompressed. `windowBits` (9-15) sets the size of the compression
+	window, and if `contextTakeover` is false every message is compressed independently, which needs less memory but
+	compresses worse. Requires building with ASL_ZLIB.
+	*/
+	void setCompression(int level, int minSize = 64, int windowBits = 15, bool contextTakeover = true);
+
+	/**
+	Returns true if compression was negotiated with the peer
+	*/
+	bool compressed() const { return _deflate; }
+
 protected:
+	struct OutFrame
+	{
+		ByteArray data;
+		bool droppable;
+	};
+	void output(const byte* head, int headLength, const byte* payload, int length);
+	void sendFrame(const byte* p, int length, byte opcode);
+	int parseHeader(WebSocketMsg& msg, bool whole);
+	int readPayload(byte* dst, int n, int maxRead, bool block = true);
+	bool readInput(bool block);
+	int receiveStep(WebSocketMsg& msg, bool block);
+	int waitSome();
+	void fail(int code);
+	bool pollInput(bool readable);
+	void dispatch(const WebSocketMsg& msg);
+	void notifyClose();
+	bool enqueue(const ByteArray& frame, int maxBytes, bool coalesce);
+	int flushQueue();
 	Socket _socket;
-	ByteArray _buffer;
+	ByteArray _buffer;        // received bytes, parsed from _inputPos to _inputEnd
+	int _inputPos;
+	int _inputEnd;
+	int _need;                // bytes missing to complete the next frame header
+	Long _frameLeft;          // payload bytes of the current data frame not yet read, or -1 before a header
+	bool _frameFin;
+	byte _frameKey[4];
+	int _frameMask;           // position in the masking key of the next payload byte, or -1 if not masked
+	ByteArray _message;       // fragments of the message being received
+	FrameType _messageType;
+	int _maxMessage;
+	bool _inMessage;
+	bool _messageDeflated;
+	bool _messageEnded;       // a streamed message ended and the end was not yet reported
+	bool _closeNotified;
+	WebSocketServer* _server; // server of an incoming connection
+	Function<void, const WebSocketMsg&> _onMessage;
+	Function<void, int> _onClose;
 	bool _isClient;
 	bool _closed;
 	int _code;
 	Random _random;
+	Mutex _writeMutex;        // held while writing frames to the socket
+	Mutex _queueMutex;        // protects the outgoing queue
+	Array<OutFrame> _queue;   // frames waiting to be sent by the server's broadcast sender
+	int _queueBytes;
+	int _queueOffset;         // bytes of the first queued frame already sent
+	int _dropped;
+	Shared<WebSocketDeflate> _deflate; // compression state if permessage-deflate was negotiated
+	Mutex _deflateMutex;      // keeps messages compressed in the order they are sent
+	int _compressLevel;
+	int _compressMin;
+	int _compressBits;
+	bool _compressTakeover;
 };
 
 /**
@@ -154,6 +303,40 @@ wsserver.bind(9000);
 wsserver.start();
 ~~~
 
+To send the same message to all connected clients use `broadcast()`. The message is encoded and framed only
+once and then queued for each client and sent by a background thread without blocking, so that a slow client
+does not delay the others. If a client's queue exceeds its limit (see `setSendQueue()`) older pending messages
+are dropped in favor of the newest one, or the new one is dropped.
+
+~~~
+wsserver.broadcast(Var("temperature", t)("time", now()));
+~~~
+
+Connections can also be served asynchronously, without a thread each, by implementing the callbacks `onOpen()`,
+`onMessage()` and `onClose()` instead of `serve()`, and enabling the reactor mode with `setReactor()` (on Linux,
+otherwise a thread per connection calls the callbacks). Then all connections are watched by one thread and their
+complete messages are dispatched to a few worker threads, so many mostly idle clients can be handled with a
+handful of threads. Callbacks for the same connection are never called concurrently.
+
+~~~
+class ChatServer : public WebSocketServer
+{
+public:
+	void onMessage(WebSocket& ws, const WebSocketMsg& msg)
+	{
+		broadcast(*msg);
+	}
+};
+
+ChatServer chat;
+chat.setReactor(4);
+chat.bind(9000);
+chat.start();
+~~~
+
+Compression with the permessage-deflate extension can be enabled with `setCompression()` (requires ASL_ZLIB). Broadcast
+messages are compressed once for all clients only if context takeover is disabled, and sent uncompressed otherwise.
+
 Additionally, a WebSocket server can use the same port as an HttpServer. To do this, call the `link()`
 function in the HTTP server and only start that one.
 
@@ -167,26 +350,98 @@ httpserver.start();
 class ASL_API WebSocketServer: public SocketServer
 {
 	friend class HttpServer;
+	friend struct WebSocketSender;
 public:
 	WebSocketServer();
 	WebSocketServer(int port);
+	~WebSocketServer();
 	/**
 	Serves the incoming client websocket, implement this function in a subclass to define
 	the behavior of this server.
 	*/
 	virtual void serve(WebSocket& s);
 	/**
+	Called when a client connects, in reactor mode or from the default `serve()`
+	*/
+	virtual void onOpen(WebSocket& ws) {}
+	/**
+	Called with each message received from a client, in reactor mode or from the default `serve()`, unless the
+	WebSocket has its own message callback
+	*/
+	virtual void onMessage(WebSocket& ws, const WebSocketMsg& msg) {}
+	/**
+	Called when a client connection is closed, in reactor mode or from the default `serve()`, unless the WebSocket
+	has its own close callback
+	*/
+	virtual void onClose(WebSocket& ws) {}
+	/**
 	Returns an array of currently connected client websockets
 	*/
 	const Array<WebSocket*>& clients() const { return _clients; }
 	Mutex& mutex() { return _mutex; }
+	/**
+	Sends a message to all connected clients without blocking, and returns the number of clients it was queued for
+	*/
+	int broadcast(const byte* data, int n, WebSocket::FrameType type);
+	/**
+	Sends a text message to all connected clients
+	*/
+	int broadcast(const String& text) { return broadcast((const byte*)*text, text.length(), WebSocket::FRAME_TEXT); }
+
+	int broadcast(const char* text) { return broadcast(String(text)); }
+	/**
+	Sends a binary message to all connected clients
+	*/
+	int broadcast(const ByteArray& data) { return broadcast(data.data(), data.length(), WebSocket::FRAME_BINARY); }
+	/**
+	Sends a Var encoded as JSON to all connected clients
+	*/
+	int broadcast(const Var& data);
+	/**
+	Sets the maximum number of bytes of broadcast messages pending to be sent to each client (default 1 MB). When a
+	new message does not fit, if `coalesce` is true the pending messages not yet started are dropped and the new one
+	is queued, otherwise the new one is dropped.
+	*/
+	void setSendQueue(int maxBytes, bool coalesce = true) { _queueMax = maxBytes; _coalesce = coalesce; }
+	/**
+	Enables the permessage-deflate extension (RFC 7692) for clients that offer it, at zlib `level` 1-9 (0 disables it).
+	Messages shorter than `minSize` bytes are sent uncompressed. `windowBits` (9-15) limits the compression window, and
+	if `contextTakeover` is false every message is compressed independently in both directions, which needs less memory
+	per client but compresses worse. Requires building with ASL_ZLIB.
+	*/
+	void setCompression(int level, int minSize = 64, int windowBits = 15, bool contextTakeover = true)
+	{
+		_compressLevel = level;
+		_compressMin = minSize;
+		_compressBits = clamp(windowBits, 9, 15);
+		_compressTakeover = contextTakeover;
+	}
+	/**
+	Sets the maximum size of messages received from clients (default 100 MB); larger messages close the connection
+	with status 1009
+	*/
+	void setMaxMessageSize(int size) { _maxMessage = size; }
 protected:
 	ByteArray readMessage();
+	bool serveInput(Socket client);
+	void serveClose(Socket client);
 private:
-	void process(Socket& socket, const Dic<String>& headers);
+	bool process(Socket& socket, const Dic<String>& headers, bool async = false);
+	bool pollClient(Socket& client, bool& keep);
 	void serve(Socket client);
+	bool flushClients();
 	Array<WebSocket*> _clients;
 	Mutex _mutex;
+	WebSocketSender* _sender;
+	int _queueMax;
+	bool _coalesce;
+	int _compressLevel;
+	int _compressMin;
+	int _compressBits;
+	bool _compressTakeover;
+	int _maxMessage;
+	HashMap<Socket_*, WebSocket*> _async; // connections served in reactor mode
+	Mutex _asyncMutex;
 };
 }
 #endif
@@ -12,11 +12,27 @@
 
 namespace asl {
 
+class File;
+class Socket;
+
 /**
  * \defgroup XDL XML and JSON
  * @{
  */
 
+/**
+A parser of XDL and JSON documents. It can decode a complete string or be fed a document in pieces split at any
+point, so large documents can be decoded without loading them whole:
+
+~~~
+XdlParser parser;
+while ((n = source.read(buffer, sizeof(buffer))) > 0)
+	parser.parse(buffer, n);
+Var data = parser.end();
+~~~
+
+It can also read directly from a File or a Socket in blocks.
+*/
 class ASL_API XdlParser
 {
 	typedef char State;
@@ -27,15 +43,41 @@ class ASL_API XdlParser
 	Stack<String> _props;
 	String _buffer;
 	bool _inComment;
+	bool _complete;
 	int _unicodeCount;
-	char _ldp;
 	char _unicode[4];
 	wchar_t _wchar;
 	void put(const Var& x);
+	int parse(const char* s, const char* end, bool single);
 public:
 	XdlParser();
 	~XdlParser();
-	void parse(const char* s);
+	/**
+	Parses the next part of the document given as a null-terminated string
+	*/
+	void parse(const char* s) { parse(s, s + strlen(s), false); }
+	/**
+	Parses the next `n` bytes of the document; the document can be split anywhere, even inside a number, a string
+	or an escape sequence
+	*/
+	void parse(const char* s, int n) { parse(s, s + n, false); }
+	/**
+	Ends the document and returns its decoded value (or a `NONE` var on error)
+	*/
+	Var end();
+	/**
+	Returns true if a syntax error was found
+	*/
+	bool failed() const;
+	/**
+	Reads and decodes a document from a file in blocks of `blockSize` bytes
+	*/
+	Var read(File& file, int blockSize = 65536);
+	/**
+	Reads and decodes one document from a socket, reading its data as it arrives and leaving any bytes after the
+	document in the socket; call reset() before reading another one.
+	*/
+	Var read(Socket& socket);
 	void value_end();
 	virtual void reset();
 	Var value() const;
@@ -53,7 +95,50 @@ public:
 	virtual void new_property(const String& name);
 };
 
-struct XdlSink;
+/**
+A destination for the text produced when encoding XDL or JSON, which receives it in pieces as encoding proceeds
+(whenever more than `flushSize` bytes are pending, and at the end). This way large values can be written out with a
+bounded buffer instead of building the whole text in memory first.
+
+Subclasses implement `write()`, which gets the pending text and consumes it (usually writing it and clearing the
+string). There are sinks for files, sockets and HTTP messages (XdlSinkHttp):
+
+~~~
+Socket socket;
+...
+XdlSinkSocket sink(socket);
+Json::write(data, sink);
+~~~
+*/
+struct ASL_API XdlSink
+{
+	/** Pending text size above which it is written */
+	int flushSize;
+	XdlSink(int flushSize = 16384) : flushSize(flushSize) {}
+	virtual ~XdlSink() {}
+	/** Writes (and removes) the text in `s`; returns false if it could not be written */
+	virtual bool write(String& s) { return true; }
+};
+
+/**
+An XdlSink that writes to a File
+*/
+struct ASL_API XdlSinkFile : public XdlSink
+{
+	File& file;
+	XdlSinkFile(File& f, int flushSize = 16384) : XdlSink(flushSize), file(f) {}
+	bool write(String& s);
+};
+
+/**
+An XdlSink that writes to a Socket
+*/
+struct ASL_API XdlSinkSocket : public XdlSink
+{
+	Socket& socket;
+	XdlSinkSocket(Socket& s, int flushSize = 16384) : XdlSink(flushSize), socket(s) {}
+	bool write(String& s);
+};
 
 class ASL_API XdlEncoder
 {
@@ -64,12 +149,16 @@ protected:
 	bool _simple;
 	const char* _fmtF;
 	const char* _fmtD;
+	int _digitsF; // max digits of the shortest formatting, 0 to always use the printf format
+	int _digitsD;
 	String _indent;
 	String _sep1; // between items in same line
 	String _sep2; // between items, end of line
 	int _level;
 	XdlSink* _sink;
+	bool _sinkOk;
 	void _encode(const Var& v);
+	void flush();
 public:
 	XdlEncoder();
 	~XdlEncoder();
@@ -79,6 +168,10 @@ public:
 	String data() const {return _out;}
 
 	String encode(const Var& v, Json::Mode mode);
+	/**
+	Encodes `v` writing the text to the given sink; returns false if the sink failed
+	*/
+	bool encode(const Var& v, Json::Mode mode, XdlSink& sink);
 
 	void put_separator();
 
@@ -115,6 +208,11 @@ struct ASL_API Xdl
 	*/
 	static bool write(const Var& v, const String& file, int mode = Json::NICE);
 
+	/**
+	Encodes a var in XDL format writing it to a sink as it is produced
+	*/
+	static bool write(const Var& v, XdlSink& sink, int mode = Json::SIMPLE);
+
 	static ASL_DEPRECATED(bool write(const String& file, const Var& v, int mode = Json::NICE), "Use Xdl::write(v, file)")
 	{
 		return write(v, file, mode);
@@ -259,6 +259,15 @@ ASL_API Long myatol(const char* s);
 ASL_API int myltoa(Long x, char* s);
 ASL_API double myatof(const char* s);
 ASL_API int myitoa(int x, char* s);
+/**
+Writes `x` in `s` with the fewest digits that read back as the same number, formatted like printf's `%.{precision}g`
+but independent of the locale; returns the length, or 0 if more than `precision` digits are needed (17 always suffice)
+*/
+ASL_API int mydtoa(double x, char* s, int precision = 17);
+/**
+Writes `x` in `s` with the fewest digits that read back as the same float, like mydtoa() (9 digits always suffice)
+*/
+ASL_API int myftoa(float x, char* s, int precision = 9);
 
 inline bool myisspace(char c)
 {
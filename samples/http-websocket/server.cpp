@@ -120,14 +120,9 @@ public:
 	*/
 	void broadcast()
 	{
-		Lock _(mutex());
 		float v = Server::_v, r = Server::_r;
 		double t = asl::now();
-		Var msg = Var("op", "pos")("x", 250 + r * cos(v*t))("y", 250 + r * sin(v*t));
-		foreach(WebSocket* ws, clients())
-		{
-			ws->send(msg);
-		}
+		WebSocketServer::broadcast(Var("op", "pos")("x", 250 + r * cos(v*t))("y", 250 + r * sin(v*t)));
 	}
 };
 
@@ -4,8 +4,14 @@
 #include <asl/File.h>
 #include <asl/Http.h>
 #include <asl/JSON.h>
+#include <asl/Xdl.h>
 #include <asl/TlsSocket.h>
+#include <asl/HashMap.h>
+#include <asl/Mutex.h>
 #include <ctype.h>
+#ifdef ASL_ZLIB
+#include <zlib.h>
+#endif
 
 #define SEND_BLOCK_SIZE 128000
 #define RECV_BLOCK_SIZE 16000
@@ -166,6 +172,114 @@ struct HttpSinkFile : public HttpSink
 	}
 };
 
+#ifdef ASL_ZLIB
+
+// Compresses a message body as it is written and sends the output as body chunks, an empty block ends the stream
+
+struct HttpSinkDeflate : public HttpSink
+{
+	HttpMessage* message;
+	z_stream z;
+	HttpSinkDeflate(HttpMessage* m, int level, bool gzip) : message(m)
+	{
+		memset(&z, 0, sizeof(z));
+		deflateInit2(&z, level, Z_DEFLATED, gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY);
+	}
+	~HttpSinkDeflate() { deflateEnd(&z); }
+	int write(byte* p, int n)
+	{
+		byte out[RECV_BLOCK_SIZE];
+		z.next_in = p;
+		z.avail_in = n;
+		do {
+			z.next_out = out;
+			z.avail_out = sizeof(out);
+			if (deflate(&z, n == 0 ? Z_FINISH : Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+				return -1;
+			int m = sizeof(out) - z.avail_out;
+			if (m > 0 && message->writeBlock(out, m, String()) < m)
+				return -1;
+		} while (z.avail_out == 0);
+		return n;
+	}
+};
+
+// Decompresses a gzip or deflate encoded body into another sink, failing if it inflates beyond the message's size
+// limit or the target sink fails
+
+struct HttpSinkInflate : public HttpSink
+{
+	Shared<HttpSink> target;
+	z_stream z;
+	bool ok;
+	Long size, maxSize;
+	HttpSinkInflate(const Shared<HttpSink>& t) : target(t), size(0), maxSize(0)
+	{
+		memset(&z, 0, sizeof(z));
+		ok = inflateInit2(&z, 15 + 32) == Z_OK;
+	}
+	~HttpSinkInflate() { inflateEnd(&z); }
+	int write(byte* p, int n)
+	{
+		byte out[RECV_BLOCK_SIZE];
+		z.next_in = p;
+		z.avail_in = n;
+		while (ok)
+		{
+			z.next_out = out;
+			z.avail_out = sizeof(out);
+			int r = inflate(&z, Z_NO_FLUSH);
+			if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+				ok = false;
+			int m = sizeof(out) - z.avail_out;
+			size += m;
+			if (maxSize && size > maxSize)
+				ok = false;
+			else if (m > 0 && target->write(out, m) < m)
+				ok = false;
+			if (r == Z_STREAM_END || z.avail_out != 0)
+				break;
+		}
+		return ok ? n : -1;
+	}
+	void use(HttpMessage* m)
+	{
+		maxSize = m->_maxSize;
+		target->use(m);
+	}
+};
+
+static bool deflateBody(const ByteArray& data, int level, bool gzip, ByteArray& out)
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, level, Z_DEFLATED, gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+	out.resize((int)deflateBound(&z, data.length()));
+	z.next_in = (Bytef*)data.data();
+	z.avail_in = data.length();
+	z.next_out = out.data();
+	z.avail_out = out.length();
+	int r = deflate(&z, Z_FINISH);
+	out.resize(out.length() - z.avail_out);
+	deflateEnd(&z);
+	return r == Z_STREAM_END;
+}
+
+#endif
+
+static bool acceptsEncoding(const String& header, const char* name)
+{
+	Array<String> items = header.split(',');
+	foreach(const String& item, items)
+	{
+		Array<String> parts = item.split(';');
+		if (parts[0].trim() == name)
+			return parts.length() < 2 || !parts[1].trim().startsWith("q=") || (double)parts[1].trim().substring(2) > 0;
+	}
+	return false;
+}
+
 HttpMessage::HttpMessage() : _proto("HTTP/1.1"), _socket(NULL), _fileBody(false), _chunked(false)
 {
 	_sink = new HttpSinkArray(_body);
@@ -173,15 +287,80 @@ HttpMessage::HttpMessage() : _proto("HTTP/1.1"), _socket(NULL), _fileBody(false)
 	_maxSize = 100000000;
 	_status = new HttpStatus;
 	memset(&*_status, 0, sizeof(*_status));
+	_bodyPending = false;
+	_bodyStarted = false;
+	_bodyChunked = false;
+	_bodyLeft = 0;
+	_compressLevel = 0;
+	_compressMin = 0;
 }
 
 Var HttpMessage::json() const
 {
+	if (_bodyPending) // a streamed body is decoded as it is read
+	{
+		// the text is also kept for the query fallback, unless it starts like a JSON object or array (which in a
+		// query would be escaped)
+		XdlParser parser;
+		String text;
+		char buffer[16384];
+		int n, size = 0;
+		bool keep = true, started = false;
+		while ((n = const_cast<HttpMessage*>(this)->readBody(buffer, sizeof(buffer))) > 0)
+		{
+			size += n;
+			if (_maxSize && size > _maxSize)
+				return Var();
+			for (int i = 0; i < n && !started; i++)
+			{
+				if (!myisspace(buffer[i]))
+				{
+					started = true;
+					keep = buffer[i] != '{' && buffer[i] != '[';
+				}
+			}
+			if (keep)
+				text.append(buffer, n);
+			if (!parser.failed())
+				parser.parse(buffer, n);
+		}
+		Var data = parser.end();
+		return data.ok() ? data : Var(Url::parseQuery(text));
+	}
 	String str = _body;
 	Var data = Json::decode(str);
 	return data.ok() ? data : Var(Url::parseQuery(str));
 }
 
+// Appends encoded text to a byte array as it is produced, instead of building a whole string and copying it
+
+struct XdlSinkBytes : public XdlSink
+{
+	ByteArray& bytes;
+	XdlSinkBytes(ByteArray& b) : bytes(b) {}
+	bool write(String& s)
+	{
+		bytes.append((const byte*)*s, s.length());
+		s.clear();
+		return true;
+	}
+};
+
+bool XdlSinkHttp::write(String& s)
+{
+	bool ok = s.length() == 0 || message.write(*s, s.length()) == s.length();
+	s.clear();
+	return ok;
+}
+
+bool HttpMessage::writeJson(const Var& data, Json::Mode mode)
+{
+	if (!hasHeader("Content-Type"))
+		setHeader("Content-Type", "application/json");
+	XdlSinkHttp sink(*this);
+	return Json::write(data, sink, mode);
+}
+
 void HttpMessage::put(const Var& body)
 {
 	if (header("Content-Type") == "application/x-www-form-urlencoded")
@@ -193,7 +372,10 @@ void HttpMessage::put(const Var& body)
 	}
 	else
 	{
-		put(Json::encode(body));
+		ByteArray data;
+		XdlSinkBytes sink(data);
+		Json::write(body, sink);
+		put(data);
 		setHeader("Content-Type", "application/json");
 	}
 }
@@ -262,6 +444,76 @@ void HttpMessage::readHeaders()
 	}
 }
 
+void HttpMessage::beginBody()
+{
+	_bodyStarted = true;
+	_bodyChunked = header("Transfer-Encoding") == "chunked";
+	_bodyLeft = _bodyChunked ? 0 : (Long)header("Content-Length");
+	if (header("Expect") == "100-continue")
+	{
+		*_socket << "HTTP/1.1 100 Continue\r\n\r\n";
+		_socket->flush();
+	}
+	_socket->setBlocking(true);
+	_status->totalReceive = _bodyChunked ? 0 : (int)min(_bodyLeft, (Long)0x7fffffff);
+	_status->received = 0;
+}
+
+// Incremental body reading for streamed bodies: each call consumes at most what is buffered or one block
+
+int HttpMessage::readBody(void* buffer, int n)
+{
+	if (!_bodyPending)
+		return 0;
+	if (!_bodyStarted)
+		beginBody();
+
+	if (_bodyChunked && _bodyLeft == 0)
+	{
+		String chunkSize = _socket->readLine();
+		if (_socket->error() || !chunkSize.ok())
+		{
+			_bodyPending = false;
+			return -1;
+		}
+		_bodyLeft = chunkSize.hexToInt();
+		if (_bodyLeft <= 0) // last chunk: skip trailers
+		{
+			String line;
+			do {
+				line = _socket->readLine();
+			} while (line.length() > 1 && !_socket->error());
+			_bodyPending = false;
+			return 0;
+		}
+	}
+
+	int toRead = (int)min((Long)n, _bodyLeft);
+	int buffered = _socket->available();
+	if (buffered > 0 && buffered < toRead)
+		toRead = buffered;
+
+	int bytesRead = toRead > 0 ? _socket->read(buffer, toRead) : 0;
+	if (bytesRead <= 0)
+	{
+		_bodyPending = false;
+		return -1;
+	}
+	_bodyLeft -= bytesRead;
+	_status->received += bytesRead;
+	if (_progress)
+		_progress(*_status);
+
+	if (_bodyLeft == 0)
+	{
+		if (_bodyChunked)
+			_socket->readLine();
+		else
+			_bodyPending = false;
+	}
+	return bytesRead;
+}
+
 void HttpMessage::readBody()
 {
 	Long clength = header("Content-Length");
@@ -310,6 +562,8 @@ void HttpMessage::readBody()
 			if (maxToRead == 0)
 				end = true;
 		}
+		else if (maxToRead <= 0) // readable but nothing to read: the peer closed
+			break;
 		while (maxToRead > 0) {
 			bytesRead = _socket->read(buffer, min(maxToRead, (int)sizeof(buffer)));
 			if (bytesRead <= 0) {
@@ -322,7 +576,10 @@ void HttpMessage::readBody()
 			}
 			currentsize += bytesRead;
 			_status->received = currentsize;
-			_sink->write(buffer, bytesRead);
+			if (_sink->write(buffer, bytesRead) < bytesRead) { // the sink failed or its output is too large
+				_status->status = 1;
+				return;
+			}
 			if(_progress)
 				_progress(*_status);
 			maxToRead -= bytesRead;
@@ -345,6 +602,98 @@ void HttpMessage::readBody()
 	//printf("readbody end\n");
 }
 
+// Client connection pool: idle keep-alive connections by "protocol://host:port"
+
+struct HttpIdleSocket
+{
+	Socket socket;
+	double since;
+};
+
+struct HttpConnectionPool
+{
+	Mutex _mutex;
+	HashMap<String, Array<HttpIdleSocket> > _idle;
+	int _maxIdle;
+	double _timeout;
+
+	HttpConnectionPool() : _maxIdle(0), _timeout(30) {}
+	~HttpConnectionPool() { clear(); }
+
+	// returns an idle connection to that host that is still open, or a null socket
+	Socket get(const String& key)
+	{
+		Lock _(_mutex);
+		Array<HttpIdleSocket>* sockets = _idle.find(key);
+		while (sockets && sockets->length() > 0)
+		{
+			HttpIdleSocket idle = sockets->last();
+			sockets->removeLast();
+			// input on an idle connection means the server closed it (or sent something unexpected); the check does not
+			// block, for TLS it polls the socket and mbedTLS' buffers without reading a record
+			if (now() - idle.since < _timeout && !idle.socket.waitInput(0))
+				return idle.socket;
+			idle.socket.close();
+		}
+		return Socket((Socket::Ptr)NULL);
+	}
+	bool put(const String& key, Socket socket)
+	{
+		Lock _(_mutex);
+		if (_maxIdle <= 0)
+			return false;
+		Array<HttpIdleSocket>& sockets = _idle[key];
+		double t = now();
+		for (int i = sockets.length() - 1; i >= 0; i--)
+		{
+			if (t - sockets[i].since > _timeout)
+			{
+				sockets[i].socket.close();
+				sockets.remove(i);
+			}
+		}
+		if (sockets.length() >= _maxIdle)
+			return false;
+		HttpIdleSocket idle = { socket, t };
+		sockets << idle;
+		return true;
+	}
+	void clear()
+	{
+		Lock _(_mutex);
+		foreach2(String& key, Array<HttpIdleSocket>& sockets, _idle)
+		{
+			(void)key;
+			foreach(HttpIdleSocket& idle, sockets)
+				idle.socket.close();
+		}
+		_idle.clear();
+	}
+};
+
+static HttpConnectionPool& httpPool()
+{
+	static HttpConnectionPool pool;
+	return pool;
+}
+
+void Http::setConnectionPool(int maxIdle, double idleTimeout)
+{
+	HttpConnectionPool& pool = httpPool();
+	{
+		Lock _(pool._mutex);
+		pool._maxIdle = maxIdle;
+		pool._timeout = idleTimeout;
+	}
+	if (maxIdle <= 0)
+		pool.clear();
+}
+
+void Http::closeIdleConnections()
+{
+	httpPool().clear();
+}
+
 HttpResponse Http::request(HttpRequest& request)
 {
 	Socket socket((Socket::Ptr)NULL);
@@ -356,23 +705,35 @@ HttpResponse Http::request(HttpRequest& request)
 
 	if (url.protocol == "https")
 	{
-#ifdef ASL_TLS
-		socket = TlsSocket();
-		if (!hasPort) url.port = 443;
-#else
+#ifndef ASL_TLS
 		response.setSockError("SOCKET_NO_TLS_AVAILABLE");
 		return response;
 #endif
+		if (!hasPort) url.port = 443;
 	}
-	else {
-		socket = Socket();
-		if (!hasPort) url.port = 80;
+	else if (!hasPort)
+		url.port = 80;
+
+	String poolKey = url.protocol + "://" + url.host + ':' + String(url.port);
+	socket = httpPool().get(poolKey);
+	bool reused = socket.ptr() != NULL;
+	const String& method = request.method();
+	bool idempotent = method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
+
+	if (!reused)
+	{
+#ifdef ASL_TLS
+		if (url.protocol == "https")
+			socket = TlsSocket();
+		else
+#endif
+			socket = Socket();
 	}
 
 	response.use(socket);
 	request.use(socket);
 
-	if (!socket.connect(url.host, url.port)) {
+	if (!reused && !socket.connect(url.host, url.port)) {
 		//printf("Cannot connect to %s : %i\n", *url.host, url.port);
 		socket.close();
 		response.setSockError(socket.errorMsg());
@@ -387,15 +748,28 @@ HttpResponse Http::request(HttpRequest& request)
 	title << request.method() << ' ' << url.path << " HTTP/1.1\r\nHost: " << url.host;
 	if (hasPort)
 		title << ':' << url.port;
+#ifdef ASL_ZLIB
+	bool decode = !request.hasHeader("Accept-Encoding");
+	if (decode)
+		title << "\r\nAccept-Encoding: gzip, deflate";
+#endif
 	request._command = title;
 
-	if (!request.write())
+	bool written = request.write();
+	String line = written ? socket.readLine() : String();
+	if (!line.ok() && reused && idempotent) // the server may have closed the idle connection meanwhile, retry
+	{
+		socket.close();
+		request._headersSent = false;
+		return Http::request(request);
+	}
+
+	if (!written)
 	{
 		response.setSockError(socket.errorMsg());
 		return response;
 	}
 	
-	String line = socket.readLine();
 	if (!line.ok()) {
 		socket.close();
 		response.setSockError(socket.errorMsg());
@@ -436,14 +810,47 @@ HttpResponse Http::request(HttpRequest& request)
 
 	response.onProgress(request._progress);
 	response.useSink(request._sink);
+#ifdef ASL_ZLIB
+	String encoding = response.header("Content-Encoding");
+	if (decode && (encoding == "gzip" || encoding == "deflate"))
+		response.useSink(new HttpSinkInflate(request._sink));
+#endif
 
 	response.readBody();
 
-	socket.close();
+	// keep the connection if the body was delimited and fully read, and the server did not ask to close
+	String conn = response.header("Connection").toLowerCase();
+	bool delimited = response.hasHeader("Content-Length") || response.header("Transfer-Encoding") == "chunked" ||
+		code == 204 || code == 304;
+	bool keep = delimited && method != "HEAD" && response.status() == 0 && !socket.error() && conn != "close" &&
+		(parts[0] != "HTTP/1.0" || conn == "keep-alive");
+	if (!keep || !httpPool().put(poolKey, socket))
+		socket.close();
 	return response;
 }
 
 
+void HttpRequest::readContent()
+{
+	if (header("Expect") == "100-continue")
+	{
+		if ((Long)header("Content-Length") < _maxSize)
+			*_socket << "HTTP/1.1 100 Continue\r\n\r\n";
+		else
+			*_socket << "HTTP/1.1 417 Too Large\r\n\r\n";
+		_socket->flush(); // the client waits for it before sending the body, it cannot stay corked
+	}
+	
+	if((Long)header("Content-Length") > _maxSize) 
+	{
+		*_socket << "HTTP/1.1 413 Request Entity Too Large\r\n\r\n";
+		_status->status = 1;
+		return;
+	}
+
+	readBody();
+}
+
 void HttpRequest::read()
 {
 	_addr = _socket->remoteAddress();
@@ -461,29 +868,12 @@ void HttpRequest::read()
 	_proto = _command.substring(j + 1).trim();
 
 	readHeaders();
-	
-	if (header("Expect") == "100-continue")
-	{
-		if ((Long)header("Content-Length") < _maxSize)
-			*_socket << "HTTP/1.1 100 Continue\r\n\r\n";
-		else
-			*_socket << "HTTP/1.1 417 Too Large\r\n\r\n";
-	}
-	
-	if((Long)header("Content-Length") > _maxSize) 
-	{
-		*_socket << "HTTP/1.1 413 Request Entity Too Large\r\n\r\n";
-		_status->status = 1;
-		return;
-	}
 
-	readBody();
-	/*
-	if(_body.length() > 0) // dump
-	{
-		File("bb.txt").put(_body);
-	}
-	*/
+	if (_deferBody)
+		_bodyPending = header("Transfer-Encoding") == "chunked" || (Long)header("Content-Length") > 0;
+	else
+		readContent();
+
 	int pathend = _res.length();
 	int h = _res.indexOf('#');
 	if (h > 0)
@@ -540,9 +930,27 @@ HttpResponse::HttpResponse(const HttpRequest& r)
 		_proto = r._proto;
 	_headersSent = false;
 	_maxSize = r._maxSize;
+	_acceptEncoding = r.header("Accept-Encoding");
 	setCode(200);
 }
 
+void HttpResponse::setCompression(int level, int minSize)
+{
+#ifdef ASL_ZLIB
+	_compressLevel = clamp(level, 0, 9);
+	_compressMin = minSize;
+	_encoding = acceptsEncoding(_acceptEncoding, "gzip") ? "gzip" : acceptsEncoding(_acceptEncoding, "deflate") ? "deflate" : "";
+#else
+	(void)level;
+	(void)minSize;
+#endif
+}
+
+bool HttpRequest::acceptsEncoding(const char* name) const
+{
+	return asl::acceptsEncoding(header("Accept-Encoding"), name);
+}
+
 void HttpResponse::setCode(int code)
 {
 	_code = code;
@@ -571,8 +979,29 @@ void HttpMessage::useSink(const Shared<HttpSink>& s)
 	_sink->use(this);
 }
 
-bool HttpMessage::sendHeaders()
+// whether the body should be compressed if the client accepts it (size -1 if unknown)
+
+bool HttpMessage::compressible(int size)
 {
+	if (_compressLevel <= 0 || (size >= 0 && size < _compressMin) || hasHeader("Content-Encoding"))
+		return false;
+	String type = header("Content-Type");
+	return type.startsWith("text/") || type.contains("json") || type.contains("javascript") || type.contains("xml");
+}
+
+String HttpMessage::headerBlock()
+{
+#ifdef ASL_ZLIB
+	if (!_encoder && !hasHeader("Content-Length") && compressible(-1))
+	{
+		setHeader("Vary", "Accept-Encoding");
+		if (_encoding != "")
+		{
+			setHeader("Content-Encoding", _encoding);
+			_encoder = new HttpSinkDeflate(this, _compressLevel, _encoding == "gzip");
+		}
+	}
+#endif
 	String s(50 + _headers.length() * 64, 0);
 	s << _command << "\r\n";
 	foreach2(String& name, String& value, _headers)
@@ -580,13 +1009,19 @@ bool HttpMessage::sendHeaders()
 		s << name << ": " << value << "\r\n";
 	}
 	s << "\r\n";
+	String contentlength = header("Content-Length");
+	_chunked = !contentlength.ok();
+	_status->totalSend = _chunked ? 0 : int(contentlength);
+	return s;
+}
+
+bool HttpMessage::sendHeaders()
+{
+	String s = headerBlock();
 	int sent = _socket->write(*s, s.length());
 	if (sent < s.length())
 		return false;
 	_headersSent = true;
-	String contentlength = header("Content-Length");
-	_chunked = !contentlength.ok();
-	_status->totalSend = _chunked ? 0 : int(contentlength);
 	return true;
 }
 
@@ -594,32 +1029,97 @@ bool HttpMessage::write()
 {
 	if (_fileBody)
 		return putFile(_body);
-	else
-		return write(_body.data(), _body.length()) > 0;
+#ifdef ASL_ZLIB
+	if (!_headersSent && (int)header("Content-Length") == _body.length() && compressible(_body.length()))
+	{
+		setHeader("Vary", "Accept-Encoding");
+		ByteArray data;
+		if (_encoding != "" && deflateBody(_body, _compressLevel, _encoding == "gzip", data) && data.length() < _body.length())
+		{
+			setHeader("Content-Encoding", _encoding);
+			setHeader("Content-Length", data.length());
+			return write(data.data(), data.length()) > 0;
+		}
+	}
+#endif
+	return write(_body.data(), _body.length()) > 0;
 }
 
 int HttpMessage::write(const void* buffer, int n)
 {
+	String head;
 	if (!_headersSent)
-		if (!sendHeaders())
-			return false;
+	{
+		if (n == 0)
+			return sendHeaders();
+		if (!hasHeader("Content-Length") && !hasHeader("Transfer-Encoding"))
+			setHeader("Transfer-Encoding", "chunked");
+		head = headerBlock();
+	}
+	if (!_encoder)
+		return writeBlock(buffer, n, head);
+	if (n == 0)
+		return 1;
+	if (head.length() > 0)
+	{
+		if (_socket->write(*head, head.length()) < head.length())
+			return 0;
+		_headersSent = true;
+	}
+	return _encoder->write((byte*)buffer, n) < 0 ? 0 : n;
+}
+
+void HttpMessage::finish()
+{
+	if (!_headersSent)
+		return;
+	if (_encoder)
+	{
+		_encoder->write(NULL, 0);
+		_encoder = Shared<HttpSink>();
+	}
+	if (_chunked)
+	{
+		_socket->write("0\r\n\r\n", 5);
+		_chunked = false;
+	}
+}
+
+// Headers (if not sent yet), chunk framing and each body block go out in a single gathered write
+
+int HttpMessage::writeBlock(const void* buffer, int n, const String& head)
+{
+	bool withHead = head.length() > 0;
 	int sent = n == 0 ? 1 : 0;
 	const char* p = (const char*)buffer;
 	while (n > 0)
 	{
 		int m = min(n, SEND_BLOCK_SIZE);
+		char prefix[16];
+		SocketBuf bufs[4];
+		int k = 0;
+		if (withHead)
+			bufs[k++] = SocketBuf(*head, head.length());
 		if (_chunked)
-			*_socket << String::f("%x\r\n", m);
-		int written = _socket->write(p, m);
-		if (written != m)
+			bufs[k++] = SocketBuf(prefix, snprintf(prefix, sizeof(prefix), "%x\r\n", m));
+		bufs[k++] = SocketBuf(p, m);
+		if (_chunked)
+			bufs[k++] = SocketBuf("\r\n", 2);
+		int total = 0;
+		for (int i = 0; i < k; i++)
+			total += bufs[i].length;
+		if (_socket->write(bufs, k) != total)
 			return sent;
-		_status->sent += written;
+		if (withHead)
+		{
+			_headersSent = true;
+			withHead = false;
+		}
+		_status->sent += m;
 		if (_progress)
 			_progress(*_status);
 
-		sent += written;
-		if (_chunked)
-			*_socket << "\r\n";
+		sent += m;
 		n -= m;
 		p += m;
 	}
@@ -642,6 +1142,22 @@ void HttpMessage::writeFile(const String& path, int begin, int end)
 	//HttpStatus status;
 	//status.sent = 0;
 	//status.totalSend = (int)size;
+	if (!_chunked) // zero-copy if the socket supports it, otherwise copy below
+	{
+		while (bytesSent < (int)size)
+		{
+			Long m = _socket->sendFile(file, begin + bytesSent, min((int)size - bytesSent, SEND_BLOCK_SIZE * 8));
+			if (m < 0)
+				break;
+			if (m == 0)
+				return;
+			bytesSent += (int)m;
+			_status->sent += (int)m;
+			if (_progress)
+				_progress(*_status);
+		}
+		file.seek(begin + bytesSent);
+	}
 	while(n > 0 && bytesSent < (int)size)
 	{
 		char buf[RECV_BLOCK_SIZE];
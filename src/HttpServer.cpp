@@ -5,11 +5,211 @@
 #include <asl/WebSocket.h>
 #include <asl/Map.h>
 #include <asl/File.h>
+#include <asl/HashMap.h>
+#include <asl/Mutex.h>
 
 namespace asl {
 
 bool verbose = false;
 
+// Static file cache: keeps small files in memory with their precompressed siblings, evicting the least recently
+// used ones when over budget, and revalidating them against the file's modification time at intervals
+
+struct HttpCachedFile
+{
+	ByteArray content, gz, br;
+	String etag, lastModified, mime;
+	double mtime;
+	Long size;
+	double checked;
+	Long used;
+	int bytes() const { return content.length() + gz.length() + br.length(); }
+};
+
+struct HttpFileCache
+{
+	HashMap<String, HttpCachedFile*> _files;
+	Mutex _mutex;
+	Long _budget, _bytes, _clock;
+	double _interval;
+
+	HttpFileCache(Long budget, double interval) : _budget(budget), _bytes(0), _clock(0), _interval(interval) {}
+	~HttpFileCache()
+	{
+		foreach2(String& path, HttpCachedFile* f, _files)
+		{
+			(void)path;
+			delete f;
+		}
+	}
+	// gets the cached file at path, loading it if needed; returns false if the file cannot be cached
+	bool get(const String& path, const String& mime, HttpCachedFile& file)
+	{
+		double t = now();
+		{
+			Lock _(_mutex);
+			HttpCachedFile* f = _files.get(path, NULL);
+			if (f && (t - f->checked < _interval || fresh(path, f)))
+			{
+				f->checked = max(f->checked, t);
+				f->used = ++_clock;
+				file = *f;
+				return true;
+			}
+		}
+		HttpCachedFile* f = load(path, mime);
+		if (!f)
+		{
+			Lock _(_mutex);
+			remove(path);
+			return false;
+		}
+		f->checked = t;
+		file = *f;
+		Lock _(_mutex);
+		remove(path);
+		f->used = ++_clock;
+		_files[path] = f;
+		_bytes += f->bytes();
+		evict();
+		return true;
+	}
+	static bool fresh(const String& path, const HttpCachedFile* f)
+	{
+		File file(path);
+		return file.isFile() && file.lastModified().time() == f->mtime && file.size() == f->size;
+	}
+	HttpCachedFile* load(const String& path, const String& mime)
+	{
+		File file(path);
+		if (!file.isFile() || file.size() > _budget / 4)
+			return NULL;
+		HttpCachedFile* f = new HttpCachedFile;
+		f->mtime = file.lastModified().time();
+		f->size = file.size();
+		f->content = file.content();
+		if (f->content.length() != f->size)
+		{
+			delete f;
+			return NULL;
+		}
+		f->gz = sibling(path + ".gz", f->mtime);
+		f->br = sibling(path + ".br", f->mtime);
+		f->etag = String::f("\"%llx-%llx\"", (unsigned long long)(f->mtime * 1000), (unsigned long long)f->size);
+		f->lastModified = file.lastModified().toString(Date::HTTP);
+		f->mime = mime;
+		return f;
+	}
+	// precompressed variants older than the file are ignored
+	static ByteArray sibling(const String& path, double mtime)
+	{
+		File file(path);
+		if (file.isFile() && file.lastModified().time() >= mtime)
+			return file.content();
+		return ByteArray();
+	}
+	void remove(const String& path)
+	{
+		HttpCachedFile* f = _files.get(path, NULL);
+		if (!f)
+			return;
+		_bytes -= f->bytes();
+		_files.remove(path);
+		delete f;
+	}
+	void evict()
+	{
+		while (_bytes > _budget && _files.length() > 1)
+		{
+			String oldest;
+			Long used = _clock + 1;
+			foreach2(String& path, HttpCachedFile* f, _files)
+			{
+				if (f->used < used)
+				{
+					used = f->used;
+					oldest = path;
+				}
+			}
+			remove(oldest);
+		}
+	}
+};
+
+// Route table: a tree of path segments, each node with literal children, a parameter child and a wildcard child.
+// Parameter names belong to each route, as routes sharing a parameter node may name it differently.
+
+struct HttpRoute
+{
+	HttpHandler handler;
+	bool stream;
+	Array<String> params; // names of the parameter segments, in order
+};
+
+struct HttpRouteNode
+{
+	HashMap<String, HttpRouteNode*> children;
+	HttpRouteNode* param;
+	HttpRouteNode* wildcard;
+	HashMap<String, HttpRoute*> handlers; // by method
+
+	HttpRouteNode() : param(NULL), wildcard(NULL) {}
+	~HttpRouteNode()
+	{
+		foreach2(String& key, HttpRouteNode* child, children)
+		{
+			(void)key;
+			delete child;
+		}
+		foreach2(String& method, HttpRoute* route, handlers)
+		{
+			(void)method;
+			delete route;
+		}
+		delete param;
+		delete wildcard;
+	}
+	HttpRoute* handler(const String& method)
+	{
+		HttpRoute* const* route = handlers.find(method);
+		if (!route)
+			route = handlers.find("*");
+		return route ? *route : NULL;
+	}
+	// finds the route for the rest of the path, collecting parameter values
+	HttpRoute* match(const String& method, const char* path, Array<String>& values, String& suffix)
+	{
+		while (*path == '/')
+			path++;
+		if (!*path)
+			return handler(method);
+		const char* end = strchr(path, '/');
+		int n = end ? int(end - path) : (int)strlen(path);
+		String segment(path, n);
+		if (HttpRouteNode* const* child = children.find(segment))
+		{
+			if (HttpRoute* route = (*child)->match(method, path + n, values, suffix))
+				return route;
+		}
+		if (param)
+		{
+			values << segment;
+			if (HttpRoute* route = param->match(method, path + n, values, suffix))
+				return route;
+			values.removeLast();
+		}
+		if (wildcard)
+		{
+			if (HttpRoute* route = wildcard->handler(method))
+			{
+				suffix = path;
+				return route;
+			}
+		}
+		return NULL;
+	}
+};
+
 HttpServer::HttpServer(int port):
 	_proto("HTTP/1.1"),
 	_methods("GET, POST, OPTIONS, PUT, DELETE, PATCH, HEAD")
@@ -19,6 +219,11 @@ HttpServer::HttpServer(int port):
 	if (port >= 0)
 		bind(port);
 	_wsserver = NULL;
+	_fileCache = NULL;
+	_routes = NULL;
+	_streamBodies = false;
+	_compressLevel = 0;
+	_compressMin = 1024;
 	_cors = false;
 	_mimetypes = String(
 		"css:text/css,"
@@ -38,105 +243,262 @@ HttpServer::HttpServer(int port):
 		).split(',', ':');
 }
 
+HttpServer::~HttpServer()
+{
+	delete _fileCache;
+	delete _routes;
+}
+
+bool HttpServer::route(const String& method, const String& pattern, const HttpHandler& handler, bool stream)
+{
+	Array<String> segments = pattern.split('/');
+	bool wildcard = false;
+	foreach(String& segment, segments) // a `*` matches the rest of the path, nothing can follow it
+	{
+		if (segment == "")
+			continue;
+		if (wildcard)
+			return false;
+		wildcard = segment == "*";
+	}
+	if (!_routes)
+		_routes = new HttpRouteNode;
+	HttpRouteNode* node = _routes;
+	Array<String> params;
+	foreach(String& segment, segments)
+	{
+		if (segment == "")
+			continue;
+		HttpRouteNode*& next = segment == "*" ? node->wildcard : segment[0] == ':' ? node->param : node->children[segment];
+		if (!next)
+			next = new HttpRouteNode;
+		if (segment[0] == ':')
+			params << segment.substring(1);
+		node = next;
+		if (segment == "*")
+			break;
+	}
+	HttpRoute*& route = node->handlers[method];
+	if (!route)
+		route = new HttpRoute;
+	route->handler = handler;
+	route->stream = stream;
+	route->params = params;
+	return true;
+}
+
+HttpRoute* HttpServer::findRoute(HttpRequest& request)
+{
+	if (!_routes)
+		return NULL;
+	Array<String> values;
+	String suffix;
+	HttpRoute* route = _routes->match(request.method(), *request.path(), values, suffix);
+	if (!route)
+		return NULL;
+	request._argument = suffix;
+	request._params.clear();
+	for (int i = 0; i < values.length(); i++)
+		request._params[route->params[i]] = values[i];
+	return route;
+}
+
+bool HttpServer::dispatch(HttpRequest& request, HttpResponse& response)
+{
+	HttpRoute* route = findRoute(request);
+	if (!route)
+		return false;
+	route->handler(request, response);
+	return true;
+}
+
+void HttpServer::setFileCache(int maxBytes, double checkInterval)
+{
+	delete _fileCache;
+	_fileCache = maxBytes > 0 ? new HttpFileCache(maxBytes, checkInterval) : NULL;
+}
+
 void HttpServer::addMimeType(const String& ext, const String& type)
 {
 	_mimetypes[ext] = type;
 }
 
+// Requests already received (pipelined) are answered back to back with their responses held in the corked socket,
+// which is flushed when no more input is pending
+
 void HttpServer::serve(Socket client)
 {
-	double t1 = now();
-	while(client.connected() && now() - t1 < 10.0 && !_requestStop)
+	double t1 = now(), t2 = t1;
+	client.cork();
+	while(client.connected() && !_requestStop)
 	{
-		if (!client.waitData(5))
+		double t = now();
+		if ((_idleTimeout > 0 && t - t2 > _idleTimeout) || (_lifetime > 0 && t - t1 > _lifetime))
+			break;
+		if (!client.waitData(1))
 			continue;
 
-		HttpRequest request(client);
-		request.setMaxSize(_maxUploadSize);
-		request.read();
-
-		if (client.error() || !request.method().ok() || !request.path().ok() || !request.protocol().ok() || request.status() != 0)
+		if (!serveRequest(client))
 			break;
+		if (client.available() <= 0)
+			client.flush();
+		t2 = now();
+	}
+	client.cork(false);
+}
+
+// Connections upgraded to WebSocket are then served by the linked WebSocket server
+
+bool HttpServer::serveInput(Socket client)
+{
+	bool keep;
+	if (_wsserver && _wsserver->pollClient(client, keep))
+		return keep;
+	client.cork();
+	do
+	{
+		keep = serveRequest(client, true);
+	} while (keep && !_requestStop && client.available() > 0 && !(_wsserver && _wsserver->pollClient(client, keep)));
+	client.cork(false);
+	return keep;
+}
 
-		String hconn = request.header("Connection").toLowerCase();
+void HttpServer::serveClose(Socket client)
+{
+	if (_wsserver)
+		_wsserver->serveClose(client);
+}
 
-		if (request.header("Upgrade") == "websocket" && _wsserver)
+bool HttpServer::serveRequest(Socket& client, bool async)
+{
+	HttpRequest request(client);
+	request.setMaxSize(_maxUploadSize);
+	request._deferBody = true;
+	request.read();
+
+	if (client.error() || !request.method().ok() || !request.path().ok() || !request.protocol().ok())
+		return false;
+
+	HttpRoute* route = findRoute(request);
+
+	if (!(route ? route->stream : _streamBodies))
+	{
+		request._bodyPending = false;
+		request.readContent();
+	}
+
+	if (client.error() || request.status() != 0)
+		return false;
+
+	String hconn = request.header("Connection").toLowerCase();
+
+	if (request.header("Upgrade") == "websocket" && _wsserver)
+	{
+		if(verbose) printf("handing over to ws\n");
+		client.cork(false);
+		if (!async)
 		{
-			if(verbose) printf("handing over to ws\n");
 			_wsserver->process(client, request.headers());
-			return;
+			return false;
 		}
+		if (!_wsserver->process(client, request.headers(), true))
+			return false;
+		setIdleTimeout(client, _wsserver->_idleTimeout); // the WebSocket server's timeout applies from now on
+		return true;
+	}
 
-		HttpResponse response(request);
+	HttpResponse response(request);
 
-		if (_cors && request.hasHeader("Origin"))
-		{
-			response.setHeader("Access-Control-Allow-Origin", request.header("Origin"));
-			response.setHeader("Access-Control-Allow-Credentials", "true");
-		}
+	if (_cors && request.hasHeader("Origin"))
+	{
+		response.setHeader("Access-Control-Allow-Origin", request.header("Origin"));
+		response.setHeader("Access-Control-Allow-Credentials", "true");
+	}
 
-		if (hconn == "keep-alive")
-			response.setHeader("Connection", "keep-alive");
+	if (hconn == "keep-alive")
+		response.setHeader("Connection", "keep-alive");
 
-		if (!handleOptions(request, response))
-		{
-			serve(request, response);
+	if (_compressLevel > 0)
+		response.setCompression(_compressLevel, _compressMin);
 
-			if (!response.body())
-				response.put("");
+	bool keep = !((request.protocol() == "HTTP/1.0" && hconn != "keep-alive") || hconn == "close");
 
-			if (response.code() == 405)
-				response.setHeader("Allow", _methods);
+	if (!handleOptions(request, response))
+	{
+		if (route)
+			route->handler(request, response);
+		else
+			serve(request, response);
 
-			if (response.containsFile())
+		if (request.bodyPending()) // discard what the handler did not read, unless it is too much
+		{
+			// a client expecting 100 Continue has not sent the body: close rather than ask for it just to discard it
+			bool unsent = !request._bodyStarted && request.header("Expect") == "100-continue";
+			byte buffer[4096];
+			int left = unsent ? 0 : 65536, n;
+			while (left > 0 && (n = request.readBody(buffer, sizeof(buffer))) > 0)
+				left -= n;
+			if (request.bodyPending())
 			{
-				File file(response.text());
-				if (!file.isFile())
-				{
-					response.setCode(404);
-					response.setHeader("Content-Type", "text/plain");
-					response.put("Not found");
-					response.write();
-					continue;
-				}
+				keep = false;
+				response.setHeader("Connection", "close");
+			}
+		}
 
-				String mime = _mimetypes.get(file.extension(), "text/plain");
-				response.setHeader("Date", Date::now().toString(Date::HTTP));
-				if (!response.hasHeader("Content-Type"))
-					response.setHeader("Content-Type", mime);
-				
-				if (!response.hasHeader("Cache-Control"))
-					response.setHeader("Cache-Control", "max-age=60, public");
-				
-				if (request.hasHeader("Range"))
-				{
-					String range = request.header("Range");
-					if (range.startsWith("bytes=") && !range.contains(',')) // no multiple ranges
-					{
-						Array<String> parts = range.substr(6).split('-');
-						int begin = parts[0];
-						int end = parts[1];
-						response.setCode(206);
-						response.setHeader("Content-Range", "+");
-						response.putFile(file.path(), begin, end);
-					}
-				}
-				else
-					response.putFile(file.path());
+		if (!response.body())
+			response.put("");
+
+		if (response.code() == 405)
+			response.setHeader("Allow", _methods);
 
-				if (response.hasHeader("Content-Range") && response.header("Content-Range").contains('*'))
+		if (response.containsFile())
+		{
+			File file(response.text());
+			if (!file.isFile())
+			{
+				response.setCode(404);
+				response.setHeader("Content-Type", "text/plain");
+				response.put("Not found");
+				response.write();
+				return keep;
+			}
+
+			String mime = _mimetypes.get(file.extension(), "text/plain");
+			response.setHeader("Date", Date::now().toString(Date::HTTP));
+			if (!response.hasHeader("Content-Type"))
+				response.setHeader("Content-Type", mime);
+			
+			if (!response.hasHeader("Cache-Control"))
+				response.setHeader("Cache-Control", "max-age=60, public");
+			
+			if (request.hasHeader("Range"))
+			{
+				String range = request.header("Range");
+				if (range.startsWith("bytes=") && !range.contains(',')) // no multiple ranges
 				{
-					response.setCode(416);
-					response.write();
+					Array<String> parts = range.substr(6).split('-');
+					int begin = parts[0];
+					int end = parts[1];
+					response.setCode(206);
+					response.setHeader("Content-Range", "+");
+					response.putFile(file.path(), begin, end);
 				}
 			}
 			else
+				response.putFile(file.path());
+
+			if (response.hasHeader("Content-Range") && response.header("Content-Range").contains('*'))
+			{
+				response.setCode(416);
 				response.write();
+			}
 		}
-		
-		if ((request.protocol() == "HTTP/1.0" && hconn != "keep-alive") || hconn == "close")
-			break;
+		else
+			response.write();
+		response.finish();
 	}
+	
+	return keep;
 }
 
 void HttpServer::setRoot(const String& root)
@@ -154,6 +516,8 @@ void HttpServer::serveFile(HttpRequest& request, HttpResponse& response)
 			path += "index.html";
 
 		String localpath = _webroot + path;
+		if (_fileCache && !request.hasHeader("Range") && serveCachedFile(request, response, localpath))
+			return;
 		File file(localpath);
 		if (file.isDirectory())
 		{
@@ -188,6 +552,48 @@ void HttpServer::serveFile(HttpRequest& request, HttpResponse& response)
 	}
 }
 
+bool HttpServer::serveCachedFile(HttpRequest& request, HttpResponse& response, const String& localpath)
+{
+	HttpCachedFile file;
+	String mime = _mimetypes.get(File(localpath).extension(), "text/plain");
+	if (!_fileCache->get(localpath, mime, file))
+		return false;
+
+	const ByteArray* body = &file.content;
+	String etag = file.etag;
+	if (file.br.length() > 0 && request.acceptsEncoding("br"))
+	{
+		body = &file.br;
+		response.setHeader("Content-Encoding", "br");
+		etag = etag.substring(0, etag.length() - 1) + "-br\"";
+	}
+	else if (file.gz.length() > 0 && request.acceptsEncoding("gzip"))
+	{
+		body = &file.gz;
+		response.setHeader("Content-Encoding", "gzip");
+		etag = etag.substring(0, etag.length() - 1) + "-gz\"";
+	}
+	if (file.gz.length() > 0 || file.br.length() > 0)
+		response.setHeader("Vary", "Accept-Encoding");
+
+	response.setHeader("Date", Date::now().toString(Date::HTTP));
+	response.setHeader("Last-Modified", file.lastModified);
+	response.setHeader("ETag", etag);
+	if (!response.hasHeader("Cache-Control"))
+		response.setHeader("Cache-Control", "max-age=60, public");
+
+	if (request.hasHeader("If-None-Match") ? request.header("If-None-Match") == etag :
+		request.hasHeader("If-Modified-Since") && file.mtime <= Date(request.header("If-Modified-Since")).time() + 1.0)
+	{
+		response.setCode(304);
+		return true;
+	}
+	if (!response.hasHeader("Content-Type"))
+		response.setHeader("Content-Type", file.mime);
+	response.put(*body);
+	return true;
+}
+
 void HttpServer::addMethod(const String& verb)
 {
 	if (!_methods.ok())
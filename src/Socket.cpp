@@ -22,10 +22,17 @@ struct IUnknown; // Workaround for "combaseapi.h(229): error C2187: syntax error
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <errno.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
 #ifndef ASL_SOCKET_LOCAL
 #define ASL_SOCKET_LOCAL
 #endif
@@ -51,6 +58,10 @@ struct IUnknown; // Workaround for "combaseapi.h(229): error C2187: syntax error
 #define MSG_NOSIGNAL 0
 #endif
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define ASL_SOCKET_MMSG
+#endif
+
 static void verbose_print(...) {}
 //#define verbose_print printf
 
@@ -383,6 +394,8 @@ Socket_::Socket_()
 	_type = TCP;
 	_blocking = true;
 	_endian = ENDIAN_NATIVE;
+	_inpos = _inend = 0;
+	_corked = false;
 }
 
 Socket_::Socket_(int fd)
@@ -397,6 +410,8 @@ Socket_::Socket_(int fd)
 	_type = TCP;
 	_blocking = true;
 	_endian = ENDIAN_NATIVE;
+	_inpos = _inend = 0;
+	_corked = false;
 }
 
 bool Socket_::init(bool force)
@@ -419,6 +434,7 @@ void Socket_::close()
 		closesocket(_handle);
 #endif
 	_handle = -1;
+	_inpos = _inend = 0;
 }
 
 bool Socket_::bind(const String& ip, int port)
@@ -518,7 +534,7 @@ void Socket::enableBroadcast(bool on)
 	setOption(SOL_SOCKET, SO_BROADCAST, on ? 1ul : 0);
 }
 
-int Socket_::available()
+int Socket_::availableRaw()
 {
 	if (_error != 0 || _handle < 0)
 		return -1;
@@ -534,50 +550,137 @@ int Socket_::available()
 		return -1;
 }
 
+int Socket_::available()
+{
+	int n = availableRaw();
+	return buffered() > 0 ? buffered() + max(n, 0) : n;
+}
+
+int Socket_::readRaw(void* data, int size)
+{
+#ifdef _WIN32
+	return recv(_handle, (char*)data, size, 0);
+#else
+	return (int)::read(_handle, (char*)data, size);
+#endif
+}
+
+int Socket_::readRawSome(void* data, int size)
+{
+	if (_handle < 0)
+		return -1;
+#ifdef _WIN32
+	if (!waitInput(0))
+		return 0;
+	int r = ::recv(_handle, (char*)data, size, 0);
+#else
+	int r = (int)::recv(_handle, data, size, MSG_DONTWAIT);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+#endif
+	return r > 0 ? r : -1;
+}
+
+int Socket_::readSome(void* data, int size)
+{
+	if (buffered() > 0)
+	{
+		int s = min(size, buffered());
+		memcpy(data, &_inbuf[_inpos], s);
+		_inpos += s;
+		return s;
+	}
+	return readRawSome(data, size);
+}
+
+// Receives whatever is available (up to the buffer size) into the input buffer, which must be empty
+
+int Socket_::fillBuffer()
+{
+	if (_inbuf.length() == 0)
+		_inbuf.resize(4096);
+	_inpos = 0;
+	int n = readRaw(_inbuf.data(), _inbuf.length());
+	_inend = max(n, 0);
+	return n;
+}
+
+const byte* Socket_::peek(int& n)
+{
+	if (buffered() == 0 && _error == 0 && waitInput() && fillBuffer() <= 0 && _blocking)
+		_error = SOCKET_BAD_RECV;
+	n = buffered();
+	return _inbuf.data() + _inpos;
+}
+
 String Socket_::readLine()
 {
-	char c;
 	String s;
-	if (available()>0 || waitInput())
+	if (buffered() > 0 || available() > 0 || waitInput())
 	{
-		while (1)
+		while (_error == 0)
 		{
-			int n = read(&c, 1);
-			if (n <= 0 || c == '\n' || _error != 0)
+			if (buffered() == 0 && fillBuffer() <= 0)
+			{
+				if (_blocking)
+					_error = SOCKET_BAD_RECV;
 				break;
-			if (s.length() > 16000)
+			}
+			const char* p = (const char*)&_inbuf[_inpos];
+			const char* end = (const char*)memchr(p, '\n', buffered());
+			int n = end ? int(end - p) : buffered();
+			if (s.length() + n > 16000)
 			{
 				_error = SOCKET_BAD_LINE;
 				s = "";
 				break;
 			}
-			s += c;
+			s.append(p, n);
+			_inpos += end ? n + 1 : n;
+			if (end)
+				break;
 		}
+		if (_type == PACKET) // don't mix datagrams
+			_inpos = _inend;
 	}
 	return s;
 }
 
 int Socket_::read(void* data, int size)
 {
-		int s = 0, size0 = size;
-		do
+	int s = 0;
+	if (buffered() > 0)
+	{
+		s = min(size, buffered());
+		memcpy(data, &_inbuf[_inpos], s);
+		_inpos += s;
+		if (s == size || !_blocking)
+			return s;
+	}
+	while (s < size)
+	{
+		int n;
+		if (size - s < 1024 && _type != PACKET) // small reads go through the buffer to save syscalls
 		{
-#ifdef _WIN32
-		int n = recv(_handle, (char*)data, size, 0);
-#else
-		int n = ::read(_handle, (char*)data, size);
-#endif
+			n = fillBuffer();
+			if (n > 0)
+			{
+				n = min(size - s, n);
+				memcpy((char*)data + s, &_inbuf[_inpos], n);
+				_inpos += n;
+			}
+		}
+		else
+			n = readRaw((char*)data + s, size - s);
 		if (!_blocking)
 			return n;
-			if (n <= 0)
-			{
+		if (n <= 0)
+		{
 			_error = SOCKET_BAD_RECV;
 			break;
 		}
-		data = (char*)data + n;
 		s += n;
-		size -= n;
-	} while (s < size0);
+	}
 	return s;
 }
 
@@ -607,6 +710,201 @@ int Socket_::write(const void* data, int size)
 	return s;
 }
 
+int Socket_::writeSome(const void* data, int n)
+{
+	if (_handle < 0)
+		return -1;
+	if (n == 0)
+		return 0;
+#ifdef _WIN32
+	if (!waitOutput(0))
+		return 0;
+	int r = ::send(_handle, (const char*)data, n, 0);
+#else
+	int r = (int)::send(_handle, data, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+#endif
+	if (r < 0)
+		_error = SOCKET_BAD_DATA;
+	return r;
+}
+
+int Socket_::writev(const SocketBuf* bufs, int count)
+{
+	int s = 0, i = 0, offset = 0;
+	while (i < count)
+	{
+		int k = 0;
+#ifdef _WIN32
+		WSABUF iov[64];
+		for (int j = i; j < count && k < 64; j++, k++)
+		{
+			iov[k].buf = (CHAR*)bufs[j].data + (j == i ? offset : 0);
+			iov[k].len = (ULONG)(bufs[j].length - (j == i ? offset : 0));
+		}
+		DWORD sent = 0;
+		int n = WSASend(_handle, iov, k, &sent, 0, NULL, NULL) == 0 ? (int)sent : -1;
+#else
+		iovec iov[64];
+		for (int j = i; j < count && k < 64; j++, k++)
+		{
+			iov[k].iov_base = (char*)bufs[j].data + (j == i ? offset : 0);
+			iov[k].iov_len = bufs[j].length - (j == i ? offset : 0);
+		}
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = k;
+		int n = (int)sendmsg(_handle, &msg, MSG_NOSIGNAL);
+#endif
+		if (!_blocking)
+			return n;
+		if (n < 0)
+		{
+			_error = SOCKET_BAD_DATA;
+			break;
+		}
+		s += n;
+		while (i < count && n >= bufs[i].length - offset)
+		{
+			n -= bufs[i++].length - offset;
+			offset = 0;
+		}
+		offset += n;
+	}
+	return s;
+}
+
+#ifdef __linux__
+
+// Moves file data to the socket through a pipe, for when sendfile() is not supported
+
+static Long spliceFile(int out, int fd, Long offset, Long count)
+{
+	int p[2];
+	if (pipe(p) != 0)
+		return -1;
+	loff_t off = offset;
+	Long sent = 0;
+	while (sent < count)
+	{
+		ssize_t n = splice(fd, &off, p[1], NULL, (size_t)min(count - sent, (Long)65536), SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			if (sent == 0 && n < 0)
+				sent = -1;
+			break;
+		}
+		while (n > 0)
+		{
+			ssize_t m = splice(p[0], NULL, out, NULL, (size_t)n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0)
+				break;
+			n -= m;
+			sent += m;
+		}
+		if (n > 0)
+			break;
+	}
+	::close(p[0]);
+	::close(p[1]);
+	return sent;
+}
+
+#endif
+
+Long Socket_::sendFile(int fd, Long offset, Long count)
+{
+#ifdef __linux__
+	if (_handle < 0 || !_blocking || _type == PACKET)
+		return -1;
+	off_t off = (off_t)offset;
+	Long sent = 0;
+	while (sent < count)
+	{
+		ssize_t n = ::sendfile(_handle, fd, &off, (size_t)min(count - sent, (Long)0x40000000));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS))
+			return spliceFile(_handle, fd, offset, count);
+		if (n <= 0)
+		{
+			if (n < 0)
+				_error = SOCKET_BAD_DATA;
+			break;
+		}
+		sent += n;
+	}
+	return sent;
+#else
+	return -1;
+#endif
+}
+
+Long Socket::sendFile(File& file, Long offset, Long count)
+{
+	if (!file || !flush())
+		return -1;
+	return _()->sendFile(fileno(file.stdio()), offset, count);
+}
+
+// Output corking: writes are collected up to a limit and sent together in one syscall on flush
+
+#define SOCKET_CORK_SIZE 65536
+
+int Socket_::output(const void* data, int n)
+{
+	if (!_corked)
+		return write(data, n);
+	if (_outbuf.length() + n > SOCKET_CORK_SIZE)
+	{
+		if (!flush())
+			return -1;
+		if (n > SOCKET_CORK_SIZE / 2)
+			return write(data, n);
+	}
+	_outbuf.append((const byte*)data, n);
+	return n;
+}
+
+int Socket_::outputv(const SocketBuf* bufs, int count)
+{
+	int total = 0;
+	for (int i = 0; i < count; i++)
+		total += bufs[i].length;
+	if (!_corked || _outbuf.length() + total > SOCKET_CORK_SIZE)
+	{
+		if (!flush())
+			return -1;
+		return writev(bufs, count);
+	}
+	for (int i = 0; i < count; i++)
+		_outbuf.append((const byte*)bufs[i].data, bufs[i].length);
+	return total;
+}
+
+bool Socket_::flush()
+{
+	if (_outbuf.length() == 0)
+		return true;
+	int n = write(_outbuf.data(), _outbuf.length());
+	bool ok = n == _outbuf.length();
+	_outbuf.clear();
+	return ok;
+}
+
+void Socket_::cork(bool on)
+{
+	if (!on)
+		flush();
+	_corked = on;
+}
+
 ByteArray Socket_::read(int n)
 {
 	ByteArray a((n < 0) ? available() : n);
@@ -618,6 +916,8 @@ bool Socket_::waitInput(double t)
 {
 	if (_handle < 0)
 		return false;
+	if (buffered() > 0)
+		return true;
 	int a = available();
 	if (a > 0)
 		return true;
@@ -626,6 +926,13 @@ bool Socket_::waitInput(double t)
 		_error = SOCKET_BAD_DATA;
 		return true;
 	}
+#ifndef _WIN32
+	// poll() has no limit on descriptor numbers (select() cannot take descriptors beyond FD_SETSIZE)
+	pollfd pfd = { handle(), POLLIN, 0 };
+	int r = ::poll(&pfd, 1, (int)(t * 1000));
+	if (r >= 0)
+		return r > 0;
+#else
 	fd_set rset;
 	timeval to;
 	to.tv_sec = (int)floor(t);
@@ -634,10 +941,34 @@ bool Socket_::waitInput(double t)
 	FD_SET(handle(), &rset);
 	if(select(handle()+1, &rset, 0, 0, &to) >= 0)
 		return FD_ISSET(handle(), &rset)!=0;
+#endif
 	_error = SOCKET_BAD_WAIT;
 	return true;
 }
 
+bool Socket_::waitOutput(double t)
+{
+	if (_handle < 0)
+		return false;
+#ifndef _WIN32
+	pollfd pfd = { handle(), POLLOUT, 0 };
+	int r = ::poll(&pfd, 1, (int)(t * 1000));
+	if (r >= 0)
+		return r > 0;
+#else
+	fd_set wset;
+	timeval to;
+	to.tv_sec = (int)floor(t);
+	to.tv_usec = (int)((t - floor(t)) * 1e6);
+	FD_ZERO(&wset);
+	FD_SET(handle(), &wset);
+	if (select(handle() + 1, 0, &wset, 0, &to) >= 0)
+		return FD_ISSET(handle(), &wset) != 0;
+#endif
+	_error = SOCKET_BAD_WAIT;
+	return false;
+}
+
 String Socket_::errorMsg() const
 {
 	return messages[_error];
@@ -663,6 +994,139 @@ void PacketSocket_::sendTo(const InetAddress& to, const void* data, int n)
 	sendto(_handle, (const char*)data, n, 0, (sockaddr*)to.ptr(), to.length());
 }
 
+PacketBatch::PacketBatch(int count, int size) : _data(count * size), _addrs(count * ADDR_SIZE), _sizes(count),
+	_addrLengths(count), _size(size), _n(0)
+{
+	memset(_addrs.data(), 0, _addrs.length());
+}
+
+InetAddress PacketBatch::address(int i) const
+{
+	const sockaddr* sa = (const sockaddr*)(_addrs.data() + i * ADDR_SIZE);
+	InetAddress a(sa->sa_family == AF_INET6 ? InetAddress::IPv6 : InetAddress::IPv4);
+	memcpy(a.ptr(), sa, a.length());
+	return a;
+}
+
+bool PacketBatch::add(const InetAddress& to, const void* data, int n)
+{
+	if (_n >= capacity() || n > _size || to.length() > ADDR_SIZE)
+		return false;
+	memcpy(this->data(_n), data, n);
+	memcpy(_addrs.data() + _n * ADDR_SIZE, to.ptr(), to.length());
+	_sizes[_n] = n;
+	_addrLengths[_n] = to.length();
+	_n++;
+	return true;
+}
+
+// Returns the message headers for recvmmsg/sendmmsg, pointing to the batch's buffers, followed by their iovecs
+
+void* PacketBatch::headers() const
+{
+#ifdef ASL_SOCKET_MMSG
+	int n = capacity();
+	if (_headers.length() == 0)
+	{
+		_headers.resize(n * int(sizeof(mmsghdr) + sizeof(iovec)));
+		memset(_headers.data(), 0, _headers.length());
+		mmsghdr* msgs = (mmsghdr*)_headers.data();
+		iovec* iov = (iovec*)(msgs + n);
+		for (int i = 0; i < n; i++)
+		{
+			iov[i].iov_base = (void*)data(i);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = (void*)(_addrs.data() + i * ADDR_SIZE);
+		}
+	}
+	return _headers.data();
+#else
+	return NULL;
+#endif
+}
+
+int PacketSocket_::readBatch(PacketBatch& batch)
+{
+	if (_handle < 0)
+		init();
+	int n = batch.capacity();
+	batch._n = 0;
+#ifdef ASL_SOCKET_MMSG
+	mmsghdr* msgs = (mmsghdr*)batch.headers();
+	iovec* iov = (iovec*)(msgs + n);
+	for (int i = 0; i < n; i++)
+	{
+		iov[i].iov_len = batch._size;
+		msgs[i].msg_hdr.msg_namelen = PacketBatch::ADDR_SIZE;
+	}
+	int r;
+	do
+		r = recvmmsg(_handle, msgs, n, MSG_WAITFORONE, NULL);
+	while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return -1;
+	for (int i = 0; i < r; i++)
+	{
+		batch._sizes[i] = min((int)msgs[i].msg_len, batch._size);
+		batch._addrLengths[i] = msgs[i].msg_hdr.msg_namelen;
+	}
+	batch._n = r;
+#else
+	for (int i = 0; i < n; i++) // after the first datagram, only read those already there
+	{
+		if (i > 0 && availableRaw() <= 0)
+			break;
+		socklen_t len = PacketBatch::ADDR_SIZE;
+		int r = recvfrom(_handle, (char*)batch.data(i), batch._size, 0,
+			(sockaddr*)(batch._addrs.data() + i * PacketBatch::ADDR_SIZE), &len);
+		if (r < 0)
+		{
+			if (i == 0)
+				return -1;
+			break;
+		}
+		batch._sizes[i] = r;
+		batch._addrLengths[i] = (int)len;
+		batch._n++;
+	}
+#endif
+	return batch._n;
+}
+
+int PacketSocket_::sendBatch(const PacketBatch& batch)
+{
+	if (_handle < 0)
+		init();
+	int n = batch._n, sent = 0;
+#ifdef ASL_SOCKET_MMSG
+	mmsghdr* msgs = (mmsghdr*)batch.headers();
+	iovec* iov = (iovec*)(msgs + batch.capacity());
+	for (int i = 0; i < n; i++)
+	{
+		iov[i].iov_len = batch._sizes[i];
+		msgs[i].msg_hdr.msg_namelen = batch._addrLengths[i];
+	}
+	while (sent < n) // the kernel may send only part of them
+	{
+		int r = sendmmsg(_handle, msgs + sent, n - sent, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		sent += r;
+	}
+#else
+	for (; sent < n; sent++)
+	{
+		if (sendto(_handle, (const char*)batch.data(sent), batch._sizes[sent], 0,
+			(const sockaddr*)(batch._addrs.data() + sent * PacketBatch::ADDR_SIZE), batch._addrLengths[sent]) < 0)
+			break;
+	}
+#endif
+	return sent;
+}
+
 // LocalSocket (UNIX)
 
 LocalSocket_::~LocalSocket_()
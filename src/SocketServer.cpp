@@ -1,9 +1,15 @@
 #include <asl/SocketServer.h>
 #include <asl/Thread.h>
+#include <asl/Queue.h>
 #ifdef ASL_TLS
 #include <asl/TlsSocket.h>
 #endif
 #include <stdio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#define ASL_SOCKET_REACTOR
+#endif
 
 namespace asl {
 
@@ -41,13 +47,332 @@ struct SockServerThread : public Thread
 	}
 };
 
+// Worker pool: new connections (thread pool mode) and connections with input (reactor mode) are queued and
+// served by a fixed set of threads
+
+struct SockConn
+{
+	Socket socket;
+	bool polled; // belongs to the reactor
+	bool busy;   // queued or being served (not armed in the reactor)
+	int index;   // position in the reactor's list
+	double queued;
+	double created, active;
+	double idle; // idle timeout, or the server's if negative
+	SockConn(const Socket& s, bool p = false) : socket(s), polled(p), busy(false), index(-1), queued(0), idle(-1)
+	{
+		created = active = now();
+	}
+};
+
+struct SockPoolWorker : public Thread
+{
+	SockPool* _pool;
+	SockPoolWorker(SockPool* p) : _pool(p) {}
+	void run();
+};
+
+struct SockPool
+{
+	SocketServer* _server;
+	SockReactor* _reactor;
+	Array<SockPoolWorker*> _workers;
+	Queue<SockConn*> _ready;
+	Mutex _mutex;
+	Condition _space;
+	Semaphore _sem;
+	int _maxQueue;
+	bool _reject;
+	int _pending;
+	double _waitSum;
+	SocketServerStats _stats;
+	volatile bool _stop;
+
+	SockPool(SocketServer* svr, int nthreads, int maxQueue, bool reject) :
+		_server(svr), _reactor(NULL), _maxQueue(maxQueue), _reject(reject), _pending(0), _waitSum(0), _stop(false)
+	{
+		_space.use(_mutex);
+		memset(&_stats, 0, sizeof(_stats));
+		for (int i = 0; i < nthreads; i++)
+		{
+			_workers << new SockPoolWorker(this);
+			_workers.last()->start();
+		}
+	}
+	~SockPool()
+	{
+		stop();
+	}
+	// queues a new connection, waiting for space or rejecting it if the queue is full
+	bool submit(const Socket& client)
+	{
+		Lock _(_mutex);
+		while (_maxQueue > 0 && _pending >= _maxQueue)
+		{
+			if (_reject || _stop || _server->_requestStop)
+			{
+				_stats.rejected++;
+				return false;
+			}
+			_space.wait(0.1);
+		}
+		_pending++;
+		push(new SockConn(client));
+		return true;
+	}
+	// queues a connection with input from the reactor (not bounded)
+	void enqueue(SockConn* conn)
+	{
+		Lock _(_mutex);
+		push(conn);
+	}
+	void push(SockConn* conn)
+	{
+		conn->queued = now();
+		_ready.put(conn);
+		_stats.maxQueued = max(_stats.maxQueued, _ready.length());
+		_sem.post();
+	}
+	void work()
+	{
+		while (!_stop)
+		{
+			if (!_sem.wait(0.5))
+				continue;
+			SockConn* conn;
+			{
+				Lock _(_mutex);
+				if (_ready.length() == 0)
+					continue;
+				conn = _ready.get();
+				double wait = now() - conn->queued;
+				_waitSum += wait;
+				_stats.maxWaitTime = max(_stats.maxWaitTime, wait);
+				_stats.dispatched++;
+				if (!conn->polled)
+				{
+					_pending--;
+					_space.signal();
+				}
+			}
+			if (conn->polled)
+				process(conn);
+			else
+				serve(conn);
+		}
+	}
+	void serve(SockConn* conn)
+	{
+		_server->serve(conn->socket);
+		close(conn);
+	}
+	void close(SockConn* conn)
+	{
+		conn->socket.close();
+		delete conn;
+		--_server->_numClients;
+	}
+	void process(SockConn* conn);
+	void stop()
+	{
+		_stop = true;
+		foreach (SockPoolWorker* w, _workers)
+		{
+			w->join();
+			delete w;
+		}
+		_workers.clear();
+		Lock _(_mutex);
+		while (_ready.length() > 0)
+		{
+			SockConn* conn = _ready.get();
+			if (!conn->polled)
+				close(conn);
+		}
+	}
+	SocketServerStats stats()
+	{
+		Lock _(_mutex);
+		SocketServerStats s = _stats;
+		s.queued = _ready.length();
+		s.waitTime = s.dispatched > 0 ? _waitSum / s.dispatched : 0;
+		return s;
+	}
+};
+
+void SockPoolWorker::run()
+{
+	_pool->work();
+}
+
+#ifdef ASL_SOCKET_REACTOR
+
+// Event-driven mode: one thread waits on all client sockets with epoll (edge-triggered, one-shot) and queues
+// connections with input in the pool, whose workers re-arm them after serving
+
+struct SockReactor : public Thread
+{
+	SocketServer* _server;
+	SockPool* _pool;
+	int _epoll;
+	Array<SockConn*> _conns;
+	Mutex _mutex;
+
+	SockReactor(SocketServer* svr, SockPool* pool) : _server(svr), _pool(pool)
+	{
+		_epoll = epoll_create1(EPOLL_CLOEXEC);
+		_pool->_reactor = this;
+	}
+	~SockReactor()
+	{
+		while (_conns.length() > 0)
+			remove(_conns.last());
+		if (_epoll >= 0)
+			::close(_epoll);
+	}
+	bool watch(SockConn* conn, int op)
+	{
+		epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		return epoll_ctl(_epoll, op, conn->socket.handle(), &ev) == 0;
+	}
+	void add(const Socket& client)
+	{
+		SockConn* conn = new SockConn(client, true);
+		{
+			Lock _(_mutex);
+			conn->index = _conns.length();
+			_conns << conn;
+		}
+		if (!watch(conn, EPOLL_CTL_ADD))
+			remove(conn);
+	}
+	void remove(SockConn* conn)
+	{
+		_server->serveClose(conn->socket);
+		epoll_ctl(_epoll, EPOLL_CTL_DEL, conn->socket.handle(), NULL);
+		{
+			Lock _(_mutex);
+			SockConn* last = _conns.last();
+			_conns[conn->index] = last;
+			last->index = conn->index;
+			_conns.removeLast();
+		}
+		_pool->close(conn);
+	}
+	void process(SockConn* conn)
+	{
+		double lifetime = _server->_lifetime;
+		bool keep = _server->serveInput(conn->socket) && !_server->_requestStop &&
+			(lifetime <= 0 || now() - conn->created < lifetime);
+		// input already buffered (also inside mbedTLS) would not wake epoll, so it is served now; this check does not
+		// block, not even for TLS, or an idle client would hold this worker
+		int avail = keep ? conn->socket.available() : -1;
+		if (avail > 0)
+		{
+			_pool->enqueue(conn);
+			return;
+		}
+		if (avail == 0)
+		{
+			Lock _(_mutex);
+			conn->active = now();
+			if (watch(conn, EPOLL_CTL_MOD))
+			{
+				conn->busy = false;
+				return;
+			}
+		}
+		remove(conn);
+	}
+	void setIdle(const Socket& client, double idle)
+	{
+		Lock _(_mutex);
+		foreach (SockConn* conn, _conns)
+		{
+			if (conn->socket == client)
+			{
+				conn->idle = idle;
+				break;
+			}
+		}
+	}
+	// closes connections idle or alive for too long (only those not being served)
+	void sweep()
+	{
+		double lifetime = _server->_lifetime, t = now();
+		Array<SockConn*> expired;
+		{
+			Lock _(_mutex);
+			foreach (SockConn* conn, _conns)
+			{
+				double idle = conn->idle < 0 ? _server->_idleTimeout : conn->idle;
+				if (!conn->busy && ((idle > 0 && t - conn->active > idle) || (lifetime > 0 && t - conn->created > lifetime)))
+				{
+					conn->busy = true;
+					expired << conn;
+				}
+			}
+		}
+		foreach (SockConn* conn, expired)
+			remove(conn);
+	}
+	void run()
+	{
+		epoll_event events[64];
+		double swept = now();
+		while (!_server->_requestStop)
+		{
+			int n = epoll_wait(_epoll, events, 64, 500);
+			for (int i = 0; i < n; i++)
+			{
+				SockConn* conn = (SockConn*)events[i].data.ptr;
+				{
+					Lock _(_mutex);
+					conn->busy = true;
+				}
+				_pool->enqueue(conn);
+			}
+			if (now() - swept > 1)
+			{
+				sweep();
+				swept = now();
+			}
+		}
+	}
+};
+
+void SockPool::process(SockConn* conn)
+{
+	_reactor->process(conn);
+}
+
+#else
+
+void SockPool::process(SockConn* conn)
+{
+	serve(conn);
+}
+
+#endif
+
 SocketServer::SocketServer()
 {
 	_thread = NULL;
+	_pool = NULL;
+	_reactor = NULL;
+	_useReactor = false;
+	_reactorThreads = 0;
+	_poolThreads = 0;
+	_poolQueue = 0;
+	_poolReject = false;
 	_requestStop = false;
 	_sequential = false;
 	_running = false;
 	_numClients = 0;
+	_idleTimeout = 10;
+	_lifetime = 0;
 }
 
 SocketServer::~SocketServer()
@@ -56,6 +381,84 @@ SocketServer::~SocketServer()
 		_thread->kill();
 		delete _thread;
 	}
+	_requestStop = true;
+	stopWorkers();
+	delete _pool;
+}
+
+void SocketServer::setReactor(int nthreads)
+{
+	_useReactor = true;
+	_reactorThreads = nthreads > 0 ? nthreads : Thread::numProcessors();
+}
+
+void SocketServer::setThreadPool(int nthreads, int maxQueue, bool reject)
+{
+	_poolThreads = nthreads > 0 ? nthreads : Thread::numProcessors();
+	_poolQueue = maxQueue;
+	_poolReject = reject;
+}
+
+SocketServerStats SocketServer::stats() const
+{
+	if (_pool)
+		return _pool->stats();
+	SocketServerStats s;
+	memset(&s, 0, sizeof(s));
+	return s;
+}
+
+void SocketServer::setIdleTimeout(const Socket& client, double idle)
+{
+#ifdef ASL_SOCKET_REACTOR
+	if (_reactor)
+		_reactor->setIdle(client, idle);
+#endif
+}
+
+void SocketServer::startWorkers()
+{
+	int nthreads = _poolThreads;
+#ifdef ASL_SOCKET_REACTOR
+	if (_useReactor && nthreads == 0)
+		nthreads = _reactorThreads;
+#endif
+	if (_sequential || nthreads == 0)
+		return;
+	delete _pool;
+	_pool = new SockPool(this, nthreads, _poolQueue, _poolReject);
+#ifdef ASL_SOCKET_REACTOR
+	if (_useReactor) {
+		_reactor = new SockReactor(this, _pool);
+		if (_reactor->_epoll >= 0)
+			_reactor->start();
+		else {
+			delete _reactor;
+			_reactor = NULL;
+			_pool->_reactor = NULL;
+		}
+	}
+#endif
+}
+
+void SocketServer::stopWorkers()
+{
+#ifdef ASL_SOCKET_REACTOR
+	if (_reactor)
+		_reactor->join();
+#endif
+	if (_pool)
+		_pool->stop();
+#ifdef ASL_SOCKET_REACTOR
+	delete _reactor;
+	_reactor = NULL;
+#endif
+}
+
+bool SocketServer::serveInput(Socket client)
+{
+	serve(client);
+	return false;
 }
 
 bool SocketServer::bind(const String& ip, int port)
@@ -110,7 +513,19 @@ void SocketServer::startLoop()
 			{
 				Socket client = _sockets.activeAt(i).accept();
 				++_numClients;
-				if (_sequential) {
+#ifdef ASL_SOCKET_REACTOR
+				if (_reactor) {
+					_reactor->add(client);
+					continue;
+				}
+#endif
+				if (_pool) {
+					if (!_pool->submit(client)) {
+						client.close();
+						--_numClients;
+					}
+				}
+				else if (_sequential) {
 					serve(client);
 					client.close();
 					--_numClients;
@@ -121,6 +536,7 @@ void SocketServer::startLoop()
 		}
 		if(_requestStop || n < 0)
 		{
+			stopWorkers();
 			_running = false;
 			break;
 		}
@@ -133,6 +549,8 @@ void SocketServer::start(bool nonblocking)
 {
 	_running = true;
 
+	startWorkers();
+
 	if(nonblocking) {
 		_thread = new SockServerThread(this);
 		_thread->start();
@@ -174,6 +592,24 @@ bool SocketServer::useCert(const String& cert, const String& key)
 	}
 	return true;
 }
+
+void SocketServer::useTlsContext(const TlsContext& context)
+{
+	for (int i = 0; i < _sockets.length(); i++)
+	{
+		if (TlsSocket s = _sockets[i].as<TlsSocket>())
+			s.useContext(context);
+	}
+}
+
+void SocketServer::setHandshakeTimeout(double timeout)
+{
+	for (int i = 0; i < _sockets.length(); i++)
+	{
+		if (TlsSocket s = _sockets[i].as<TlsSocket>())
+			s.setHandshakeTimeout(timeout);
+	}
+}
 #endif
 
 }
@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <wchar.h>
+#include <float.h>
+#include <locale.h>
 
 #ifdef _WIN32
 #define vsnprintf _vsnprintf
@@ -505,7 +507,13 @@ String::String(float x)
 String::String(double x)
 {
 	char s[32];
-	_len = snprintf(s, 32, "%.15g", x);
+	_len = mydtoa(x, s, 15);
+	if (_len == 0) // needs more than 15 digits: round to 15
+	{
+		_len = snprintf(s, 32, "%.15g", x);
+		if (char* comma = strchr(s, ','))
+			*comma = '.';
+	}
 	char* p = alloc(_len);
 	strcpy(p, s);
 }
@@ -882,38 +890,394 @@ Long myatol(const char* s)
 	return y*sgn;
 }
 
+// Powers of 10 that are exact in a double
+
+static const double exactPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+	1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+// Parses a decimal number, exactly: if the mantissa and the power of ten are exact in a double, a single
+// multiplication or division rounds correctly (Clinger's fast path), otherwise it uses strtod
+
 double myatof(const char* s)
 {
-	double y = 0;
-	double m = 1;
-	int exp = 0;
-	if (s[0] == '-') { m = -1; s++; }
-	const char* p = strchr(s, '.');
-	if (p) {
+	const char* p = s;
+	bool neg = *p == '-';
+	if (*p == '-' || *p == '+')
+		p++;
+	ULong m = 0;
+	int digits = 0, exp = 0;
+	for (; *p >= '0' && *p <= '9'; p++)
+	{
+		if (m == 0 && *p == '0')
+			continue;
+		m = m * 10 + (*p - '0');
+		digits++;
+	}
+	if (*p == '.')
+	{
+		for (p++; *p >= '0' && *p <= '9'; p++, exp--)
+		{
+			if (m == 0 && *p == '0')
+				continue;
+			m = m * 10 + (*p - '0');
+			digits++;
+		}
+	}
+	if ((*p == 'e' || *p == 'E') && (p[1] == '-' || p[1] == '+' || (p[1] >= '0' && p[1] <= '9')))
+	{
 		p++;
-		while (*p != '\0' && *p != 'e' && *p != 'E') {
-			exp--;
+		bool eneg = *p == '-';
+		if (*p == '-' || *p == '+')
 			p++;
+		int e = 0;
+		for (; *p >= '0' && *p <= '9'; p++)
+			if (e < 100000)
+				e = e * 10 + (*p - '0');
+		exp += eneg ? -e : e;
+	}
+#if !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+	if (digits <= 19 && m <= (ULong(1) << 53) && exp >= -22 && exp <= 22)
+	{
+		double x = exp < 0 ? double(m) / exactPow10[-exp] : double(m) * exactPow10[exp];
+		return neg ? -x : x;
+	}
+#endif
+	String t(s, int(p - s)); // only the number, with the locale's decimal point that strtod wants
+	char dp = *localeconv()->decimal_point;
+	if (dp != '.')
+	{
+		int dot = t.indexOf('.');
+		if (dot >= 0)
+			t[dot] = dp;
+	}
+	return strtod(*t, NULL);
+}
+
+/*
+Shortest round-trip formatting of floating point numbers with the Grisu2 algorithm (F. Loitsch, "Printing
+Floating-Point Numbers Quickly and Accurately with Integers", 2010). The digits produced always read back as the
+same number, and are the shortest such digits in nearly all cases.
+*/
+
+namespace {
+
+struct DiyFp
+{
+	ULong f;
+	int e;
+	DiyFp(ULong f = 0, int e = 0) : f(f), e(e) {}
+	DiyFp operator-(const DiyFp& y) const { return DiyFp(f - y.f, e); }
+	DiyFp operator*(const DiyFp& y) const
+	{
+		ULong a = f >> 32, b = f & 0xffffffffu, c = y.f >> 32, d = y.f & 0xffffffffu;
+		ULong ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+		ULong q = (bd >> 32) + (ad & 0xffffffffu) + (bc & 0xffffffffu) + (ULong(1) << 31); // rounded
+		return DiyFp(ac + (ad >> 32) + (bc >> 32) + (q >> 32), e + y.e + 64);
+	}
+	DiyFp normalized() const
+	{
+		DiyFp x = *this;
+		while ((x.f >> 63) == 0)
+		{
+			x.f <<= 1;
+			x.e--;
 		}
-		p--;
+		return x;
 	}
-	if (!p) p = s;
-	while (*p++)
-		if (*p == 'e' || *p == 'E'){
-			if (*(p + 1) == '+')
-				p++;
-			exp += myatoiz(p + 1);
-			break;
+};
+
+struct CachedPower
+{
+	ULong f;
+	int e;
+	int k;
+};
+
+// Normalized 10^k for k = -300, -292, ... 324
+
+static const CachedPower cachedPowers[] = {
+	{ 0xAB70FE17C79AC6CA, -1060, -300 },
+	{ 0xFF77B1FCBEBCDC4F, -1034, -292 },
+	{ 0xBE5691EF416BD60C, -1007, -284 },
+	{ 0x8DD01FAD907FFC3C, -980, -276 },
+	{ 0xD3515C2831559A83, -954, -268 },
+	{ 0x9D71AC8FADA6C9B5, -927, -260 },
+	{ 0xEA9C227723EE8BCB, -901, -252 },
+	{ 0xAECC49914078536D, -874, -244 },
+	{ 0x823C12795DB6CE57, -847, -236 },
+	{ 0xC21094364DFB5637, -821, -228 },
+	{ 0x9096EA6F3848984F, -794, -220 },
+	{ 0xD77485CB25823AC7, -768, -212 },
+	{ 0xA086CFCD97BF97F4, -741, -204 },
+	{ 0xEF340A98172AACE5, -715, -196 },
+	{ 0xB23867FB2A35B28E, -688, -188 },
+	{ 0x84C8D4DFD2C63F3B, -661, -180 },
+	{ 0xC5DD44271AD3CDBA, -635, -172 },
+	{ 0x936B9FCEBB25C996, -608, -164 },
+	{ 0xDBAC6C247D62A584, -582, -156 },
+	{ 0xA3AB66580D5FDAF6, -555, -148 },
+	{ 0xF3E2F893DEC3F126, -529, -140 },
+	{ 0xB5B5ADA8AAFF80B8, -502, -132 },
+	{ 0x87625F056C7C4A8B, -475, -124 },
+	{ 0xC9BCFF6034C13053, -449, -116 },
+	{ 0x964E858C91BA2655, -422, -108 },
+	{ 0xDFF9772470297EBD, -396, -100 },
+	{ 0xA6DFBD9FB8E5B88F, -369, -92 },
+	{ 0xF8A95FCF88747D94, -343, -84 },
+	{ 0xB94470938FA89BCF, -316, -76 },
+	{ 0x8A08F0F8BF0F156B, -289, -68 },
+	{ 0xCDB02555653131B6, -263, -60 },
+	{ 0x993FE2C6D07B7FAC, -236, -52 },
+	{ 0xE45C10C42A2B3B06, -210, -44 },
+	{ 0xAA242499697392D3, -183, -36 },
+	{ 0xFD87B5F28300CA0E, -157, -28 },
+	{ 0xBCE5086492111AEB, -130, -20 },
+	{ 0x8CBCCC096F5088CC, -103, -12 },
+	{ 0xD1B71758E219652C, -77, -4 },
+	{ 0x9C40000000000000, -50, 4 },
+	{ 0xE8D4A51000000000, -24, 12 },
+	{ 0xAD78EBC5AC620000, 3, 20 },
+	{ 0x813F3978F8940984, 30, 28 },
+	{ 0xC097CE7BC90715B3, 56, 36 },
+	{ 0x8F7E32CE7BEA5C70, 83, 44 },
+	{ 0xD5D238A4ABE98068, 109, 52 },
+	{ 0x9F4F2726179A2245, 136, 60 },
+	{ 0xED63A231D4C4FB27, 162, 68 },
+	{ 0xB0DE65388CC8ADA8, 189, 76 },
+	{ 0x83C7088E1AAB65DB, 216, 84 },
+	{ 0xC45D1DF942711D9A, 242, 92 },
+	{ 0x924D692CA61BE758, 269, 100 },
+	{ 0xDA01EE641A708DEA, 295, 108 },
+	{ 0xA26DA3999AEF774A, 322, 116 },
+	{ 0xF209787BB47D6B85, 348, 124 },
+	{ 0xB454E4A179DD1877, 375, 132 },
+	{ 0x865B86925B9BC5C2, 402, 140 },
+	{ 0xC83553C5C8965D3D, 428, 148 },
+	{ 0x952AB45CFA97A0B3, 455, 156 },
+	{ 0xDE469FBD99A05FE3, 481, 164 },
+	{ 0xA59BC234DB398C25, 508, 172 },
+	{ 0xF6C69A72A3989F5C, 534, 180 },
+	{ 0xB7DCBF5354E9BECE, 561, 188 },
+	{ 0x88FCF317F22241E2, 588, 196 },
+	{ 0xCC20CE9BD35C78A5, 614, 204 },
+	{ 0x98165AF37B2153DF, 641, 212 },
+	{ 0xE2A0B5DC971F303A, 667, 220 },
+	{ 0xA8D9D1535CE3B396, 694, 228 },
+	{ 0xFB9B7CD9A4A7443C, 720, 236 },
+	{ 0xBB764C4CA7A44410, 747, 244 },
+	{ 0x8BAB8EEFB6409C1A, 774, 252 },
+	{ 0xD01FEF10A657842C, 800, 260 },
+	{ 0x9B10A4E5E9913129, 827, 268 },
+	{ 0xE7109BFBA19C0C9D, 853, 276 },
+	{ 0xAC2820D9623BF429, 880, 284 },
+	{ 0x80444B5E7AA7CF85, 907, 292 },
+	{ 0xBF21E44003ACDD2D, 933, 300 },
+	{ 0x8E679C2F5E44FF8F, 960, 308 },
+	{ 0xD433179D9C8CB841, 986, 316 },
+	{ 0x9E19DB92B4E31BA9, 1013, 324 },
+};
+
+// Computes the value of a float with `precision` significand bits and its rounding boundaries, all with the same exponent
+
+template<class T>
+void boundaries(T value, DiyFp& v, DiyFp& minus, DiyFp& plus)
+{
+	const int precision = sizeof(T) == 8 ? 53 : 24;
+	const int bias = (sizeof(T) == 8 ? 1023 : 127) + precision - 1;
+	const ULong hidden = ULong(1) << (precision - 1);
+	ULong bits;
+	if (sizeof(T) == 8)
+		memcpy(&bits, &value, 8);
+	else
+	{
+		unsigned int b;
+		memcpy(&b, &value, 4);
+		bits = b;
+	}
+	ULong f = bits & (hidden - 1);
+	int e = int(bits >> (precision - 1)) & (sizeof(T) == 8 ? 0x7ff : 0xff);
+	DiyFp x = e == 0 ? DiyFp(f, 1 - bias) : DiyFp(f + hidden, e - bias);
+	bool closerBelow = f == 0 && e > 1;
+	plus = DiyFp(2 * x.f + 1, x.e - 1).normalized();
+	minus = closerBelow ? DiyFp(4 * x.f - 1, x.e - 2) : DiyFp(2 * x.f - 1, x.e - 1);
+	minus = DiyFp(minus.f << (minus.e - plus.e), plus.e);
+	v = x.normalized();
+}
+
+static void grisuRound(char* buffer, int length, ULong dist, ULong delta, ULong rest, ULong tenK)
+{
+	while (rest < dist && delta - rest >= tenK && (rest + tenK < dist || dist - rest > rest + tenK - dist))
+	{
+		buffer[length - 1]--;
+		rest += tenK;
+	}
+}
+
+// Generates the digits of a number between `low` and `high` closest to `w`
+
+static int grisuDigits(char* buffer, int& exp10, DiyFp low, DiyFp w, DiyFp high)
+{
+	ULong delta = (high - low).f, dist = (high - w).f;
+	DiyFp one(ULong(1) << -high.e, high.e);
+	unsigned int p1 = (unsigned int)(high.f >> -one.e);
+	ULong p2 = high.f & (one.f - 1);
+	int length = 0;
+	unsigned int pow10 = 1;
+	int n = 1;
+	while (n < 10 && pow10 * 10 <= p1)
+	{
+		pow10 *= 10;
+		n++;
+	}
+	while (n > 0)
+	{
+		buffer[length++] = char('0' + p1 / pow10);
+		p1 %= pow10;
+		n--;
+		ULong rest = (ULong(p1) << -one.e) + p2;
+		if (rest <= delta)
+		{
+			exp10 += n;
+			grisuRound(buffer, length, dist, delta, rest, ULong(pow10) << -one.e);
+			return length;
+		}
+		pow10 /= 10;
+	}
+	int m = 0;
+	do
+	{
+		p2 *= 10;
+		buffer[length++] = char('0' + (p2 >> -one.e));
+		p2 &= one.f - 1;
+		m++;
+		delta *= 10;
+		dist *= 10;
+	} while (p2 > delta);
+	exp10 -= m;
+	grisuRound(buffer, length, dist, delta, p2, one.f);
+	return length;
+}
+
+// Writes the shortest digits of a positive finite number to `buffer`; its value is digits * 10^exp10
+
+template<class T>
+int grisu2(T value, char* buffer, int& exp10)
+{
+	DiyFp v, minus, plus;
+	boundaries(value, v, minus, plus);
+	int f = -61 - plus.e; // scale so the product's exponent is in [-60, -32]
+	int k = (f * 78913) / (1 << 18) + (f > 0);
+	const CachedPower& c = cachedPowers[(300 + k + 7) / 8];
+	DiyFp ck(c.f, c.e);
+	DiyFp w = v * ck, low = minus * ck, high = plus * ck;
+	exp10 = -c.k;
+	return grisuDigits(buffer, exp10, DiyFp(low.f + 1, low.e), w, DiyFp(high.f - 1, high.e));
+}
+
+// Formats digits * 10^exp10 like printf's %g with the given precision, returns the length
+
+static int formatDigits(char* s, const char* digits, int n, int exp10, int precision)
+{
+	int x = n + exp10 - 1; // exponent of the first digit
+	char* p = s;
+	if (x >= -4 && x < precision)
+	{
+		if (exp10 >= 0)
+		{
+			memcpy(p, digits, n);
+			p += n;
+			memset(p, '0', exp10);
+			p += exp10;
+		}
+		else if (x >= 0)
+		{
+			memcpy(p, digits, x + 1);
+			p += x + 1;
+			*p++ = '.';
+			memcpy(p, digits + x + 1, n - x - 1);
+			p += n - x - 1;
+		}
+		else
+		{
+			*p++ = '0';
+			*p++ = '.';
+			memset(p, '0', -x - 1);
+			p += -x - 1;
+			memcpy(p, digits, n);
+			p += n;
+		}
+	}
+	else
+	{
+		*p++ = digits[0];
+		if (n > 1)
+		{
+			*p++ = '.';
+			memcpy(p, digits + 1, n - 1);
+			p += n - 1;
 		}
-	long long y1 = 0;
-	while (int c = *s++)
+		*p++ = 'e';
+		*p++ = x < 0 ? '-' : '+';
+		int e = x < 0 ? -x : x;
+		if (e >= 100)
+			*p++ = char('0' + e / 100);
+		*p++ = char('0' + e / 10 % 10);
+		*p++ = char('0' + e % 10);
+	}
+	*p = '\0';
+	return int(p - s);
+}
+
+template<class T>
+int formatShortest(T x, char* s, int precision)
+{
+	char* p = s;
+	if (x != x)
+	{
+		strcpy(s, "nan");
+		return 3;
+	}
+	if (x < 0 || (x == 0 && 1 / x < 0))
+	{
+		*p++ = '-';
+		x = -x;
+	}
+	if (x == 0)
+	{
+		strcpy(p, "0");
+		return int(p - s) + 1;
+	}
+	if (x > (sizeof(T) == 8 ? DBL_MAX : FLT_MAX))
 	{
-		if (c == '.') continue;
-		if (c == 'E' || c == 'e') break;
-		y1 = 10 * y1 + (c - '0');
+		strcpy(p, "inf");
+		return int(p - s) + 3;
 	}
-	y = double(y1) * pow(10.0, exp);
-	return y * m;
+	char digits[20];
+	int exp10;
+	int n = grisu2(x, digits, exp10);
+	while (n > 1 && digits[n - 1] == '0')
+	{
+		n--;
+		exp10++;
+	}
+	if (n > precision)
+	{
+		*s = '\0';
+		return 0;
+	}
+	return int(p - s) + formatDigits(p, digits, n, exp10, precision);
+}
+
+}
+
+int mydtoa(double x, char* s, int precision)
+{
+	return formatShortest(x, s, precision);
+}
+
+int myftoa(float x, char* s, int precision)
+{
+	return formatShortest(x, s, precision);
 }
 
 int myitoa(int x, char* s)
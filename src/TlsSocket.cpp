@@ -5,7 +5,12 @@
 #include <mbedtls/ssl.h>
 #include <mbedtls/debug.h>
 #include <mbedtls/error.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
 #include <asl/TlsSocket.h>
+#include <asl/HashMap.h>
+#include <asl/Mutex.h>
+#include <asl/time.h>
 #if MBEDTLS_VERSION_MAJOR < 4
 #include <mbedtls/entropy.h>
 #include <mbedtls/ctr_drbg.h>
@@ -32,11 +37,17 @@
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
+#include <errno.h>
 #endif
 
 #include <stdio.h>
 #include <string.h>
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 #ifndef _WIN32
 #define SOCKOPT int
 #else
@@ -158,68 +169,536 @@ struct TlsCore
 {
 	mbedtls_net_context net;
 	mbedtls_ssl_context ssl;
-	mbedtls_ssl_config  conf;
-	mbedtls_x509_crt    cacert;
-	mbedtls_x509_crt    srvcert;
-	mbedtls_pk_context  pkey;
-	bool                bound;
+	Shared<TlsConfig>   config;     // the configuration the connection was set up with
+	Mutex               contextMutex; // guards context and hasContext, which may be replaced while accepting
+	TlsContext          context;    // certificates of a listening socket, or of a client if hasContext
+	bool                hasContext;
+	String              certPem;    // certificate given with useCert() waiting for its key
+	String              sessionKey; // host:port of a client connection, to find its cached session
+	int                 state;      // handshake state of an accepted connection
+	double              handshakeTimeout;
+	double              deadline;   // time limit of a handshake in progress
+	bool                nonblocking; // after the handshake: transport calls fail with WANT_READ/WRITE instead of waiting
+	Mutex               ioMutex;    // serializes reads and writes from different threads, never held while waiting
+	int                 pendingWrite; // length of a write interrupted by a full socket, to be retried as it was
+};
+
+mbedtls_ssl_config config;
+bool inited = false;
+
+enum { TLS_READY, TLS_PENDING, TLS_FAILED };
+
+// Tells if a socket becomes readable (or writable if `output`) within `t` seconds
+
+static bool ready(int fd, bool output, double t)
+{
+#ifndef _WIN32
+	pollfd pfd = { fd, short(output ? POLLOUT : POLLIN), 0 };
+	return ::poll(&pfd, 1, t < 0 ? -1 : (int)(t * 1000)) != 0;
+#else
+	fd_set set;
+	struct timeval to;
+	to.tv_sec = (int)floor(t);
+	to.tv_usec = (int)((t - floor(t)) * 1e6);
+	FD_ZERO(&set);
+	FD_SET(fd, &set);
+	select(fd + 1, output ? 0 : &set, output ? &set : 0, 0, t < 0 ? 0 : &to);
+	return FD_ISSET(fd, &set) != 0;
+#endif
+}
+
+// Transport functions of connections. After the handshake they do not block, so that a thread can write while
+// another one waits for input; and the handshake of accepted connections must complete before the deadline even if
+// the peer sends data slowly
+
+static int sendCore(void* p, const unsigned char* buf, size_t len)
+{
+	TlsCore* core = (TlsCore*)p;
+	if (!core->nonblocking)
+		return mbedtls_net_send(&core->net, buf, len);
+#ifndef _WIN32
+	int r = (int)::send(core->net.fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (r >= 0)
+		return r;
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return MBEDTLS_ERR_SSL_WANT_WRITE;
+	return (errno == EPIPE || errno == ECONNRESET) ? MBEDTLS_ERR_NET_CONN_RESET : MBEDTLS_ERR_NET_SEND_FAILED;
+#else
+	if (!ready(core->net.fd, true, 0))
+		return MBEDTLS_ERR_SSL_WANT_WRITE;
+	return mbedtls_net_send(&core->net, buf, len);
+#endif
+}
+
+static int recvCore(void* p, unsigned char* buf, size_t len)
+{
+	TlsCore* core = (TlsCore*)p;
+	if (core->nonblocking && !ready(core->net.fd, false, 0))
+		return MBEDTLS_ERR_SSL_WANT_READ;
+	return mbedtls_net_recv(&core->net, buf, len);
+}
+
+static int recvDeadline(void* p, unsigned char* buf, size_t len, uint32_t)
+{
+	TlsCore* core = (TlsCore*)p;
+	double t = core->deadline - now();
+	if (t <= 0)
+		return MBEDTLS_ERR_SSL_TIMEOUT;
+#ifndef _WIN32
+	pollfd pfd = { core->net.fd, POLLIN, 0 }; // mbedtls_net_recv_timeout() uses select(), limited to FD_SETSIZE
+	int r = ::poll(&pfd, 1, (int)max(t * 1000, 1.0));
+	if (r == 0)
+		return MBEDTLS_ERR_SSL_TIMEOUT;
+	if (r < 0)
+		return MBEDTLS_ERR_NET_RECV_FAILED;
+	return mbedtls_net_recv(&core->net, buf, len);
+#else
+	return mbedtls_net_recv_timeout(&core->net, buf, len, (uint32_t)max(t * 1000, 1.0));
+#endif
+}
+
+#if defined(MBEDTLS_SSL_TICKET_C) && defined(MBEDTLS_SSL_SESSION_TICKETS)
+#define ASL_TLS_TICKETS
+#endif
+
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+#define ASL_TLS_CLIENT_SESSIONS
+#endif
+
+// Session state shared by all sockets: for servers a session ID cache (TLS 1.2) and the session ticket keys
+// (TLS 1.2 and 1.3), and for clients the last session of each host:port, serialized
+
+struct TlsSessionStore
+{
+	Mutex mutex;
+#ifdef MBEDTLS_SSL_CACHE_C
+	mbedtls_ssl_cache_context cache;
+#endif
+#ifdef ASL_TLS_TICKETS
+	mbedtls_ssl_ticket_context ticket;
+	bool ticketReady;
+#endif
 #if MBEDTLS_VERSION_MAJOR < 4
 	mbedtls_entropy_context  entropy;
 	mbedtls_ctr_drbg_context ctr_drbg;
 #endif
+	HashMap<String, ByteArray> clientSessions;
+	TlsSessionStats stats;
+
+	TlsSessionStore()
+	{
+		memset(&stats, 0, sizeof(stats));
+#ifdef MBEDTLS_SSL_CACHE_C
+		mbedtls_ssl_cache_init(&cache);
+		mbedtls_ssl_cache_set_max_entries(&cache, 1000);
+#endif
+#ifdef ASL_TLS_TICKETS
+		mbedtls_ssl_ticket_init(&ticket);
+#if MBEDTLS_VERSION_MAJOR < 4
+		mbedtls_ctr_drbg_init(&ctr_drbg);
+		mbedtls_entropy_init(&entropy);
+		ticketReady = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0) == 0 &&
+			mbedtls_ssl_ticket_setup(&ticket, mbedtls_ctr_drbg_random, &ctr_drbg, MBEDTLS_CIPHER_AES_256_GCM, 86400) == 0;
+#else
+		ticketReady = psa_crypto_init() == 0 &&
+			mbedtls_ssl_ticket_setup(&ticket, PSA_ALG_GCM, PSA_KEY_TYPE_AES, 256, 86400) == 0;
+#endif
+#endif
+	}
 };
 
-mbedtls_ssl_config config;
-bool inited = false;
+static TlsSessionStore& sessionStore()
+{
+	static TlsSessionStore store;
+	return store;
+}
 
-TlsSocket_::TlsSocket_()
+// Wrappers of the mbedTLS cache and ticket functions serializing them (mbedTLS only locks with MBEDTLS_THREADING_C)
+// and counting resumptions
+
+#ifdef MBEDTLS_SSL_CACHE_C
+#if MBEDTLS_VERSION_MAJOR >= 3
+static int cacheGet(void* p, const unsigned char* id, size_t len, mbedtls_ssl_session* session)
 {
-	_error = 0;
-	_core = new TlsCore;
-	_core->bound = false;
-	mbedtls_net_init(&_core->net);
-	mbedtls_ssl_init(&_core->ssl);
-	mbedtls_ssl_config_init(&_core->conf);
-	mbedtls_x509_crt_init(&_core->cacert);
-#if MBEDTLS_VERSION_MAJOR < 4
-	mbedtls_ctr_drbg_init(&_core->ctr_drbg);
-	mbedtls_entropy_init(&_core->entropy);
-	mbedtls_ssl_conf_rng(&_core->conf, mbedtls_ctr_drbg_random, &_core->ctr_drbg);
+	TlsSessionStore* store = (TlsSessionStore*)p;
+	Lock _(store->mutex);
+	int ret = mbedtls_ssl_cache_get(&store->cache, id, len, session);
+	if (ret == 0)
+		store->stats.resumed++;
+	return ret;
+}
+
+static int cacheSet(void* p, const unsigned char* id, size_t len, const mbedtls_ssl_session* session)
+{
+	TlsSessionStore* store = (TlsSessionStore*)p;
+	Lock _(store->mutex);
+	return mbedtls_ssl_cache_set(&store->cache, id, len, session);
+}
 #else
-	auto ret1 = psa_crypto_init();
-	if (ret1 != 0)
+static int cacheGet(void* p, mbedtls_ssl_session* session)
+{
+	TlsSessionStore* store = (TlsSessionStore*)p;
+	Lock _(store->mutex);
+	int ret = mbedtls_ssl_cache_get(&store->cache, session);
+	if (ret == 0)
+		store->stats.resumed++;
+	return ret;
+}
+
+static int cacheSet(void* p, const mbedtls_ssl_session* session)
+{
+	TlsSessionStore* store = (TlsSessionStore*)p;
+	Lock _(store->mutex);
+	return mbedtls_ssl_cache_set(&store->cache, session);
+}
+#endif
+#endif
+
+#ifdef ASL_TLS_TICKETS
+static int ticketWrite(void* p, const mbedtls_ssl_session* session, unsigned char* start, const unsigned char* end,
+                       size_t* len, uint32_t* lifetime)
+{
+	TlsSessionStore* store = (TlsSessionStore*)p;
+	Lock _(store->mutex);
+	return mbedtls_ssl_ticket_write(&store->ticket, session, start, end, len, lifetime);
+}
+
+static int ticketParse(void* p, mbedtls_ssl_session* session, unsigned char* buf, size_t len)
+{
+	TlsSessionStore* store = (TlsSessionStore*)p;
+	Lock _(store->mutex);
+	int ret = mbedtls_ssl_ticket_parse(&store->ticket, session, buf, len);
+	if (ret == 0)
+		store->stats.resumed++;
+	return ret;
+}
+#endif
+
+static void useSessionStore(mbedtls_ssl_config* conf)
+{
+	TlsSessionStore& store = sessionStore();
+#ifdef MBEDTLS_SSL_CACHE_C
+	mbedtls_ssl_conf_session_cache(conf, &store, cacheGet, cacheSet);
+#endif
+#ifdef ASL_TLS_TICKETS
+	if (store.ticketReady)
+		mbedtls_ssl_conf_session_tickets_cb(conf, ticketWrite, ticketParse, &store);
+#endif
+}
+
+// Offers the session cached for the client's host:port, if any
+
+static bool loadSession(TlsCore* core)
+{
+#ifdef ASL_TLS_CLIENT_SESSIONS
+	TlsSessionStore& store = sessionStore();
+	ByteArray data;
 	{
-		verbose_print("TlsSocket: PSA crypto init failed 0x%x\n", -ret1);
-		_error = SOCKET_BAD_INIT;
+		Lock _(store.mutex);
+		ByteArray* saved = store.clientSessions.find(core->sessionKey);
+		if (!saved)
+			return false;
+		data = *saved;
+	}
+	mbedtls_ssl_session session;
+	mbedtls_ssl_session_init(&session);
+	bool ok = mbedtls_ssl_session_load(&session, data.data(), data.length()) == 0 &&
+		mbedtls_ssl_set_session(&core->ssl, &session) == 0;
+	mbedtls_ssl_session_free(&session);
+	return ok;
+#else
+	return false;
+#endif
+}
+
+// Saves the client's current session (after a TLS 1.2 handshake, or when a TLS 1.3 ticket arrives)
+
+static void saveSession(TlsCore* core)
+{
+#ifdef ASL_TLS_CLIENT_SESSIONS
+	if (core->sessionKey == "")
 		return;
+	mbedtls_ssl_session session;
+	mbedtls_ssl_session_init(&session);
+	size_t n = 0;
+	if (mbedtls_ssl_get_session(&core->ssl, &session) == 0)
+	{
+		mbedtls_ssl_session_save(&session, NULL, 0, &n);
+		ByteArray data((int)n);
+		if (n > 0 && mbedtls_ssl_session_save(&session, data.data(), n, &n) == 0)
+		{
+			TlsSessionStore& store = sessionStore();
+			Lock _(store.mutex);
+			if (store.clientSessions.length() >= 1000)
+				store.clientSessions.clear();
+			store.clientSessions[core->sessionKey] = data;
+		}
 	}
+	mbedtls_ssl_session_free(&session);
 #endif
-	mbedtls_ssl_set_bio(&_core->ssl, &_core->net, mbedtls_net_send, mbedtls_net_recv, NULL);
-	mbedtls_pk_init(&_core->pkey);
-	mbedtls_x509_crt_init(&_core->srvcert);
-	mbedtls_ssl_conf_read_timeout(&_core->conf, 0);
+}
 
-#if MBEDTLS_VERSION_MAJOR < 4
-	int ret = 0;
-	if ((ret = mbedtls_ctr_drbg_seed(&_core->ctr_drbg, mbedtls_entropy_func, &_core->entropy, NULL, 0)) != 0)
+// Writes at most one record of application data. If the socket is full mbedTLS keeps the record and the write must
+// be retried with the same arguments, so its length is kept (the caller passes the same data again)
+
+static int sslWrite(TlsCore* core, const void* data, int n)
+{
+	int len = core->pendingWrite > 0 ? core->pendingWrite : min(n, 16384);
+	int r = mbedtls_ssl_write(&core->ssl, (const unsigned char*)data, len);
+	if (r == MBEDTLS_ERR_SSL_WANT_WRITE || r == MBEDTLS_ERR_SSL_WANT_READ)
 	{
-		_error = SOCKET_BAD_INIT;
-		return;
+		core->pendingWrite = len;
+		return 0;
 	}
+	core->pendingWrite = 0;
+	return r;
+}
+
+// Reads application data, keeping the session tickets that may arrive in between
+
+static int sslRead(TlsCore* core, unsigned char* data, int size)
+{
+	int n = mbedtls_ssl_read(&core->ssl, data, size);
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+	if (n == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
+		saveSession(core);
 #endif
+	return n;
+}
+
+// An mbedTLS configuration with its certificates and random generator, shared by all connections set up with it.
+// Connections keep a reference, so a configuration replaced by a new one lives until they close.
+
+struct TlsConfig
+{
+	mbedtls_ssl_config conf;
+	mbedtls_x509_crt   cert;
+	mbedtls_x509_crt   ca;
+	mbedtls_pk_context pkey;
+#if MBEDTLS_VERSION_MAJOR < 4
+	mbedtls_entropy_context  entropy;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	Mutex                    rngMutex;
+#endif
+	bool ok;
+	TlsConfig(int endpoint);
+	~TlsConfig();
+	bool setCert(const String& certPem, const String& keyPem);
+	bool setCA(const String& pem);
+};
+
+#if MBEDTLS_VERSION_MAJOR < 4
+// The generator is used by all connections of the configuration concurrently
+
+static int lockedRandom(void* p, unsigned char* out, size_t n)
+{
+	TlsConfig* config = (TlsConfig*)p;
+	Lock _(config->rngMutex);
+	return mbedtls_ctr_drbg_random(&config->ctr_drbg, out, n);
+}
+#endif
+
+TlsConfig::TlsConfig(int endpoint)
+{
+	mbedtls_ssl_config_init(&conf);
+	mbedtls_x509_crt_init(&cert);
+	mbedtls_x509_crt_init(&ca);
+	mbedtls_pk_init(&pkey);
+#if MBEDTLS_VERSION_MAJOR < 4
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	mbedtls_entropy_init(&entropy);
+	mbedtls_ssl_conf_rng(&conf, lockedRandom, this);
+	ok = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0) == 0;
+#else
+	ok = psa_crypto_init() == 0;
+#endif
+	int ret = mbedtls_ssl_config_defaults(&conf, endpoint, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+	if (ret != 0)
+	{
+		verbose_print("TlsSocket: config failed 0x%x\n", -ret);
+		ok = false;
+	}
+	mbedtls_ssl_conf_read_timeout(&conf, 0);
 #ifdef TLS_DEBUG
-	mbedtls_ssl_conf_dbg(&_core->conf, my_debug, stdout);
+	mbedtls_ssl_conf_dbg(&conf, my_debug, stdout);
 	mbedtls_debug_set_threshold(TLS_DEBUG);
 #endif
+	if (endpoint == MBEDTLS_SSL_IS_SERVER)
+		useSessionStore(&conf);
+	else
+	{
+		mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_NONE);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_PROTO_TLS1_3) && MBEDTLS_VERSION_NUMBER >= 0x03060100
+		mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets(&conf,
+		                                                         MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED);
+#endif
+	}
+}
 
-	/*if ((ret = mbedtls_x509_crt_parse(&_core->cacert, (const byte*)mbedtls_test_cas_pem, mbedtls_test_cas_pem_len)) < 0)
+TlsConfig::~TlsConfig()
+{
+	mbedtls_ssl_config_free(&conf);
+	mbedtls_x509_crt_free(&cert);
+	mbedtls_x509_crt_free(&ca);
+	mbedtls_pk_free(&pkey);
+#if MBEDTLS_VERSION_MAJOR < 4
+	mbedtls_ctr_drbg_free(&ctr_drbg);
+	mbedtls_entropy_free(&entropy);
+#endif
+}
+
+bool TlsConfig::setCert(const String& certPem, const String& keyPem)
+{
+	int ret = mbedtls_x509_crt_parse(&cert, (const byte*)*certPem, certPem.length() + 1);
+	if (ret < 0)
 	{
-		_error = true;
-		return;
+		verbose_print("TlsSocket: cert parse error 0x%x\n", -ret);
+		return false;
 	}
-	
-	mbedtls_ssl_conf_ca_chain(&_core->conf, &_core->cacert, NULL);
-	*/
+#if MBEDTLS_VERSION_MAJOR == 3
+	ret = mbedtls_pk_parse_key(&pkey, (const byte*)*keyPem, keyPem.length() + 1, NULL, 0, lockedRandom, this);
+#else
+	ret = mbedtls_pk_parse_key(&pkey, (const byte*)*keyPem, keyPem.length() + 1, NULL, 0);
+#endif
+	if (ret < 0)
+	{
+		verbose_print("TlsSocket: key parse error 0x%x\n", -ret);
+		return false;
+	}
+	if ((ret = mbedtls_ssl_conf_own_cert(&conf, &cert, &pkey)) != 0)
+	{
+		verbose_print("TlsSocket: setting certificate failed 0x%x\n", -ret);
+		return false;
+	}
+	return true;
+}
+
+bool TlsConfig::setCA(const String& pem)
+{
+	int ret = mbedtls_x509_crt_parse(&ca, (const byte*)*pem, pem.length() + 1);
+	if (ret < 0)
+	{
+		verbose_print("TlsSocket: CA parse error 0x%x\n", -ret);
+		return false;
+	}
+	mbedtls_ssl_conf_ca_chain(&conf, &ca, NULL);
+	mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+	return true;
+}
+
+struct TlsContextData
+{
+	Mutex mutex;               // held while replacing or taking the configurations
+	Shared<TlsConfig> server;
+	Shared<TlsConfig> client;
+	String ca;
+};
+
+TlsContext::TlsContext() : _d(new TlsContextData) {}
+
+TlsContext::TlsContext(const TlsContext& c) : _d(c._d) {}
+
+TlsContext& TlsContext::operator=(const TlsContext& c)
+{
+	_d = c._d;
+	return *this;
+}
+
+TlsContext::~TlsContext() {}
+
+bool TlsContext::useCert(const String& cert, const String& key)
+{
+	Shared<TlsConfig> config = new TlsConfig(MBEDTLS_SSL_IS_SERVER);
+	if (!config->ok || !config->setCert(cert, key))
+		return false;
+	Lock _(_d->mutex);
+	_d->server = config;
+	return true;
+}
+
+bool TlsContext::useCA(const String& ca)
+{
+	Shared<TlsConfig> config = new TlsConfig(MBEDTLS_SSL_IS_CLIENT);
+	if (!config->ok || !config->setCA(ca))
+		return false;
+	Lock _(_d->mutex);
+	_d->client = config;
+	_d->ca = ca;
+	return true;
+}
+
+// Returns the current server configuration, with the test certificate if none was given
+
+Shared<TlsConfig> TlsContext::serverConfig() const
+{
+	Lock _(_d->mutex);
+	if (!_d->server)
+	{
+		Shared<TlsConfig> config = new TlsConfig(MBEDTLS_SSL_IS_SERVER);
+		config->setCert(asl_test_srv_crt_rsa, asl_test_srv_key_rsa);
+		_d->server = config;
+	}
+	return _d->server;
+}
+
+Shared<TlsConfig> TlsContext::clientConfig() const
+{
+	Lock _(_d->mutex);
+	if (!_d->client)
+		_d->client = new TlsConfig(MBEDTLS_SSL_IS_CLIENT);
+	return _d->client;
+}
+
+// The context of a socket, taken under its lock as useContext() may replace it from another thread
+
+static TlsContext contextOf(TlsCore* core, bool& own)
+{
+	Lock _(core->contextMutex);
+	own = core->hasContext;
+	return core->context;
+}
+
+static TlsContext contextOf(TlsCore* core)
+{
+	bool own;
+	return contextOf(core, own);
+}
+
+// Client connections without their own context share this one
+
+static TlsContext& clientContext()
+{
+	static TlsContext context;
+	return context;
+}
+
+TlsSessionStats TlsSocket::sessionStats()
+{
+	TlsSessionStore& store = sessionStore();
+	Lock _(store.mutex);
+	return store.stats;
+}
+
+void TlsSocket::clearSessions()
+{
+	TlsSessionStore& store = sessionStore();
+	Lock _(store.mutex);
+	store.clientSessions.clear();
+}
+
+TlsSocket_::TlsSocket_()
+{
+	_error = 0;
+	_core = new TlsCore;
+	_core->hasContext = false;
+	_core->state = TLS_READY;
+	_core->handshakeTimeout = 10;
+	_core->deadline = 0;
+	_core->nonblocking = false;
+	_core->pendingWrite = 0;
+	mbedtls_net_init(&_core->net);
+	mbedtls_ssl_init(&_core->ssl);
+	mbedtls_ssl_set_bio(&_core->ssl, _core, sendCore, recvCore, NULL);
 	_type = TCP;
 	_blocking = true;
 }
@@ -228,26 +707,33 @@ TlsSocket_::~TlsSocket_()
 {
 	TlsSocket_::close();
 	mbedtls_net_free(&_core->net);
-	mbedtls_x509_crt_free(&_core->cacert);
-	mbedtls_ssl_free(&_core->ssl);
-	mbedtls_ssl_config_free(&_core->conf);
-#if MBEDTLS_VERSION_MAJOR < 4
-	mbedtls_ctr_drbg_free(&_core->ctr_drbg);
-	mbedtls_entropy_free(&_core->entropy);
-#endif
-	if (_core->bound)
-	{
-		mbedtls_pk_free(&_core->pkey);
-		mbedtls_x509_crt_free(&_core->srvcert);
-	}
+	mbedtls_ssl_free(&_core->ssl); // before its configuration is released
 	delete _core;
 }
 
+// Frees the connection state after a failed connect, so that the socket can try again
+
+void TlsSocket_::reset()
+{
+	mbedtls_net_free(&_core->net);
+	mbedtls_ssl_free(&_core->ssl);
+	mbedtls_ssl_init(&_core->ssl);
+	mbedtls_ssl_set_bio(&_core->ssl, _core, sendCore, recvCore, NULL);
+	_core->config = Shared<TlsConfig>();
+	_core->nonblocking = false;
+	_core->pendingWrite = 0;
+	_handle = -1;
+}
+
 void TlsSocket_::close()
 {
 	if (_handle >= 0)
+	{
+		Lock _(_core->ioMutex);
 		mbedtls_ssl_close_notify(&_core->ssl);
+	}
 	_handle = -1;
+	_inpos = _inend = 0;
 }
 
 int TlsSocket_::handle() const
@@ -262,13 +748,6 @@ bool TlsSocket_::bind(const String& ip, int port)
 		_error = SOCKET_BAD_BIND;
 		return false;
 	}
-	mbedtls_x509_crt_init(&_core->srvcert);
-	mbedtls_pk_init(&_core->pkey);
-	_core->bound = true;
-
-	useCert(asl_test_srv_crt_rsa);
-	useKey(asl_test_srv_key_rsa);
-
 	InetAddress here(ip, port);
 	String host = here.host();
 	int ret = mbedtls_net_bind(&_core->net, host, String(port), MBEDTLS_NET_PROTO_TCP);
@@ -278,27 +757,11 @@ bool TlsSocket_::bind(const String& ip, int port)
 		_error = SOCKET_BAD_BIND;
 		return false;
 	}
-	if ((ret = mbedtls_ssl_config_defaults(&_core->conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
-	                                       MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
+	if (!contextOf(_core).serverConfig()->ok)
 	{
-		verbose_print("TlsSocket: config failed 0x%x\n", -ret);
 		_error = SOCKET_BAD_CONFIG;
 		return false;
 	}
-
-	if ((ret = mbedtls_ssl_conf_own_cert(&_core->conf, &_core->srvcert, &_core->pkey)) != 0)
-	{
-		verbose_print("TlsSocket: setting certificate failed 0x%x\n", ret);
-		_error = SOCKET_BAD_CERT;
-		return false;
-	}
-	if ((ret = mbedtls_ssl_setup(&_core->ssl, &_core->conf)) != 0)
-	{
-		verbose_print("TlsSocket: session setup failed 0x%x\n", -ret);
-		_error = SOCKET_BAD_SESSION;
-		return false;
-	}
-
 	return true;
 }
 
@@ -310,17 +773,14 @@ Socket_* TlsSocket_::accept()
 	TlsSocket_* cli = new TlsSocket_();
 
 	mbedtls_net_free(&cli->_core->net);
-	ret = mbedtls_ssl_config_defaults(&cli->_core->conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
-	                                  MBEDTLS_SSL_PRESET_DEFAULT);
-	if ((ret = mbedtls_ssl_conf_own_cert(&cli->_core->conf, &_core->srvcert, &_core->pkey)) != 0)
+	cli->_core->config = contextOf(_core).serverConfig(); // the current certificate, even if replaced later
+	if ((ret = mbedtls_ssl_setup(&cli->_core->ssl, &cli->_core->config->conf)) != 0)
 	{
-		verbose_print("TlsSocket: setting certificate failed -0x%x\n", ret);
-		_error = SOCKET_BAD_CERT;
+		verbose_print("TlsSocket: session setup failed 0x%x\n", -ret);
+		_error = SOCKET_BAD_SESSION;
 		return cli;
 	}
 
-	ret = mbedtls_ssl_setup(&cli->_core->ssl, &cli->_core->conf);
-
 	char ip[128];
 	size_t ipsize = 0;
 	ret = mbedtls_net_accept(&_core->net, &cli->_core->net, ip, sizeof(ip), &ipsize);
@@ -339,10 +799,25 @@ Socket_* TlsSocket_::accept()
 		return cli;
 	}
 
-	mbedtls_ssl_set_bio(&cli->_core->ssl, &cli->_core->net, mbedtls_net_send, mbedtls_net_recv, mbedtls_net_recv_timeout);
+	// the handshake is done later by the first operation on the connection, in the thread serving it
+
+	mbedtls_ssl_set_bio(&cli->_core->ssl, cli->_core, sendCore, recvCore, recvDeadline);
+	cli->_core->state = TLS_PENDING;
+	cli->_core->deadline = now() + _core->handshakeTimeout;
+	cli->_handle = 0;
+	return cli;
+}
+
+// Completes the handshake of an accepted connection, failing if it is not done within the handshake timeout since
+// the connection was accepted
 
+bool TlsSocket_::handshake()
+{
+	if (_core->state != TLS_PENDING)
+		return _core->state == TLS_READY;
+	int ret;
 	do
-		ret = mbedtls_ssl_handshake(&cli->_core->ssl);
+		ret = mbedtls_ssl_handshake(&_core->ssl);
 #ifdef MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS
 	while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE ||
 	       ret == MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS);
@@ -350,42 +825,21 @@ Socket_* TlsSocket_::accept()
 	while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
 #endif
 
-	if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED)
-	{
-		verbose_print("TlsSocket: hello verification requested\n");
-		_error = SOCKET_BAD_HELLO;
-		return cli;
-	}
-	else if (ret != 0)
+	if (ret != 0)
 	{
-		_error = SOCKET_BAD_HANDSHAKE;
+		_error = ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED ? SOCKET_BAD_HELLO : SOCKET_BAD_HANDSHAKE;
 		verbose_print("TlsSocket: handshake error -0x%x\n", -ret);
-
-#if defined(MBEDTLS_X509_CRT_PARSE_C)
-		if (ret == MBEDTLS_ERR_X509_CERT_VERIFY_FAILED)
-		{
-			char vrfy_buf[512];
-			unsigned flags = mbedtls_ssl_get_verify_result(&cli->_core->ssl);
-			mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "", flags);
-			// verbose_print("TlsSocket: auth failed: %s\n", vrfy_buf);
-		}
-#endif
-		return cli;
-	}
-	else // ret == 0
-	{
-		// verbose_print("Protocol %s\nCiphersuite is %s\n", mbedtls_ssl_get_version(&cli->_core->ssl),
-		// mbedtls_ssl_get_ciphersuite(&cli->_core->ssl));
+		_core->state = TLS_FAILED;
+		return false;
 	}
 
-	/*
-	if ((ret = mbedtls_ssl_get_record_expansion(&cli->_core->ssl)) >= 0) // returns 29
-		verbose_print("Record expansion is %d\n", ret);
-	else
-		verbose_print("Record expansion is unknown\n");
-	*/
-	// verbose_print("TLS accepted connection\n");
-	return cli;
+	mbedtls_ssl_set_bio(&_core->ssl, _core, sendCore, recvCore, NULL);
+	_core->nonblocking = true;
+	_core->state = TLS_READY;
+	TlsSessionStore& store = sessionStore();
+	Lock _(store.mutex);
+	store.stats.accepted++;
+	return true;
 }
 
 bool TlsSocket_::connect(const InetAddress& addr)
@@ -393,27 +847,29 @@ bool TlsSocket_::connect(const InetAddress& addr)
 	int ret = mbedtls_net_connect(&_core->net, addr.host(), String(addr.port()), MBEDTLS_NET_PROTO_TCP);
 	if (ret)
 	{
-		(*this) = TlsSocket_();
+		reset();
 		_error = SOCKET_BAD_CONNECT;
 		return false;
 	}
-	ret = mbedtls_ssl_config_defaults(&_core->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
-	                                  MBEDTLS_SSL_PRESET_DEFAULT);
-	mbedtls_ssl_conf_authmode(&_core->conf, MBEDTLS_SSL_VERIFY_NONE);
-	ret = mbedtls_ssl_setup(&_core->ssl, &_core->conf);
+	bool own;
+	TlsContext context = contextOf(_core, own);
+	_core->config = (own ? context : clientContext()).clientConfig();
+	ret = _core->config->ok ? mbedtls_ssl_setup(&_core->ssl, &_core->config->conf) : -1;
 	if (ret)
 	{
-		(*this) = TlsSocket_();
+		reset();
 		_error = SOCKET_BAD_TLS;
 		return false;
 	}
 	ret = mbedtls_ssl_set_hostname(&_core->ssl, _hostname);
+	_core->sessionKey = (_hostname != "" ? _hostname : addr.host()) + ":" + String(addr.port());
+	bool cached = loadSession(_core);
 
 	while ((ret = mbedtls_ssl_handshake(&_core->ssl)) != 0)
 	{
 		if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret != -0x7000)
 		{
-			(*this) = TlsSocket_();
+			reset();
 			_error = SOCKET_BAD_TLS;
 			return false;
 		}
@@ -427,6 +883,15 @@ bool TlsSocket_::connect(const InetAddress& addr)
 		// wrong certificate
 	}
 	*/
+	saveSession(_core);
+	_core->nonblocking = true;
+	{
+		TlsSessionStore& store = sessionStore();
+		Lock _(store.mutex);
+		store.stats.connected++;
+		if (cached)
+			store.stats.cached++;
+	}
 	_handle = 0;
 	return true;
 }
@@ -436,88 +901,161 @@ bool TlsSocket_::setOption(int level, int opt, const void* val, int n)
 	return setsockopt(handle(), level, opt, (const SOCKOPT*)val, n) >= 0;
 }
 
-int TlsSocket_::available()
-{
-	mbedtls_ssl_read(&_core->ssl, NULL, 0);
-	return (int)mbedtls_ssl_get_bytes_avail(&_core->ssl);
-}
+// This must not block (it is used to decide whether to wait for more requests), so it does not read records: it gives
+// the decrypted bytes pending, or 1 if mbedTLS holds unprocessed input, or else the encrypted bytes in the socket
 
-int TlsSocket_::read(void* data, int size)
+int TlsSocket_::availableRaw()
 {
-	if (_blocking)
+	if (_core->state == TLS_FAILED)
+		return -1;
+	if (_core->state == TLS_READY)
 	{
-	int s = size, n;
-	while ((n = mbedtls_ssl_read(&_core->ssl, (unsigned char*)data, size)) < size)
-	{
-			if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE
-#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
-			    || n == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
-#endif
-			)
-			continue;
-			if (n < 0)
-			{
-				_error = SOCKET_BAD_RECV;
-				break;
-			}
-			else if (n == 0)
-			return s - size;
-		size -= n;
-		data = (char*)data + n;
-	}
-	return s;
+		Lock _(_core->ioMutex);
+		int n = (int)mbedtls_ssl_get_bytes_avail(&_core->ssl);
+		if (n > 0)
+			return n;
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+		if (mbedtls_ssl_check_pending(&_core->ssl))
+			return 1;
+#endif
 	}
-	else
+#ifndef _WIN32
+	long n;
+	if (ioctl(handle(), FIONREAD, &n) == 0)
+#else
+	unsigned long n;
+	if (ioctlsocket(handle(), FIONREAD, &n) == 0)
+#endif
+		return (int)n;
+	return -1;
+}
+
+// Reads and writes lock the connection only while mbedTLS runs, and wait for the socket without it
+
+int TlsSocket_::readRaw(void* data, int size)
+{
+	if (!handshake())
+		return -1;
+	int n;
+	while (1)
 	{
-		int n = 1, m = 0;
-		do
 		{
-			n = mbedtls_ssl_read(&_core->ssl, (unsigned char*)data, size); 
-			if (n > 0)
-				m += n;
-		} while (n > 0 || n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE
+			Lock _(_core->ioMutex);
+			n = sslRead(_core, (unsigned char*)data, size);
+		}
+		if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE)
+			ready(handle(), n == MBEDTLS_ERR_SSL_WANT_WRITE, -1);
 #ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
-		         || n == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+		else if (n != MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
+#else
+		else
 #endif
-		);
-		return m;
+			break;
 	}
+	if (n == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+		n = 0;
+	return n;
+}
+
+// Reads only what can be decrypted from the records received so far: the bytes available in the socket may be part
+// of a record, and are encrypted, so they do not tell how many bytes would be read without blocking
+
+int TlsSocket_::readRawSome(void* data, int size)
+{
+	if (!handshake())
+		return -1;
+	Lock _(_core->ioMutex);
+	int n;
+	do
+		n = sslRead(_core, (unsigned char*)data, size);
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+	while (n == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET);
+#else
+	while (0);
+#endif
+	if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE)
+		return 0;
+	return n > 0 ? n : -1;
 }
 
 int TlsSocket_::write(const void* data, int n)
 {
+	if (!handshake())
+		return 0;
 	int written = 0;
 	while (written < n)
 	{
 		int m;
-		do
 		{
-			m = mbedtls_ssl_write(&_core->ssl, (unsigned char*)data + written, n - written);
-			if (m == MBEDTLS_ERR_SSL_WANT_READ || m == MBEDTLS_ERR_SSL_WANT_WRITE)
-				continue;
-			if (m <= 0)
-				return written;
-			else
-				break;
-		} while (1);
+			Lock _(_core->ioMutex);
+			m = sslWrite(_core, (const byte*)data + written, n - written);
+		}
+		if (m < 0)
+			break;
+		if (m == 0)
+			ready(handle(), true, -1);
 		written += m;
 	}
 	return written;
 }
 
+// Writes at most one record without blocking. If the socket fills up in the middle of a record this returns 0 and
+// mbedTLS keeps the rest: the next call must pass the same data, and then returns its length once it is all sent
+
+int TlsSocket_::writeSome(const void* data, int n)
+{
+	if (n == 0)
+		return 0;
+	if (!handshake())
+		return -1;
+	Lock _(_core->ioMutex);
+	int m = sslWrite(_core, data, n);
+	if (m < 0)
+		_error = SOCKET_BAD_DATA;
+	return m < 0 ? -1 : m;
+}
+
+// Gathers the blocks in one buffer so that they can go in as few TLS records as possible
+
+int TlsSocket_::writev(const SocketBuf* bufs, int count)
+{
+	int total = 0;
+	for (int i = 0; i < count; i++)
+		total += bufs[i].length;
+	if (total == 0)
+		return 0;
+	ByteArray data(total);
+	for (int i = 0, j = 0; i < count; j += bufs[i++].length)
+		memcpy(&data[j], bufs[i].data, bufs[i].length);
+	return write(data.data(), total);
+}
+
 bool TlsSocket_::waitInput(double t)
 {
-	if (available() != 0)
+	if (_core->state == TLS_PENDING) // wait for the client hello and then do the handshake, if it is in time
+	{
+		double t0 = now(), left = _core->deadline - t0;
+		if (!waitRaw(max(min(t, left), 0.0)))
+		{
+			if (t < left)
+				return false;
+			_error = SOCKET_BAD_HANDSHAKE;
+			_core->state = TLS_FAILED;
+			return true;
+		}
+		handshake();
+		t = max(t - (now() - t0), 0.0);
+	}
+	if (_core->state == TLS_FAILED)
 		return true;
-	// else return false;
-	fd_set rset;
-	struct timeval to;
-	to.tv_sec = (int)floor(t);
-	to.tv_usec = (int)((t - floor(t)) * 1e6);
-	FD_ZERO(&rset);
-	FD_SET(handle(), &rset);
-	select(handle() + 1, &rset, 0, 0, &to);
-	return FD_ISSET(handle(), &rset) != 0;
+	if (buffered() > 0 || availableRaw() != 0)
+		return true;
+	return waitRaw(t);
+}
+
+bool TlsSocket_::waitRaw(double t)
+{
+	return ready(handle(), false, t);
 }
 
 String TlsSocket_::errorMsg() const
@@ -525,46 +1063,44 @@ String TlsSocket_::errorMsg() const
 	return messages[_error];
 }
 
+void TlsSocket_::setHandshakeTimeout(double timeout)
+{
+	_core->handshakeTimeout = timeout;
+}
+
 bool TlsSocket_::useCert(const String& cert)
 {
-	mbedtls_x509_crt_free(&_core->srvcert);
-	mbedtls_x509_crt_init(&_core->srvcert);
-	int ret = mbedtls_x509_crt_parse(&_core->srvcert, (byte*)*cert, cert.length() + 1);
+	mbedtls_x509_crt crt;
+	mbedtls_x509_crt_init(&crt);
+	int ret = mbedtls_x509_crt_parse(&crt, (const byte*)*cert, cert.length() + 1);
+	mbedtls_x509_crt_free(&crt);
 	if (ret < 0)
 	{
 		verbose_print("TlsSocket: cert parse error 0x%x\n", -ret);
 		_error = SOCKET_BAD_CERT;
 		return false;
 	}
-	// char buf[500];
-	// mbedtls_x509_crt_info(buf, 500, "Tls: ", &_core->srvcert);
-	// printf("%s\n", buf);
+	_core->certPem = cert;
 	return true;
 }
 
+// The certificate and key replace the ones of this socket's context, for the connections accepted from now on
+
 bool TlsSocket_::useKey(const String& key)
 {
-	mbedtls_pk_free(&_core->pkey);
-	mbedtls_pk_init(&_core->pkey);
-#if MBEDTLS_VERSION_MAJOR == 3
-	int ret = mbedtls_pk_parse_key(&_core->pkey, (byte*)*key, key.length() + 1, NULL, 0, mbedtls_ctr_drbg_random,
-	                               &_core->ctr_drbg);
-#else
-	int ret = mbedtls_pk_parse_key(&_core->pkey, (byte*)*key, key.length() + 1, NULL, 0);
-#endif
-	if (ret < 0)
+	if (!contextOf(_core).useCert(_core->certPem, key))
 	{
-		verbose_print("TlsSocket: key parse error 0x%x\n", -ret);
 		_error = SOCKET_BAD_CERT;
 		return false;
 	}
-	ret = mbedtls_ssl_conf_own_cert(&_core->conf, &_core->srvcert, &_core->pkey);
-	if (ret)
-	{
-		verbose_print("TlsSocket: setting certificate failed 0x%x\n", -ret);
-		_error = SOCKET_BAD_CERT;
-	}
-	return ret == 0;
+	return true;
+}
+
+void TlsSocket_::useContext(const TlsContext& context)
+{
+	Lock _(_core->contextMutex);
+	_core->context = context;
+	_core->hasContext = true;
 }
 
 }
@@ -1,15 +1,24 @@
 #include <asl/Socket.h>
 #include <asl/Map.h>
 #include <asl/WebSocket.h>
-#include <asl/StreamBuffer.h>
 #include <asl/SHA1.h>
 #include <asl/util.h>
 #include <asl/Http.h>
 #include <asl/JSON.h>
+#include <asl/Thread.h>
 #ifdef ASL_TLS
 #include <asl/TlsSocket.h>
 #endif
 #include <ctype.h>
+#ifdef ASL_ZLIB
+#include <zlib.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ASL_WS_SSE2
+#endif
 
 namespace asl {
 
@@ -44,38 +53,409 @@ WebSocketMsg& WebSocketMsg::fix()
 	return *this;
 }
 
+static byte frameOpcode(WebSocket::FrameType type)
+{
+	return (type == WebSocket::FRAME_TEXT) ? 1 : (type == WebSocket::FRAME_BINARY) ? 2 : (type == WebSocket::FRAME_PONG) ? 10 :
+		(type == WebSocket::FRAME_PING) ? 9 : 8;
+}
+
+// XORs `n` bytes from `src` with the 4-byte masking key into `dst` (which can be the same as `src`), with a
+// vectorized main loop (AVX2 or SSE2 when available) and 8-byte words otherwise
+
+static void maskBytes(byte* dst, const byte* src, int n, const byte* key)
+{
+	int i = 0;
+	unsigned k4;
+	memcpy(&k4, key, 4);
+#if defined(__AVX2__)
+	__m256i k32 = _mm256_set1_epi32((int)k4);
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(x, k32));
+	}
+#elif defined(ASL_WS_SSE2)
+	__m128i k16 = _mm_set1_epi32((int)k4);
+	for (; i + 64 <= n; i += 64)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(a, k16));
+		_mm_storeu_si128((__m128i*)(dst + i + 16), _mm_xor_si128(b, k16));
+		_mm_storeu_si128((__m128i*)(dst + i + 32), _mm_xor_si128(c, k16));
+		_mm_storeu_si128((__m128i*)(dst + i + 48), _mm_xor_si128(d, k16));
+	}
+	for (; i + 16 <= n; i += 16)
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i)), k16));
+#endif
+	ULong k8 = ((ULong)k4 << 32) | k4;
+	for (; i + 8 <= n; i += 8)
+	{
+		ULong x;
+		memcpy(&x, src + i, 8);
+		x ^= k8;
+		memcpy(dst + i, &x, 8);
+	}
+	for (; i < n; i++)
+		dst[i] = src[i] ^ key[i & 3];
+}
+
+// Writes a frame header into `h` (up to 14 bytes) and returns its length
+
+static int frameHeader(byte* h, Long length, byte opcode, bool masked, unsigned mask)
+{
+	int head = 2;
+	h[0] = 0x80 | opcode;
+	byte m = masked ? 0x80 : 0;
+	if (length < 126)
+		h[1] = m | (byte)length;
+	else if (length < (1 << 16))
+	{
+		h[1] = m | 126;
+		h[2] = byte(length >> 8);
+		h[3] = byte(length);
+		head = 4;
+	}
+	else
+	{
+		h[1] = m | 127;
+		for (int i = 0; i < 8; i++)
+			h[2 + i] = byte(length >> (56 - 8 * i));
+		head = 10;
+	}
+	if (masked)
+	{
+		for (int i = 0; i < 4; i++)
+			h[head + i] = byte(mask >> (24 - 8 * i));
+		head += 4;
+	}
+	return head;
+}
+
+// Builds a complete frame (header and payload, masked if requested) in a single buffer
+
+static ByteArray makeFrame(const byte* p, int length, byte opcode, bool masked, unsigned mask)
+{
+	byte h[14];
+	int head = frameHeader(h, length, opcode, masked, mask);
+	ByteArray frame(head + length);
+	memcpy(frame.data(), h, head);
+	if (masked)
+		maskBytes(frame.data() + head, p, length, h + head - 4);
+	else
+		memcpy(frame.data() + head, p, length);
+	return frame;
+}
+
+// State of the permessage-deflate extension (RFC 7692) of a connection: messages are deflated with a sync flush
+// and the trailing 00 00 ff ff is removed (and restored before inflating)
+
+struct WebSocketDeflate
+{
+#ifdef ASL_ZLIB
+	z_stream out, in;
+	int bits;      // our compression window
+	bool reset;    // no context takeover for our messages
+	int minSize;
+	WebSocketDeflate(int level, int windowBits, bool noTakeover, int min) : bits(windowBits), reset(noTakeover), minSize(min),
+		tailFed(false)
+	{
+		memset(&out, 0, sizeof(out));
+		memset(&in, 0, sizeof(in));
+		deflateInit2(&out, level, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY);
+		inflateInit2(&in, -15);
+	}
+	~WebSocketDeflate()
+	{
+		deflateEnd(&out);
+		inflateEnd(&in);
+	}
+	ByteArray compress(const byte* p, int n)
+	{
+		ByteArray dst(n / 2 + 64);
+		int m = 0;
+		out.next_in = (Bytef*)p;
+		out.avail_in = n;
+		do {
+			if (m == dst.length())
+				dst.resize(2 * m);
+			out.next_out = dst.data() + m;
+			out.avail_out = dst.length() - m;
+			deflate(&out, Z_SYNC_FLUSH);
+			m = dst.length() - out.avail_out;
+		} while (out.avail_out == 0);
+		if (reset)
+			deflateReset(&out);
+		return dst.resize(m - 4);
+	}
+	// inflates a whole message, returns 0 or the close code for an error (invalid data or larger than `maxSize`)
+	int decompress(ByteArray& data, ByteArray& dst, int maxSize)
+	{
+		static const byte tail[] = { 0, 0, 0xff, 0xff };
+		data.append(tail, 4);
+		in.next_in = data.data();
+		in.avail_in = data.length();
+		dst.resize(clamp(3 * data.length(), 256, maxSize));
+		int m = 0;
+		while (1)
+		{
+			in.next_out = dst.data() + m;
+			in.avail_out = dst.length() - m;
+			int r = inflate(&in, Z_SYNC_FLUSH);
+			m = dst.length() - in.avail_out;
+			if (r == Z_STREAM_END) // the peer finished the deflate stream
+				inflateReset(&in);
+			else if (r != Z_OK && r != Z_BUF_ERROR)
+				return 1007;
+			if (in.avail_out != 0)
+				break;
+			if (dst.length() >= maxSize)
+				return 1009;
+			dst.resize((int)min(2 * (Long)dst.length(), (Long)maxSize));
+		}
+		dst.resize(m);
+		return (in.avail_in == 0 || in.avail_in == 4) ? 0 : 1007;
+	}
+	// streamed reception: compressed payload is set as input and inflated in parts
+	ByteArray input;
+	bool tailFed;
+	void feed(const byte* p, int n)
+	{
+		in.next_in = (Bytef*)p;
+		in.avail_in = n;
+	}
+	void feedTail()
+	{
+		static const byte tail[] = { 0, 0, 0xff, 0xff };
+		feed(tail, 4);
+		tailFed = true;
+	}
+	int inflatePart(byte* dst, int n)
+	{
+		in.next_out = dst;
+		in.avail_out = n;
+		int r = in.avail_in > 0 ? inflate(&in, Z_SYNC_FLUSH) : Z_BUF_ERROR;
+		if (r == Z_STREAM_END)
+			inflateReset(&in);
+		else if (r != Z_OK && r != Z_BUF_ERROR)
+			return -1;
+		return n - in.avail_out;
+	}
+#endif
+};
+
+// Splits a Sec-WebSocket-Extensions header into its extensions, each one a map of its parameters with the
+// extension name as the "" key
+
+static Array<Dic<String> > parseExtensions(const String& header)
+{
+	Array<Dic<String> > extensions;
+	Array<String> list = header.split(",");
+	foreach(String& item, list)
+	{
+		Array<String> params = item.split(";");
+		Dic<String> ext;
+		ext[""] = params[0].trimmed();
+		for (int i = 1; i < params.length(); i++)
+		{
+			String param = params[i].trimmed();
+			int j = param.indexOf('=');
+			if (j < 0)
+				ext[param] = "";
+			else
+				ext[param.substring(0, j).trimmed()] = param.substring(j + 1).trimmed().replace("\"", "");
+		}
+		extensions << ext;
+	}
+	return extensions;
+}
+
+static bool validWindowBits(const String& value)
+{
+	int bits = myatoi(value);
+	return value.length() > 0 && bits >= 8 && bits <= 15;
+}
+
+// Chooses the first acceptable permessage-deflate offer from a client, given the server's window bits and context
+// takeover, and returns the parameters to answer with (or an empty string if none is acceptable)
+
+static String acceptDeflate(const String& offers, int maxBits, bool takeover, int& bits, bool& reset)
+{
+	Array<Dic<String> > extensions = parseExtensions(offers);
+	foreach(Dic<String>& offer, extensions)
+	{
+		if (offer[""] != "permessage-deflate")
+			continue;
+		bool valid = true;
+		bits = maxBits;
+		reset = !takeover;
+		String answer = "permessage-deflate";
+		foreach2(String& name, String& value, offer)
+		{
+			if (name == "")
+				continue;
+			if (name == "server_no_context_takeover" && value == "")
+				reset = true;
+			else if (name == "server_max_window_bits" && validWindowBits(value))
+				bits = min(bits, myatoi(value));
+			else if (name == "client_max_window_bits" && (value == "" || validWindowBits(value)))
+			{
+				int clientBits = (value == "") ? maxBits : min(maxBits, myatoi(value));
+				if (clientBits < 15)
+					answer << "; client_max_window_bits=" << clientBits;
+			}
+			else if (name != "client_no_context_takeover" || value != "")
+				valid = false;
+		}
+		if (!valid || bits < 9) // zlib cannot deflate with a 256 byte window
+			continue;
+		if (reset)
+			answer << "; server_no_context_takeover";
+		if (!takeover || offer.has("client_no_context_takeover"))
+			answer << "; client_no_context_takeover";
+		if (bits < 15 || offer.has("server_max_window_bits"))
+			answer << "; server_max_window_bits=" << bits;
+		return answer;
+	}
+	return String();
+}
+
+// Background thread sending queued broadcast frames to clients as their sockets accept them
+
+struct WebSocketSender : public Thread
+{
+	WebSocketServer* server;
+	Semaphore wakeup;
+	volatile bool stop;
+	WebSocketSender(WebSocketServer* s) : server(s), stop(false) {}
+	void run()
+	{
+		bool pending = false;
+		while (!stop)
+		{
+			if (pending)
+				wakeup.wait(0.005);
+			else
+				wakeup.wait();
+			pending = server->flushClients();
+		}
+	}
+};
+
 WebSocketServer::WebSocketServer()
 {
 	_requestStop = false;
+	_maxMessage = 100 * 1024 * 1024;
+	_idleTimeout = 0;
+	_sender = NULL;
+	_queueMax = 1024 * 1024;
+	_coalesce = true;
+	_compressLevel = 0;
+	_compressMin = 64;
+	_compressBits = 15;
+	_compressTakeover = true;
 }
 
 WebSocketServer::WebSocketServer(int port)
 {
 	bind(port);
 	_requestStop = false;
+	_maxMessage = 100 * 1024 * 1024;
+	_idleTimeout = 0;
+	_sender = NULL;
+	_queueMax = 1024 * 1024;
+	_coalesce = true;
+	_compressLevel = 0;
+	_compressMin = 64;
+	_compressBits = 15;
+	_compressTakeover = true;
 }
 
-void WebSocketServer::serve(Socket client)
+WebSocketServer::~WebSocketServer()
+{
+	if (_sender)
+	{
+		_sender->stop = true;
+		_sender->wakeup.post();
+		_sender->join();
+		delete _sender;
+	}
+}
+
+int WebSocketServer::broadcast(const byte* data, int n, WebSocket::FrameType type)
+{
+	ByteArray frame = makeFrame(data, n, frameOpcode(type), false, 0);
+	ByteArray deflated; // without context takeover the same compressed frame is valid for all compressing clients
+#ifdef ASL_ZLIB
+	if (_compressLevel > 0 && !_compressTakeover && n >= _compressMin)
+	{
+		WebSocketDeflate deflate(_compressLevel, _compressBits, true, 0);
+		ByteArray payload = deflate.compress(data, n);
+		deflated = makeFrame(payload.data(), payload.length(), frameOpcode(type) | 0x40, false, 0);
+	}
+#endif
+	int queued = 0;
+	Lock _(_mutex);
+	if (_clients.length() == 0)
+		return 0;
+	if (!_sender)
+	{
+		_sender = new WebSocketSender(this);
+		_sender->start();
+	}
+	foreach(WebSocket* ws, _clients)
+	{
+#ifdef ASL_ZLIB
+		bool compress = deflated.length() > 0 && ws->_deflate && ws->_deflate->reset && ws->_deflate->bits == _compressBits;
+#else
+		bool compress = false;
+#endif
+		if (ws->enqueue(compress ? deflated : frame, _queueMax, _coalesce))
+			queued++;
+	}
+	_sender->wakeup.post();
+	return queued;
+}
+
+int WebSocketServer::broadcast(const Var& data)
+{
+	return broadcast(Json::encode(data));
+}
+
+// sends what fits of each client's queue, returns true if some data remains
+
+bool WebSocketServer::flushClients()
+{
+	Lock _(_mutex);
+	bool pending = false;
+	foreach(WebSocket* ws, _clients)
+		if (ws->flushQueue() > 0)
+			pending = true;
+	return pending;
+}
+
+// Reads the HTTP upgrade request of a new connection
+
+static bool readHandshake(Socket& client, Dic<String>& headers)
 {
 	String head = client.readLine();
 	int i = head.indexOf(' ');
 	if (i == -1)
-		return;
+		return false;
 	int j = head.indexOf(' ', i + 1);
 	if (j == -1)
-		return;
-	String method = head.substring(0, i);
-	String res = head.substring(i + 1, j);
+		return false;
 
 	String line;
-	Dic<String> headers;
 	while (line = client.readLine(), line != "\r")
 	{
 		line = line.trim();
 		int c = line.indexOf(':');
 		if (c < 0) {
 			client.close();
-			return;
+			return false;
 		}
 		String name = line.substring(0, c);
 		String cname;
@@ -91,16 +471,71 @@ void WebSocketServer::serve(Socket client)
 	}
 
 	DEBUG_LOG("%s\n\n\n", *headers.join("\n", ": "));
+	return true;
+}
+
+void WebSocketServer::serve(Socket client)
+{
+	Dic<String> headers;
+	if (readHandshake(client, headers))
+		process(client, headers);
+}
 
-	process(client, headers);
+bool WebSocketServer::serveInput(Socket client)
+{
+	bool keep;
+	if (pollClient(client, keep))
+		return keep;
+	Dic<String> headers;
+	return readHandshake(client, headers) && process(client, headers, true);
 }
 
-void WebSocketServer::process(Socket& client, const Dic<String>& headers)
+// If the client is a WebSocket served in reactor mode, processes its input and returns true, with `keep` set to
+// false if it was closed
+
+bool WebSocketServer::pollClient(Socket& client, bool& keep)
+{
+	WebSocket* ws;
+	{
+		Lock _(_asyncMutex);
+		WebSocket** p = _async.find(client.ptr());
+		if (!p)
+			return false;
+		ws = *p;
+	}
+	keep = ws->pollInput(true) && !_requestStop;
+	return true;
+}
+
+void WebSocketServer::serveClose(Socket client)
+{
+	WebSocket* ws;
+	{
+		Lock _(_asyncMutex);
+		WebSocket** p = _async.find(client.ptr());
+		if (!p)
+			return;
+		ws = *p;
+		_async.remove(client.ptr());
+	}
+	{
+		Lock _(_mutex);
+		_clients.removeOne(ws);
+	}
+	ws->close();
+	ws->notifyClose();
+	delete ws;
+}
+
+// Answers the upgrade request and serves the connection in this thread, or if `async` registers it to be served by
+// the reactor and returns true
+
+bool WebSocketServer::process(Socket& client, const Dic<String>& headers, bool async)
 {
 	if (!headers.has("Upgrade") || headers["Upgrade"] != "websocket" || !headers["Connection"].split(", ").contains("Upgrade"))
 	{
 		client << "HTTP/1.1 400 Bad request\r\n\r\nNot a WebSocket request";
-		return;
+		return false;
 	}
 
 	String key = headers["Sec-Websocket-Key"];
@@ -115,25 +550,57 @@ void WebSocketServer::process(Socket& client, const Dic<String>& headers)
 
 	if (headers.has("Sec-Websocket-Protocol"))
 		client << "Sec-Websocket-Protocol: chat\r\n";
-	client << "\r\n";
 
-	WebSocket ws(client, false);
+	WebSocket* ws = new WebSocket(client, false);
+	ws->_server = this;
+	ws->_maxMessage = _maxMessage;
+
+#ifdef ASL_ZLIB
+	if (_compressLevel > 0 && headers.has("Sec-Websocket-Extensions"))
+	{
+		int bits = _compressBits;
+		bool reset = !_compressTakeover;
+		String answer = acceptDeflate(headers["Sec-Websocket-Extensions"], _compressBits, _compressTakeover, bits, reset);
+		if (answer != "")
+		{
+			client << "Sec-WebSocket-Extensions: " << answer << "\r\n";
+			ws->_deflate = new WebSocketDeflate(_compressLevel, bits, reset, _compressMin);
+		}
+	}
+#endif
+	client << "\r\n";
 	{
 		Lock l(_mutex);
-		_clients << &ws;
+		_clients << ws;
 	}
-	serve(ws);
+	if (async)
+	{
+		{
+			Lock _(_asyncMutex);
+			_async[client.ptr()] = ws;
+		}
+		onOpen(*ws);
+		return true;
+	}
+	serve(*ws);
 	{
 		Lock l(_mutex);
-		_clients.removeOne(&ws);
+		_clients.removeOne(ws);
 	}
 	client.close();
+	delete ws;
+	return false;
 }
 
+// By default connections are served with the callbacks
 
-
-void WebSocketServer::serve(WebSocket&)
+void WebSocketServer::serve(WebSocket& ws)
 {
+	onOpen(ws);
+	while (ws.poll() && !_requestStop)
+		ws.wait(0.5);
+	ws.close();
+	ws.notifyClose();
 }
 
 WebSocket::WebSocket()
@@ -141,6 +608,22 @@ WebSocket::WebSocket()
 	_isClient = true;
 	_closed = true;
 	_code = 1000;
+	_inputPos = _inputEnd = _need = 0;
+	_frameLeft = -1;
+	_inMessage = false;
+	_messageType = FRAME_TEXT;
+	_messageDeflated = false;
+	_messageEnded = false;
+	_closeNotified = false;
+	_maxMessage = 100 * 1024 * 1024;
+	_server = NULL;
+	_queueBytes = 0;
+	_queueOffset = 0;
+	_dropped = 0;
+	_compressLevel = 0;
+	_compressMin = 64;
+	_compressBits = 15;
+	_compressTakeover = true;
 	_socket.setEndian(ENDIAN_BIG);
 }
 
@@ -150,10 +633,38 @@ WebSocket::WebSocket(const Socket& s, bool isclient):
 {
 	_closed = false;
 	_code = 1000;
+	_inputPos = _inputEnd = _need = 0;
+	_frameLeft = -1;
+	_inMessage = false;
+	_messageType = FRAME_TEXT;
+	_messageDeflated = false;
+	_messageEnded = false;
+	_closeNotified = false;
+	_maxMessage = 100 * 1024 * 1024;
+	_server = NULL;
+	_queueBytes = 0;
+	_queueOffset = 0;
+	_dropped = 0;
+	_compressLevel = 0;
+	_compressMin = 64;
+	_compressBits = 15;
+	_compressTakeover = true;
 	_socket.setEndian(ENDIAN_BIG);
 	_socket.setBlocking(true);
 }
 
+WebSocket::~WebSocket()
+{
+}
+
+void WebSocket::setCompression(int level, int minSize, int windowBits, bool contextTakeover)
+{
+	_compressLevel = level;
+	_compressMin = minSize;
+	_compressBits = clamp(windowBits, 9, 15);
+	_compressTakeover = contextTakeover;
+}
+
 bool WebSocket::connect(const String& uri, int port)
 {
 	String path = "/";
@@ -186,6 +697,20 @@ bool WebSocket::connect(const String& uri, int port)
 
 	String key64 = encodeBase64(key, 16);
 
+	String extensions;
+#ifdef ASL_ZLIB
+	if (_compressLevel > 0)
+	{
+		extensions = "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits";
+		if (_compressBits < 15)
+			extensions << '=' << _compressBits << "; server_max_window_bits=" << _compressBits;
+		if (!_compressTakeover)
+			extensions << "; client_no_context_takeover; server_no_context_takeover";
+		extensions << "\r\n";
+	}
+#endif
+	_deflate = NULL;
+
 	_socket << String(200, "GET %s HTTP/1.1\r\n"
 		"Host: %s:%i\r\n"
 		"Upgrade: websocket\r\n"
@@ -193,7 +718,8 @@ bool WebSocket::connect(const String& uri, int port)
 		"Sec-WebSocket-Key: %s\r\n"
 		"Sec-WebSocket-Protocol: chat\r\n"
 		"Sec-WebSocket-Version: 13\r\n"
-		"Pragma: no-cache\r\n\r\n", *url.path, *url.host, url.port, *key64);
+		"%s"
+		"Pragma: no-cache\r\n\r\n", *url.path, *url.host, url.port, *key64, *extensions);
 
 	String line = _socket.readLine();
 	int i = line.indexOf(' ');
@@ -236,7 +762,46 @@ bool WebSocket::connect(const String& uri, int port)
 		return false;
 	}
 
+	foreach2(String& name, String& value, headers)
+	{
+		if (!name.equalsNocase("Sec-WebSocket-Extensions"))
+			continue;
+		// the server can only accept what was offered, otherwise the connection must fail
+		Array<Dic<String> > accepted = parseExtensions(value);
+		bool valid = extensions != "" && accepted.length() == 1 && accepted[0][""] == "permessage-deflate";
+		int bits = _compressBits;
+		bool reset = !_compressTakeover;
+		if (valid)
+		{
+			foreach2(String& param, String& arg, accepted[0])
+			{
+				if (param == "" || ((param == "server_no_context_takeover" || param == "client_no_context_takeover") && arg == ""))
+				{
+					if (param == "client_no_context_takeover")
+						reset = true;
+				}
+				else if (param == "client_max_window_bits" && validWindowBits(arg))
+					bits = min(bits, myatoi(arg));
+				else if (param != "server_max_window_bits" || !validWindowBits(arg))
+					valid = false;
+			}
+		}
+		if (!valid || bits < 9)
+		{
+			_socket.close();
+			return false;
+		}
+#ifdef ASL_ZLIB
+		_deflate = new WebSocketDeflate(_compressLevel, bits, reset, _compressMin);
+#endif
+	}
+
 	_closed = false;
+	_closeNotified = false;
+	_inputPos = _inputEnd = 0;
+	_frameLeft = -1;
+	_inMessage = false;
+	_messageEnded = false;
 
 	return true;
 }
@@ -247,6 +812,16 @@ void WebSocket::close()
 	_closed = true;
 }
 
+// Closes the connection because of an error, telling the peer the reason with a close frame
+
+void WebSocket::fail(int code)
+{
+	_code = code;
+	byte status[2] = { byte(code >> 8), byte(code) };
+	sendFrame(status, 2, 8);
+	close();
+}
+
 bool WebSocket::closed()
 {
 	if (_closed)
@@ -259,89 +834,381 @@ bool WebSocket::closed()
 	return false;
 }
 
-WebSocketMsg WebSocket::receive()
+// Parses the next frame header in the input buffer. Returns -1 if it is not complete yet (and then _need has the
+// bytes missing), 1 if a data frame starts (its payload is then read separately), 2 if the connection was closed
+// (with a close frame, whose reason is left in `msg`, or because of an error), and 0 after a control frame
+
+int WebSocket::parseHeader(WebSocketMsg& msg, bool whole)
 {
-	WebSocketMsg msg;
-	bool haveMsg = false;
-	while (!haveMsg)
-	{
-		ByteArray buffer;
-		byte b0, mlen;
-		DEBUG_LOG("receive\n");
-		if (closed()) {
-			return msg.fix();
-		}
-		DEBUG_LOG("avail %i\n", _socket.available());
-		_socket >> b0 >> mlen;
-		DEBUG_LOG("%i %i\n", b0, mlen);
-		if (closed()) {
-			return msg.fix();
+	int avail = _inputEnd - _inputPos;
+	byte* p = _buffer.data() + _inputPos;
+	if (avail < 2)
+	{
+		_need = 2 - avail;
+		return -1;
+	}
+	int len7 = p[1] & 0x7f;
+	bool masked = (p[1] & 0x80) != 0;
+	int head = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + (masked ? 4 : 0);
+	if (avail < head)
+	{
+		_need = head - avail;
+		return -1;
+	}
+	ULong length = len7;
+	if (len7 == 126)
+		length = (p[2] << 8) | p[3];
+	else if (len7 == 127)
+	{
+		length = 0;
+		for (int i = 0; i < 8; i++)
+			length = (length << 8) | p[2 + i];
+	}
+	bool fin = (p[0] & 0x80) != 0;
+	int opcode = p[0] & 0x0f;
+	bool deflated = (p[0] & 0x40) != 0;
+
+	DEBUG_LOG("frame: op %i fin %i len %i\n", opcode, fin ? 1 : 0, (int)length);
+
+	if ((deflated && (!_deflate || (opcode != 1 && opcode != 2))) || (opcode >= 8 && (len7 > 125 || !fin)) ||
+		(opcode < 8 && (opcode == 0) != _inMessage) || (opcode > 2 && opcode < 8))
+	{
+		fail(1002); // protocol error
+		return 2;
+	}
+
+	if (opcode < 8) // data frame, its payload can be larger than the buffer
+	{
+		if (length > ULong(whole ? _maxMessage - _message.length() : 0x7fffffff))
+		{
+			fail(1009); // too big
+			return 2;
 		}
-		bool fin = !!(b0 & 0x80);
-		int opcode = b0 & 0x0f;
-		bool masked = !!(mlen & 0x80);
-		int len = mlen & 0x7f;
-		if (len == 126)
+		_inputPos += head;
+		_frameLeft = (Long)length;
+		_frameFin = fin;
+		_frameMask = masked ? 0 : -1;
+		if (masked)
+			memcpy(_frameKey, p + head - 4, 4);
+		if (opcode != 0)
 		{
-			len = _socket.read<unsigned short>();
+			_message.clear();
+			_messageType = (FrameType)opcode;
+			_messageDeflated = deflated;
+#ifdef ASL_ZLIB
+			if (deflated)
+				_deflate->tailFed = false;
+#endif
 		}
-		else if (len == 127)
-			len = (int)_socket.read<Long>(); // what if length larger than int?
+		_inMessage = true;
+		return 1;
+	}
 
-		unsigned mask = 0;
-		if (masked)
-			_socket >> mask;
+	int n = (int)length;
+	if (avail < head + n)
+	{
+		_need = head + n - avail;
+		return -1;
+	}
+	_need = 0;
+	_inputPos += head + n;
+	byte* payload = p + head;
+	if (masked)
+		maskBytes(payload, payload, n, payload - 4);
+
+	switch (opcode)
+	{
+	case 8: // connection close
+		if (n >= 2) {
+			_code = (payload[0] << 8) | payload[1];
+			msg._data = ByteArray(payload + 2, n - 2);
+		}
+		close();
+		return 2;
+	case 9: // ping
+		if (!_closed)
+			sendFrame(payload, n, 10);
+		break;
+	}
+	return 0;
+}
 
-		buffer.resize(buffer.length() + len);
-		if (len > 0)
-			_socket.read(buffer.data() + buffer.length() - len, len);
+// Copies up to `n` bytes of the current frame's payload into `dst`, first what is buffered and then reading at most
+// `maxRead` bytes from the socket (waiting for all of them if `block`), and unmasks them; returns the bytes copied or
+// -1 on error
 
-		DEBUG_LOG("frame: op %i fin %i len %i\n", opcode, fin ? 1 : 0, (int)len);
+int WebSocket::readPayload(byte* dst, int n, int maxRead, bool block)
+{
+	if (maxRead < 0)
+		return -1;
+	int m = (int)min((Long)n, _frameLeft);
+	int k = min(m, _inputEnd - _inputPos);
+	memcpy(dst, _buffer.data() + _inputPos, k);
+	_inputPos += k;
+	int r = min(m - k, maxRead);
+	if (r > 0)
+	{
+		int s = block ? _socket.read(dst + k, r) : _socket.readSome(dst + k, r);
+		if (block ? s != r : s < 0)
+			return -1;
+		k += s;
+	}
+	if (_frameMask >= 0)
+	{
+		byte key[4];
+		for (int i = 0; i < 4; i++)
+			key[i] = _frameKey[(_frameMask + i) & 3];
+		maskBytes(dst, dst, k, key);
+		_frameMask = (_frameMask + k) & 3;
+	}
+	_frameLeft -= k;
+	return k;
+}
 
-		if (masked)
+// Reads more input into the buffer after the bytes not yet parsed: the bytes needed for the next header (waiting for
+// them if `block`), or what can be read without blocking otherwise (for TLS `available()` counts encrypted bytes, so
+// it is only an upper bound); returns false if the connection was closed or nothing is available
+
+bool WebSocket::readInput(bool block)
+{
+	int n = block ? _need : min(_socket.available(), 16384);
+	if (n <= 0 || (block && closed()))
+		return false;
+	if (_inputPos > 0 && (_inputPos == _inputEnd || _inputEnd + n > _buffer.length()))
+	{
+		memmove(_buffer.data(), _buffer.data() + _inputPos, _inputEnd - _inputPos);
+		_inputEnd -= _inputPos;
+		_inputPos = 0;
+	}
+	if (_inputEnd + n > _buffer.length())
+		_buffer.resize(max(_inputEnd + n, 4096));
+	int r = block ? _socket.read(_buffer.data() + _inputEnd, n) : _socket.readSome(_buffer.data() + _inputEnd, n);
+	if (r > 0)
+		_inputEnd += r;
+	return block ? r == n : r > 0;
+}
+
+// Advances the reception of a whole message. The payload of data frames is read from the socket directly into the
+// message. Returns 1 if a message was completed (in `msg`), 2 if the connection was closed, 0 after a control
+// frame and -1 if not blocking and more input is needed
+
+int WebSocket::receiveStep(WebSocketMsg& msg, bool block)
+{
+	while (1)
+	{
+		if (_frameLeft < 0)
 		{
-			swapBytes(mask);
-			buffer.resize(buffer.length() + 4);
-			buffer.resize(buffer.length() - 4);
-			int n = buffer.length() / 4 + 1;
-			for (int i = 0; i < n; i++)
+			int r = parseHeader(msg, true);
+			if (r < 0)
 			{
-				((unsigned*)buffer.data())[i] ^= mask;
+				if (readInput(block))
+					continue;
+				if (!block)
+					return -1;
+				close();
+				return 2;
 			}
+			if (r != 1)
+				return r;
 		}
-
-		switch (opcode)
+		if (_frameLeft > 0) // the message grows with the payload received, not by the length the header announces
 		{
-		case 0: // continuation
-		case 1: // text
-		case 2: // binary
-			msg.append(buffer);
-			break;
-		case 8: // connection close
+			do
+			{
+				int m = _message.length(), maxRead = block ? 65536 : max(_socket.available(), 0);
+				int n = (int)min(_frameLeft, (Long)(_inputEnd - _inputPos + maxRead));
+				if (n == 0)
+					return -1;
+				_message.resize(m + n);
+				int k = readPayload(_message.data() + m, n, maxRead, block);
+				if (k < 0)
+				{
+					close();
+					return 2;
+				}
+				_message.resize(m + k);
+			} while (block && _frameLeft > 0);
+			if (_frameLeft > 0)
+				return -1;
+		}
+		_frameLeft = -1;
+		if (!_frameFin)
+			continue;
+		_inMessage = false;
+		msg._data = _message;
+		_message = ByteArray();
+#ifdef ASL_ZLIB
+		if (_messageDeflated)
 		{
-			if (buffer.length() >= 2) {
-				_code = (buffer[0] << 8) | buffer[1];
-				buffer.remove(0, 2);
-				msg = buffer;
+			ByteArray data;
+			if (int error = _deflate->decompress(msg._data, data, _maxMessage))
+			{
+				msg._data.clear();
+				fail(error);
+				return 2;
 			}
-			haveMsg = true;
-			_closed = true;
-			_socket.close();
-			break;
+			msg._data = data;
 		}
-		case 9: // ping
-			send(buffer.data(), buffer.length(), FRAME_PONG);
-			break;
-		case 10: // pong
-			buffer.clear();
+#endif
+		return 1;
+	}
+}
+
+WebSocketMsg WebSocket::receive()
+{
+	WebSocketMsg msg;
+	while (1)
+	{
+		int r = receiveStep(msg, true);
+		if (r > 0 || !_inMessage) // a message, a close or a control frame
 			break;
+	}
+	return msg.fix();
+}
+
+int WebSocket::receive(void* buffer, int n)
+{
+	byte* dst = (byte*)buffer;
+	while (1)
+	{
+		if (_messageEnded)
+		{
+			_messageEnded = false;
+			return 0;
+		}
+		if (_frameLeft < 0)
+		{
+			WebSocketMsg msg;
+			int r = parseHeader(msg, false);
+			if (r < 0)
+			{
+				if (readInput(true))
+					continue;
+				close();
+				return -1;
+			}
+			if (r == 2)
+				return -1;
+			if (r == 0)
+				continue;
+		}
+		int k;
+#ifdef ASL_ZLIB
+		if (_messageDeflated)
+		{
+			while ((k = _deflate->inflatePart(dst, n)) == 0) // feed compressed payload until some output comes
+			{
+				if (_frameLeft > 0)
+				{
+					_deflate->input.resize((int)min(_frameLeft, (Long)16384));
+					int m = readPayload(_deflate->input.data(), _deflate->input.length(), waitSome());
+					if (m < 0)
+						break;
+					_deflate->feed(_deflate->input.data(), m);
+				}
+				else if (_frameFin && !_deflate->tailFed)
+					_deflate->feedTail();
+				else
+					break;
+			}
+			if (k < 0)
+			{
+				fail(1007);
+				return -1;
+			}
+			if (k == 0 && _frameLeft > 0)
+				k = -1;
+		}
+		else
+#endif
+		k = _frameLeft > 0 ? readPayload(dst, n, waitSome()) : 0;
+		if (k < 0)
+		{
+			close();
+			return -1;
+		}
+		if (_frameLeft == 0 && (k == 0 || !_messageDeflated)) // the frame has been consumed
+		{
+			_frameLeft = -1;
+			if (_frameFin)
+			{
+				_inMessage = false;
+				_messageEnded = true;
+			}
 		}
+		if (k > 0)
+			return k;
+	}
+}
+
+// Returns how many bytes can be read from the socket for the current frame: 0 if some are already buffered, or else
+// what is available, waiting for it, or -1 if the connection was closed
 
-		if (fin)
-			haveMsg = true;
+int WebSocket::waitSome()
+{
+	if (_inputEnd > _inputPos)
+		return 0;
+	while (!_closed)
+	{
+		int n = _socket.available();
+		if (n > 0)
+			return n;
+		if (n < 0 || (_socket.waitInput(1) && _socket.available() <= 0))
+			break;
 	}
+	return -1;
+}
 
-	return msg.fix();
+bool WebSocket::poll()
+{
+	return pollInput(!_closed && _socket.waitInput(0));
+}
+
+// Processes the input available and dispatches the messages completed; `readable` tells that the socket has input,
+// so if none is available the peer has disconnected
+
+bool WebSocket::pollInput(bool readable)
+{
+	if (readable && !_closed && _socket.available() <= 0)
+	{
+		_code = 1006; // closed without a close frame
+		close();
+	}
+	WebSocketMsg msg;
+	int r;
+	while (!_closed && (r = receiveStep(msg, false)) >= 0)
+	{
+		if (r == 1)
+		{
+			dispatch(msg.fix());
+			msg = WebSocketMsg();
+		}
+	}
+	if (_closed)
+	{
+		notifyClose();
+		return false;
+	}
+	return true;
+}
+
+void WebSocket::dispatch(const WebSocketMsg& msg)
+{
+	if (_onMessage)
+		_onMessage(msg);
+	else if (_server)
+		_server->onMessage(*this, msg);
+}
+
+void WebSocket::notifyClose()
+{
+	if (_closeNotified)
+		return;
+	_closeNotified = true;
+	if (_onClose)
+		_onClose(_code);
+	else if (_server)
+		_server->onClose(*this);
 }
 
 void WebSocket::send(const Var& v)
@@ -349,41 +1216,130 @@ void WebSocket::send(const Var& v)
 	send(Json::encode(v));
 }
 
-void WebSocket::send(const byte* p, int length, FrameType type)
+void WebSocket::send(const byte* p, int length, FrameType type, bool compress)
 {
 	if (length <= 0 || _closed)
 		return;
-	byte opcode = (type == FRAME_TEXT) ? 1 : (type == FRAME_BINARY) ? 2 : (type == FRAME_PONG) ? 10 : (type == FRAME_PING) ? 9 : 8;
-	byte b0 = 0x80 | opcode;
-	byte masked = _isClient ? 0x80 : 0;
-	StreamBuffer buf(ENDIAN_BIG);
-	buf << b0;
-	Long len = length;
-	if (len < 126)
-		buf << byte(masked | (byte)len);
-	else if (len < (1 << 16))
-		buf << byte(masked | (byte)126) << (unsigned short)len;
-	else
-		buf << byte(masked | (byte)127) << len;
-
-	unsigned mask = 0;
-	if (_isClient) {
-		mask = _random.get();
-		buf << mask;
-	}
-	ByteArray data(p, length);
-	if (mask != 0){
-		swapBytes(mask);
-		data.resize(data.length() + 4);
-		data.resize(data.length() - 4);
-		int n = data.length() / 4 + 1;
-		for (int i = 0; i < n; i++)
+	byte opcode = frameOpcode(type);
+#ifdef ASL_ZLIB
+	if (compress && _deflate && opcode < 8 && length >= _deflate->minSize)
+	{
+		Lock _(_deflateMutex);
+		ByteArray payload = _deflate->compress(p, length);
+		sendFrame(payload.data(), payload.length(), opcode | 0x40);
+		return;
+	}
+#endif
+	sendFrame(p, length, opcode);
+}
+
+void WebSocket::sendFrame(const byte* p, int length, byte opcode)
+{
+	if (_isClient) // the payload must be masked, so it is copied once, masking it, into the frame buffer
+	{
+		ByteArray frame = makeFrame(p, length, opcode, true, _random.get());
+		output(frame.data(), frame.length(), NULL, 0);
+	}
+	else // header and payload go in one gathered write
+	{
+		byte head[14];
+		output(head, frameHeader(head, length, opcode, false, 0), p, length);
+	}
+}
+
+// Frames go after any broadcast frames still queued for this client, so that they are never interleaved
+
+void WebSocket::output(const byte* head, int headLength, const byte* payload, int length)
+{
+	Lock _(_writeMutex);
+	{
+		Lock q(_queueMutex);
+		if (_queue.length() > 0)
 		{
-			((unsigned*)data.data())[i] ^= mask;
+			OutFrame out;
+			out.data = ByteArray(head, headLength);
+			out.data.append(payload, length);
+			out.droppable = false;
+			_queue << out;
+			_queueBytes += out.data.length();
+			return;
+		}
+	}
+	if (!_closed && _socket.error() == 0)
+	{
+		SocketBuf bufs[2] = { SocketBuf(head, headLength), SocketBuf(payload, length) };
+		_socket.write(bufs, length > 0 ? 2 : 1);
+	}
+}
+
+bool WebSocket::enqueue(const ByteArray& frame, int maxBytes, bool coalesce)
+{
+	Lock _(_queueMutex);
+	if (_closed)
+		return false;
+	if (_queueBytes + frame.length() > maxBytes && _queue.length() > 0)
+	{
+		if (!coalesce)
+		{
+			_dropped++;
+			return false;
+		}
+		for (int i = _queue.length() - 1; i >= 1; i--) // the first may be partly sent, for TLS even if none is counted
+		{
+			if (!_queue[i].droppable)
+				continue;
+			_queueBytes -= _queue[i].data.length();
+			_queue.remove(i);
+			_dropped++;
+		}
+	}
+	OutFrame out = { frame, true };
+	_queue << out;
+	_queueBytes += frame.length();
+	return true;
+}
+
+// Sends queued frames until the socket would block, returns the bytes left or -1 on error
+
+int WebSocket::flushQueue()
+{
+	if (!_writeMutex.trylock()) // the owner thread is writing
+		return 1;
+	int left = 0;
+	while (1)
+	{
+		ByteArray frame;
+		{
+			Lock _(_queueMutex);
+			if (_queue.length() == 0)
+				break;
+			frame = _queue[0].data;
+		}
+		int n = _closed ? -1 : _socket.writeSome(frame.data() + _queueOffset, frame.length() - _queueOffset);
+		Lock _(_queueMutex);
+		if (n < 0)
+		{
+			_queue.clear();
+			_queueBytes = 0;
+			_queueOffset = 0;
+			left = -1;
+			break;
+		}
+		_queueOffset += n;
+		if (_queueOffset == frame.length())
+		{
+			_queueBytes -= frame.length();
+			_queueOffset = 0;
+			_queue.remove(0);
+		}
+		else
+		{
+			left = _queueBytes - _queueOffset;
+			break;
 		}
 	}
-	if (!_closed && !_socket.disconnected())
-		_socket << *buf << data;
+	_writeMutex.unlock();
+	return left;
 }
 
 bool WebSocket::wait(double timeout)
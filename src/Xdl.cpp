@@ -1,17 +1,17 @@
 #include <asl/Xdl.h>
 #include <asl/TextFile.h>
+#include <asl/Socket.h>
 #include <stdio.h>
 #include <ctype.h>
-#include <locale.h>
 
-#if defined(_MSC_VER) && _MSC_VER < 1800
 #include <float.h>
-#endif
 
-#ifdef ASL_FAST_JSON
-#define ASL_ATOF myatof
-#else
-#define ASL_ATOF atof
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ASL_JSON_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #endif
 
 #ifdef _MSC_VER
@@ -20,25 +20,26 @@
 
 namespace asl {
 
-struct XdlSink
-{
-	virtual ~XdlSink() {}
-	virtual void write(String&) {}
-};
+// The default sink, leaves all the text in the encoder's output string
 
 struct XdlSinkString : XdlSink
 {
-	String& str;
-	XdlSinkString(String& s) : str(s) {}
-	void write(String&) {}
+	XdlSinkString() : XdlSink(0x7fffffff) {}
 };
 
-struct XdlSinkFile : XdlSink
+bool XdlSinkFile::write(String& s)
 {
-	TextFile& file;
-	XdlSinkFile(TextFile& f) : file(f) {}
-	void write(String& s) { file << s; s = ""; }
-};
+	bool ok = file.write(*s, s.length()) == s.length();
+	s.clear();
+	return ok;
+}
+
+bool XdlSinkSocket::write(String& s)
+{
+	bool ok = socket.write(*s, s.length()) == s.length();
+	s.clear();
+	return ok;
+}
 
 enum StateN {
 	NUMBER, INT, STRING, PROPERTY, IDENTIFIER,
@@ -50,6 +51,364 @@ enum ContextN {ROOT, ARRAY, OBJECT, COMMENT1, COMMENT, LINECOMMENT, ENDCOMMENT};
 
 #define INDENT_CHAR '\t'
 
+#ifdef ASL_JSON_SSE2
+
+static inline int firstBit(int mask)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, mask);
+	return (int)i;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+#endif
+
+/*
+A scanner of strict JSON that reports what it finds to a handler (a JsonHandler, or VarBuilder to decode into a Var),
+skipping whitespace and scanning string contents 16 bytes at a time with SSE2 when available. Strings are given as
+views into the input, or into a scratch buffer if they had escapes. Integers of up to 9 characters are given as
+int and other numbers as double, like XdlParser does. It fails on anything beyond strict JSON (comments, XDL
+syntax, trailing commas, deep nesting) or when the handler returns false. The input must be followed by a '\0'.
+*/
+
+template<class Handler>
+class JsonScanner
+{
+	Handler& _handler;
+	const char* _p;
+	const char* _end;
+	String _str;
+	int _depth;
+public:
+	JsonScanner(Handler& handler, const char* s, int n) : _handler(handler), _p(s), _end(s + n), _depth(0) {}
+
+	bool scan()
+	{
+		skipSpace();
+		if (!value())
+			return false;
+		skipSpace();
+		return _p == _end;
+	}
+
+private:
+	void skipSpace()
+	{
+#ifdef ASL_JSON_SSE2
+		while (_end - _p >= 16 && myisspace(*_p)) // long runs are indentation
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)_p);
+			__m128i sp = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+			__m128i nl = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+			int mask = ~_mm_movemask_epi8(_mm_or_si128(sp, nl)) & 0xffff;
+			if (mask)
+			{
+				_p += firstBit(mask);
+				return;
+			}
+			_p += 16;
+		}
+#endif
+		while (myisspace(*_p))
+			_p++;
+	}
+
+	// Returns the first quote, backslash or control char from p
+
+	const char* scanString(const char* p)
+	{
+#ifdef ASL_JSON_SSE2
+		const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\'), ctrl = _mm_set1_epi8(0x1f);
+		while (_end - p >= 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)p);
+			__m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash));
+			special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+			int mask = _mm_movemask_epi8(special);
+			if (mask)
+				return p + firstBit(mask);
+			p += 16;
+		}
+#endif
+		while (*p != '"' && *p != '\\' && (unsigned char)*p >= ' ')
+			p++;
+		return p;
+	}
+
+	static int hex4(const char* p)
+	{
+		int x = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			char c = p[i];
+			int d = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+			if (d < 0)
+				return -1;
+			x = x * 16 + d;
+		}
+		return x;
+	}
+
+	// Reads a string after its opening quote
+
+	bool string(JsonStr& str)
+	{
+		const char* p = scanString(_p);
+		if (*p == '"') // no escapes: a view into the input
+		{
+			str.data = _p;
+			str.length = int(p - _p);
+			_p = p + 1;
+			return true;
+		}
+		String& s = _str;
+		s.clear();
+		while (1)
+		{
+			s.append(_p, int(p - _p));
+			_p = p + 1;
+			if (*p == '"')
+				break;
+			if (*p != '\\')
+				return false;
+			char c = *_p++;
+			switch (c)
+			{
+			case '"': case '\\': case '/': s << c; break;
+			case 'n': s << '\n'; break;
+			case 'r': s << '\r'; break;
+			case 't': s << '\t'; break;
+			case 'f': s << '\f'; break;
+			case 'b': s << '\b'; break;
+			case 'u': {
+				int u = hex4(_p);
+				if (u < 0)
+					return false;
+				_p += 4;
+				wchar_t u16[3] = { (wchar_t)u, 0, 0 };
+				int n = 1;
+				if (u >= 0xd800 && u < 0xdc00) // first surrogate, must be followed by the second
+				{
+					int u2 = (_p[0] == '\\' && _p[1] == 'u') ? hex4(_p + 2) : -1;
+					if (u2 < 0)
+						return false;
+					_p += 6;
+					u16[1] = (wchar_t)u2;
+					n = 2;
+				}
+				char ch[9];
+				s.append(ch, utf16toUtf8(u16, ch, n));
+				break;
+			}
+			default:
+				return false;
+			}
+			p = scanString(_p);
+		}
+		str.data = *s;
+		str.length = s.length();
+		return true;
+	}
+
+	bool number()
+	{
+		const char* p = _p;
+		bool neg = *p == '-';
+		if (neg)
+			p++;
+		if (*p < '0' || *p > '9' || (*p == '0' && p[1] >= '0' && p[1] <= '9'))
+			return false;
+		unsigned m = 0;
+		bool isInt = true;
+		for (; *p >= '0' && *p <= '9'; p++)
+			m = m * 10 + (*p - '0'); // only used if it has up to 9 digits
+		if (*p == '.')
+		{
+			isInt = false;
+			if (*++p < '0' || *p > '9')
+				return false;
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+		if (*p == 'e' || *p == 'E')
+		{
+			isInt = false;
+			if (*++p == '-' || *p == '+')
+				p++;
+			if (*p < '0' || *p > '9')
+				return false;
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+		const char* p0 = _p;
+		int len = int(p - p0);
+		_p = p;
+		if (isInt && len <= 9)
+			return _handler.new_number(neg ? -(int)m : (int)m);
+		return _handler.new_number(myatof(p0)); // stops at the end of the number
+	}
+
+	bool literal(const char* word, int n)
+	{
+		if (strncmp(_p, word, n) != 0 || myisalnum(_p[n]) || _p[n] == '_' || _p[n] == '.')
+			return false;
+		_p += n;
+		return true;
+	}
+
+	bool value()
+	{
+		switch (*_p)
+		{
+		case '"': {
+			_p++;
+			JsonStr s;
+			return string(s) && _handler.new_string(s);
+		}
+		case '{':
+			return object();
+		case '[':
+			return array();
+		case 't':
+			return literal("true", 4) && _handler.new_bool(true);
+		case 'f':
+			return literal("false", 5) && _handler.new_bool(false);
+		case 'n':
+			return literal("null", 4) && _handler.new_null();
+		default:
+			return number();
+		}
+	}
+
+	bool array()
+	{
+		if (++_depth > 500 || !_handler.begin_array())
+			return false;
+		_p++;
+		skipSpace();
+		if (*_p != ']')
+		{
+			while (1)
+			{
+				if (!value())
+					return false;
+				skipSpace();
+				if (*_p == ']')
+					break;
+				if (*_p != ',')
+					return false;
+				_p++;
+				skipSpace();
+			}
+		}
+		_p++;
+		_depth--;
+		return _handler.end_array();
+	}
+
+	bool object()
+	{
+		if (++_depth > 500 || !_handler.begin_object())
+			return false;
+		_p++;
+		skipSpace();
+		if (*_p != '}')
+		{
+			while (1)
+			{
+				JsonStr name;
+				if (*_p++ != '"' || !string(name) || !_handler.new_property(name))
+					return false;
+				skipSpace();
+				if (*_p++ != ':')
+					return false;
+				skipSpace();
+				if (!value())
+					return false;
+				skipSpace();
+				if (*_p == '}')
+					break;
+				if (*_p != ',')
+					return false;
+				_p++;
+				skipSpace();
+			}
+		}
+		_p++;
+		_depth--;
+		return _handler.end_object();
+	}
+};
+
+// Builds a Var from the events of a JsonScanner, placing each value directly in its container
+
+class VarBuilder
+{
+	Var& _root;
+	Array<Var*> _stack;
+	String _key;
+	String _str;
+
+	Var& slot()
+	{
+		if (_stack.length() == 0)
+			return _root;
+		Var& top = *_stack.last();
+		if (top.is(Var::ARRAY))
+		{
+			top << Var();
+			return top[top.length() - 1];
+		}
+		return top[_key];
+	}
+public:
+	VarBuilder(Var& root) : _root(root) {}
+	bool begin_object()
+	{
+		Var& v = slot();
+		v = Var(Var::OBJ);
+		_stack << &v;
+		return true;
+	}
+	bool end_object()
+	{
+		_stack.removeLast();
+		return true;
+	}
+	bool begin_array()
+	{
+		Var& v = slot();
+		v = Var(Var::ARRAY);
+		_stack << &v;
+		return true;
+	}
+	bool end_array()
+	{
+		_stack.removeLast();
+		return true;
+	}
+	bool new_property(const JsonStr& name)
+	{
+		_key.clear();
+		_key.append(name.data, name.length);
+		return true;
+	}
+	bool new_string(const JsonStr& s)
+	{
+		_str.clear();
+		_str.append(s.data, s.length);
+		slot() = Var(_str);
+		return true;
+	}
+	bool new_number(int x) { slot() = Var(x); return true; }
+	bool new_number(double x) { slot() = Var(x); return true; }
+	bool new_bool(bool x) { slot() = Var(x); return true; }
+	bool new_null() { slot() = Var(Var::NUL); return true; }
+};
+
 Var Xdl::decode(const String& xdl)
 {
 	XdlParser parser;
@@ -58,10 +417,21 @@ Var Xdl::decode(const String& xdl)
 
 Var Json::decode(const String& json)
 {
+	Var v;
+	VarBuilder builder(v);
+	JsonScanner<VarBuilder> scanner(builder, *json, json.length());
+	if (scanner.scan())
+		return v;
 	XdlParser parser;
 	return parser.decode(json);
 }
 
+bool Json::parse(const String& json, JsonHandler& handler)
+{
+	JsonScanner<JsonHandler> scanner(handler, *json, json.length());
+	return scanner.scan();
+}
+
 String Xdl::encode(const Var& data, int mode)
 {
 	XdlEncoder encoder;
@@ -76,34 +446,57 @@ String Json::encode(const Var& data, Json::Mode mode)
 Var Xdl::read(const String& file)
 {
 	XdlParser parser;
-	TextFile tfile(file, File::READ);
+	File tfile(file, File::READ);
 	if (!tfile)
 		return Var();
-	char buffer[1000];
+	return parser.read(tfile);
+}
+
+Var XdlParser::read(File& file, int blockSize)
+{
+	Array<char> buffer(blockSize);
 	byte bom[3];
-	if(tfile.read(bom, 3) == 3 && !(bom[0] == 0xef && bom[1] == 0xbb && bom[2] == 0xbf))
-		tfile.seek(0);
-	while (1)
+	if (file.read(bom, 3) == 3 && bom[0] == 0xef && bom[1] == 0xbb && bom[2] == 0xbf)
+		file.seek(3);
+	else
+		file.seek(0);
+	int n;
+	while ((n = file.read(buffer.data(), blockSize)) > 0 && !failed())
+		parse(buffer.data(), n);
+	return end();
+}
+
+Var XdlParser::read(Socket& socket)
+{
+	while (!_complete && !failed())
 	{
-		int n = tfile.read(buffer, sizeof(buffer) - 1);
-		buffer[n] = '\0';
-		parser.parse(buffer);
-		if (n < sizeof(buffer) - 1)
+		int n;
+		const char* data = (const char*)socket.peek(n);
+		if (n <= 0)
 			break;
+		socket.consume(parse(data, data + n, true));
 	}
-	parser.parse(" ");
-	return parser.value();
+	return end();
 }
 
 bool Xdl::write(const Var& v, const String& file, int mode)
 {
-	XdlEncoder encoder;
 	TextFile f(file, File::WRITE);
 	if (!f)
 		return false;
-	encoder.use(new XdlSinkFile(f));
-	encoder.encode(v, Json::Mode(mode));
-	return true;
+	XdlSinkFile sink(f);
+	return write(v, sink, mode);
+}
+
+bool Xdl::write(const Var& v, XdlSink& sink, int mode)
+{
+	XdlEncoder encoder;
+	return encoder.encode(v, Json::Mode(mode), sink);
+}
+
+bool Json::write(const Var& v, XdlSink& sink, Json::Mode mode)
+{
+	return Xdl::write(v, sink, mode | Json::JSON);
 }
 
 Var Json::read(const String& file)
@@ -119,7 +512,13 @@ bool Json::write(const Var& v, const String& file, Json::Mode mode)
 
 inline void XdlParser::value_end()
 {
-	_state = State((_context.top() == ROOT) ? WAIT_VALUE : WAIT_SEP);
+	if (_context.top() == ROOT)
+	{
+		_state = WAIT_VALUE;
+		_complete = true;
+	}
+	else
+		_state = WAIT_SEP;
 	_buffer="";
 }
 
@@ -129,14 +528,35 @@ void XdlParser::reset()
 	_context << ROOT;
 	_state = WAIT_VALUE;
 	_buffer = "";
+	_lists.clear();
+	_lists << Var(Var::ARRAY);
+	_props.clear();
+	_inComment = false;
+	_complete = false;
+	_unicodeCount = 0;
+}
+
+bool XdlParser::failed() const
+{
+	return _state == ERR;
 }
 
-void XdlParser::parse(const char* s)
+Var XdlParser::end()
 {
+	parse(" ", 1);
+	return value();
+}
+
+// Parses from s up to end, or only up to the end of the first top-level value if `single`; returns the bytes used
+
+int XdlParser::parse(const char* s, const char* end, bool single)
+{
+	const char* s0 = s;
 	if(_state == ERR)
-		return;
-	while(char c=*s++)
+		return 0;
+	while (s < end && !(single && _complete))
 	{
+		char c = *s++;
 		Context ctx = _context.top();
 		if(!_inComment)
 		{
@@ -206,7 +626,7 @@ void XdlParser::parse(const char* s)
 			else
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case INT:
@@ -234,10 +654,10 @@ void XdlParser::parse(const char* s)
 				else if (_buffer[0] == '0' && _buffer[1] != '\0')
 					_state = ERR;
 				if (_state == ERR)
-					return;
+					return int(s - s0);
 
 				if (_buffer.length() > 9) // check better if it fits in an int32
-					new_number(ASL_ATOF(_buffer));
+					new_number(myatof(_buffer));
 				else
 					new_number(myatoiz(_buffer));
 				value_end();
@@ -246,7 +666,7 @@ void XdlParser::parse(const char* s)
 			else
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case NUMBER_DOT:
@@ -258,7 +678,7 @@ void XdlParser::parse(const char* s)
 			else
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case NUMBER_E:
@@ -275,7 +695,7 @@ void XdlParser::parse(const char* s)
 			else
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case NUMBER_ES:
@@ -287,7 +707,7 @@ void XdlParser::parse(const char* s)
 			else
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case NUMBER_EV:
@@ -297,22 +717,14 @@ void XdlParser::parse(const char* s)
 			}
 			else if (c == ',' || myisspace(c) || c == ']' || c == '}')
 			{
-#ifndef ASL_FAST_JSON
-				for (char* p = _buffer.data(); *p; p++)
-					if (*p == '.')
-					{
-						*p = _ldp;
-						break;
-					}
-#endif
-				new_number(ASL_ATOF(_buffer));
+				new_number(myatof(_buffer));
 				value_end();
 				s--;
 			}
 			else
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case NUMBER:
@@ -327,22 +739,14 @@ void XdlParser::parse(const char* s)
 			}
 			else if(c == ',' || myisspace(c) || c == ']' || c == '}')
 			{
-#ifndef ASL_FAST_JSON
-				for(char* p = _buffer.data(); *p; p++)
-					if (*p == '.')
-					{
-						*p = _ldp;
-						break;
-					}
-#endif
-				new_number(ASL_ATOF(_buffer));
+				new_number(myatof(_buffer));
 				value_end();
 				s--;
 			}
 			else
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 
 			break;
@@ -361,7 +765,7 @@ void XdlParser::parse(const char* s)
 			else if (unsigned(c) < ' ') // disallow control chars in string
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			else
 				_buffer << c;
@@ -453,7 +857,7 @@ void XdlParser::parse(const char* s)
 			else if(!myisspace(c) /*&& c != ','*/)
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case WAIT_SEP:
@@ -476,7 +880,7 @@ void XdlParser::parse(const char* s)
 			else if (!myisspace(c))
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case WAIT_OBJ:
@@ -490,7 +894,7 @@ void XdlParser::parse(const char* s)
 			else if (!myisspace(c))
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case WAIT_COMMA_OR_PROPERTY:
@@ -518,7 +922,7 @@ void XdlParser::parse(const char* s)
 			else if(!myisspace(c) /*&& c != ','*/ && c != '}')
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case ESCAPE:
@@ -577,7 +981,7 @@ void XdlParser::parse(const char* s)
 			else if(!myisspace(c))
 			{
 				_state = ERR;
-				return;
+				return int(s - s0);
 			}
 			break;
 		case UNICODECHAR:
@@ -618,15 +1022,15 @@ void XdlParser::parse(const char* s)
 		}
 //		printf("%c %i\n", c, state);
 	}
+	return int(s - s0);
 }
 
 XdlParser::XdlParser()
 {
-	lconv* loc = localeconv();
-	_ldp = *loc->decimal_point;
 	_context << ROOT;
 	_state = WAIT_VALUE;
 	_inComment = false;
+	_complete = false;
 	_lists << Var(Var::ARRAY);
 	_prevState = _state;
 	_unicode[0] = '\0';
@@ -711,7 +1115,10 @@ XdlEncoder::XdlEncoder()
 	_simple = false;
 	_fmtF = "%.9g";
 	_fmtD = "%.17g";
-	_sink = new XdlSinkString(_out);
+	_digitsF = 9;
+	_digitsD = 17;
+	_sink = new XdlSinkString();
+	_sinkOk = true;
 }
 
 XdlEncoder::~XdlEncoder()
@@ -732,20 +1139,43 @@ String XdlEncoder::encode(const Var& v, Json::Mode mode)
 	_simple = (mode & Json::SIMPLE) != 0;
 	_fmtF = _simple ? "%.7g" : "%.9g";
 	_fmtD = _simple ? "%.15g" : "%.17g";
+	_digitsF = _simple ? 0 : 9;
+	_digitsD = _simple ? 15 : 17;
 	if (mode & Json::SHORTF)
+	{
 		_fmtD = _fmtF;
+		_digitsD = 0;
+	}
 	if (_pretty)
 		_sep1 = ", ";
 	if (!_json && _pretty)
 		_sep2 = "";
 	reset();
+	_sinkOk = true;
 	_encode(v);
 	if (_pretty)
 		_out += '\n';
-	_sink->write(_out);
+	flush();
 	return data();
 }
 
+bool XdlEncoder::encode(const Var& v, Json::Mode mode, XdlSink& sink)
+{
+	XdlSink* own = _sink;
+	_sink = &sink;
+	encode(v, mode);
+	_sink = own;
+	return _sinkOk;
+}
+
+void XdlEncoder::flush()
+{
+	if (_sinkOk && !_sink->write(_out))
+		_sinkOk = false;
+	if (!_sinkOk)
+		_out.clear();
+}
+
 void XdlEncoder::_encode(const Var& v)
 {
 	switch(v._type)
@@ -789,7 +1219,7 @@ void XdlEncoder::_encode(const Var& v)
 			_indent = String::repeat(INDENT_CHAR, ++_level);
 			_out << '\n' << _indent;
 		}
-		for(int i=0; i<v.length(); i++)
+		for(int i=0; i<v.length() && _sinkOk; i++)
 		{
 			if(i>0) {
 				if (multi && (big || (i % 16) == 0))
@@ -821,6 +1251,8 @@ void XdlEncoder::_encode(const Var& v)
 
 		foreach2(String& name, Var& value, v)
 		{
+			if (!_sinkOk)
+				break;
 			if(value.ok() && (_json || &value != cname))
 			{
 				if (k++ > 0)
@@ -847,8 +1279,8 @@ void XdlEncoder::_encode(const Var& v)
 		break;
 	}
 
-	if (_out.length() > 16000)
-		_sink->write(_out);
+	if (_out.length() > _sink->flushSize)
+		flush();
 }
 
 void XdlEncoder::put_separator()
@@ -884,6 +1316,12 @@ void XdlEncoder::new_number(double x)
 		return;
 	}
 	_out.resize(n + 26);
+	int len = _digitsD ? mydtoa(x, &_out[n], _digitsD) : 0; // shortest form that reads back the same
+	if (len)
+	{
+		_out.fix(n + len);
+		return;
+	}
 	_out.fix(n + snprintf(&_out[n], 27, _fmtD, x));
 
 	// Fix decimal comma of some locales
@@ -916,6 +1354,12 @@ void XdlEncoder::new_number(float x)
 		return;
 	}
 	_out.resize(n + 16);
+	int len = _digitsF ? myftoa(x, &_out[n], _digitsF) : 0;
+	if (len)
+	{
+		_out.fix(n + len);
+		return;
+	}
 	_out.fix(n + snprintf(&_out[n], 17, _fmtF, x));
 
 	// Fix decimal comma of some locales
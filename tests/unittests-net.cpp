@@ -1,5 +1,12 @@
 #include <asl/Http.h>
 #include <asl/HttpServer.h>
+#include <asl/WebSocket.h>
+#include <asl/TextFile.h>
+#include <asl/JSON.h>
+#include <asl/Xdl.h>
+#ifdef ASL_TLS
+#include <asl/TlsSocket.h>
+#endif
 #include <asl/testing.h>
 #include <stdio.h>
 
@@ -40,6 +47,271 @@ public:
 	}
 };
 
+#ifdef ASL_TLS
+ASL_TEST(TlsSessions)
+{
+	AslServer server;
+	server.bindTLS("127.0.0.1", 9018);
+	server.start(true);
+	sleep(0.2);
+
+	TlsSocket::clearSessions();
+	TlsSessionStats stats0 = TlsSocket::sessionStats();
+	for (int i = 0; i < 3; i++)
+	{
+		TlsSocket client;
+		ASL_ASSERT(client.connect("127.0.0.1", 9018));
+		client << "GET /?name=A HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+		ASL_ASSERT(client.readLine().startsWith("HTTP/1.1 200")); // also reads a TLS 1.3 session ticket
+		client.close();
+	}
+	sleep(0.2);
+	TlsSessionStats stats = TlsSocket::sessionStats();
+	ASL_CHECK(stats.connected - stats0.connected, ==, 3);
+	ASL_CHECK(stats.cached - stats0.cached, ==, 2); // the first handshake is full
+	ASL_CHECK(stats.accepted - stats0.accepted, ==, 3);
+	ASL_CHECK(stats.resumed - stats0.resumed, ==, 2);
+	server.stop(true);
+}
+
+ASL_TEST(TlsHandshake)
+{
+	AslServer server;
+	server.bindTLS("127.0.0.1", 9019);
+	server.bind("127.0.0.1", 9020);
+	server.setHandshakeTimeout(1);
+	server.start(true);
+	sleep(0.2);
+
+	// clients that connect and never complete their handshake
+
+	Socket stalled[3];
+	for (int i = 0; i < 3; i++)
+		ASL_ASSERT(stalled[i].connect("127.0.0.1", 9019));
+	byte partial[] = { 0x16, 0x03, 0x01, 0x02 }; // the beginning of a client hello
+	stalled[2].write(partial, sizeof(partial));
+	sleep(0.1);
+
+	double t0 = now();
+	ASL_CHECK(Http::get("http://127.0.0.1:9020/?name=A").text(), ==, "Hello A from AslServer!");
+	TlsSocket client;
+	ASL_ASSERT(client.connect("127.0.0.1", 9019));
+	client << "GET /?name=B HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+	ASL_ASSERT(client.readLine().startsWith("HTTP/1.1 200"));
+	client.close();
+	ASL_CHECK(now() - t0, <, 0.5);
+
+	for (int i = 0; i < 3; i++) // closed by the server after the handshake timeout
+	{
+		ASL_ASSERT(stalled[i].waitInput(3));
+		ASL_ASSERT(stalled[i].disconnected());
+	}
+	ASL_CHECK(now() - t0, <, 2.5);
+	server.stop(true);
+}
+
+ASL_TEST(TlsContext)
+{
+	TlsContext context; // with the default test certificate
+	ASL_ASSERT(!context.useCert("-----BEGIN CERTIFICATE-----\nxyz\n-----END CERTIFICATE-----\n", "xyz"));
+	AslServer server;
+	server.bindTLS("127.0.0.1", 9021);
+	server.useTlsContext(context);
+	server.start(true);
+	sleep(0.2);
+
+	TlsContext shared;
+	for (int i = 0; i < 4; i++)
+	{
+		if (i == 2) // a failed replacement keeps the current certificate
+			ASL_ASSERT(!server.useCert("xyz", "xyz"));
+		TlsSocket client;
+		client.useContext(shared);
+		ASL_ASSERT(client.connect("127.0.0.1", 9021));
+		client << "GET /?name=A HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+		ASL_ASSERT(client.readLine().startsWith("HTTP/1.1 200"));
+		client.close();
+	}
+	server.stop(true);
+}
+
+ASL_TEST(TlsKeepAlive)
+{
+	AslServer server;
+	server.setThreadPool(2);
+	server.setKeepAlive(5);
+	server.bindTLS("127.0.0.1", 9024);
+	server.start(true);
+	sleep(0.2);
+
+	// the server answers without waiting for more requests, and the client reuses the idle connection at once
+	Http::setConnectionPool(4, 10);
+	double t0 = now();
+	for (int i = 0; i < 3; i++)
+		ASL_CHECK(Http::get("https://127.0.0.1:9024/?name=" + String(i)).text(), ==, "Hello " + String(i) + " from AslServer!");
+	ASL_CHECK(now() - t0, <, 1.0);
+	ASL_CHECK(server.stats().dispatched, ==, 1);
+	Http::setConnectionPool(0);
+	server.stop(true);
+}
+#endif
+
+ASL_TEST(SocketBuffer)
+{
+	Socket server;
+	ASL_ASSERT(server.bind("127.0.0.1", 9004));
+	server.listen();
+	Socket client;
+	ASL_ASSERT(client.connect("127.0.0.1", 9004));
+	Socket conn = server.accept();
+
+	client << "first line\r\nsecond\nabcd";
+	client << 1234567;
+	ASL_ASSERT(conn.waitData());
+	ASL_CHECK(conn.readLine(), ==, "first line\r");
+	ASL_CHECK(conn.available(), >=, 11);
+	ASL_CHECK(conn.readLine(), ==, "second");
+	ASL_ASSERT(conn.waitInput(0));
+	ASL_CHECK(conn.readString(4), ==, "abcd");
+	ASL_CHECK(conn.read<int>(), ==, 1234567);
+	ASL_CHECK(conn.available(), ==, 0);
+
+	SocketBuf bufs[] = { SocketBuf("ab", 2), SocketBuf("", 0), SocketBuf("cde\n", 4) };
+	ASL_CHECK(client.write(bufs, 3), ==, 6);
+	ASL_CHECK(conn.readLine(), ==, "abcde");
+
+	client.close();
+	conn.close();
+	server.close();
+}
+
+ASL_TEST(JsonSocket)
+{
+	Socket server;
+	ASL_ASSERT(server.bind("127.0.0.1", 9023));
+	server.listen();
+	Socket client;
+	ASL_ASSERT(client.connect("127.0.0.1", 9023));
+	Socket conn = server.accept();
+
+	client << "{\"a\": [1, 2, \"x\\u00e9\"]}[3,";
+	client << "4] \"str\"17 ";
+	client << "line after\n";
+	XdlParser parser;
+	ASL_CHECK(parser.read(conn), ==, Var("a", Var(array<Var>(1, 2, "x\xc3\xa9"))));
+	parser.reset();
+	ASL_CHECK(parser.read(conn), ==, Var(array<Var>(3, 4)));
+	parser.reset();
+	ASL_CHECK(parser.read(conn), ==, "str");
+	parser.reset();
+	ASL_CHECK(parser.read(conn), ==, 17);
+	ASL_CHECK(conn.readLine(), ==, " line after");
+
+	Var big = Var::ARRAY;
+	for (int i = 0; i < 5000; i++)
+		big << Var("i", i)("s", "item" + String(i));
+	XdlSinkSocket sink(client);
+	ASL_ASSERT(Json::write(big, sink));
+	parser.reset();
+	ASL_ASSERT(parser.read(conn) == big);
+
+	client << "[1, 2";
+	client.close();
+	parser.reset();
+	ASL_ASSERT(!parser.read(conn).ok());
+	conn.close();
+	server.close();
+}
+
+ASL_TEST(PacketBatch)
+{
+	PacketSocket receiver;
+	ASL_ASSERT(receiver.bind("127.0.0.1", 9022));
+	PacketSocket sender;
+	InetAddress to("127.0.0.1", 9022);
+
+	PacketBatch out(8, 64);
+	for (int i = 0; i < 5; i++)
+		ASL_ASSERT(out.add(to, String::repeat('a' + i, i + 1)));
+	ASL_ASSERT(!out.add(to, ByteArray(65, 0)));
+	ASL_CHECK(sender.sendBatch(out), ==, 5);
+
+	PacketBatch in(8, 64);
+	int n = 0;
+	String received;
+	while (n < 5 && receiver.waitInput(2))
+	{
+		int k = receiver.readBatch(in);
+		ASL_ASSERT(k > 0);
+		for (int i = 0; i < k; i++)
+		{
+			received << String((const char*)in.data(i), in.size(i)) << ",";
+			ASL_CHECK(in.address(i).host(), ==, "127.0.0.1");
+		}
+		n += k;
+	}
+	ASL_CHECK(n, ==, 5);
+	ASL_CHECK(received, ==, "a,bb,ccc,dddd,eeeee,");
+
+	InetAddress from = in.address(0);
+	out.clear();
+	ASL_ASSERT(out.add(from, String("back")));
+	ASL_CHECK(receiver.sendBatch(out), ==, 1);
+	InetAddress addr;
+	ASL_CHECK(String(sender.readFrom(addr, 10)), ==, "back");
+}
+
+// reads a response with a Content-Length from a raw connection and returns its body
+static String readReply(Socket& client)
+{
+	if (!client.readLine().startsWith("HTTP/1.1 200"))
+		return "error";
+	int length = 0;
+	String line;
+	while (line = client.readLine(), line.length() > 1)
+		if (line.toLowerCase().startsWith("content-length:"))
+			length = line.substring(15).trim();
+	return client.readString(length);
+}
+
+// sends a POST with "Expect: 100-continue" and its body only after the interim response arrives, returns the reply
+
+static String postExpectingContinue(int port, const String& path, const String& body)
+{
+	Socket client;
+	if (!client.connect("127.0.0.1", port))
+		return "no connection";
+	client << "POST " + path + " HTTP/1.1\r\nHost: localhost\r\nExpect: 100-continue\r\nContent-Length: " +
+		String(body.length()) + "\r\n\r\n";
+	if (!client.waitData(2) || client.readLine() != "HTTP/1.1 100 Continue\r" || client.readLine() != "\r")
+		return "no 100 Continue";
+	client << body;
+	return readReply(client);
+}
+
+// sends several requests in one write and reads all responses
+
+static int pipelinedRequests(int port)
+{
+	Socket client;
+	if (!client.connect("127.0.0.1", port))
+		return 0;
+	String req;
+	for (int i = 0; i < 5; i++)
+		req << "GET /?name=P" << String(i) << " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	client << req;
+	int ok = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		if (!client.waitData(5) || !client.readLine().startsWith("HTTP/1.1 200"))
+			break;
+		while (client.readLine() != "\r") {}
+		if (client.readString(24) == "Hello P" + String(i) + " from AslServer!")
+			ok++;
+	}
+	return ok;
+}
+
 ASL_TEST(HTTP)
 {
 	AslServer server;
@@ -58,5 +330,800 @@ ASL_TEST(HTTP)
 	res = Http::get("http://127.0.0.1:9001/what");
 	ASL_CHECK(res.code(), ==, 404);
 
+	ASL_CHECK(pipelinedRequests(9001), ==, 5);
+	ASL_CHECK(postExpectingContinue(9001, "/post", "later"), ==, "Received: later");
+
 	server.stop();
 }
+
+class FileServer : public HttpServer
+{
+public:
+	void serve(HttpRequest& request, HttpResponse& response)
+	{
+		serveFile(request, response);
+	}
+};
+
+ASL_TEST(HttpFile)
+{
+	String content;
+	for (int i = 0; i < 20000; i++)
+		content << String::f("%04i\n", i);
+	TextFile("asl_file_test.txt").write(content);
+
+	TextFile("asl_file_test2.txt").write(content);
+	TextFile("asl_file_test2.txt.gz").write("not really gzip");
+
+	FileServer server;
+	server.setRoot(".");
+	server.setFileCache(1000000);
+	server.bind("127.0.0.1", 9005);
+	server.start(true);
+	sleep(0.2);
+
+	HttpResponse res = Http::get("http://127.0.0.1:9005/asl_file_test.txt");
+	ASL_CHECK(res.code(), ==, 200);
+	ASL_CHECK(res.text().length(), ==, content.length());
+	ASL_ASSERT(res.text() == content);
+
+	Dic<> headers;
+	headers["Range"] = "bytes=5000-5009";
+	res = Http::get("http://127.0.0.1:9005/asl_file_test.txt", headers);
+	ASL_CHECK(res.code(), ==, 206);
+	ASL_CHECK(res.header("Content-Range"), ==, "bytes 5000-5009/" + String(content.length()));
+	ASL_CHECK(res.text(), ==, "1000\n1001\n");
+
+	res = Http::get("http://127.0.0.1:9005/asl_file_test.txt");
+	ASL_ASSERT(res.hasHeader("ETag"));
+	headers.clear();
+	headers["If-None-Match"] = res.header("ETag");
+	res = Http::get("http://127.0.0.1:9005/asl_file_test.txt", headers);
+	ASL_CHECK(res.code(), ==, 304);
+
+	Socket client;
+	ASL_ASSERT(client.connect("127.0.0.1", 9005));
+	client << "GET /asl_file_test2.txt HTTP/1.1\r\nAccept-Encoding: gzip, deflate\r\nConnection: close\r\n\r\n";
+	ASL_ASSERT(client.readLine().startsWith("HTTP/1.1 200"));
+	Dic<> rheaders;
+	for (String line; line = client.readLine().trim(), line.ok();)
+		rheaders[line.split(": ")[0]] = line.split(": ")[1];
+	ASL_CHECK(rheaders["Content-Encoding"], ==, "gzip");
+	ASL_CHECK(client.readString(15), ==, "not really gzip");
+	client.close();
+
+	server.stop(true);
+	File("asl_file_test.txt").remove();
+	File("asl_file_test2.txt").remove();
+	File("asl_file_test2.txt.gz").remove();
+}
+
+ASL_TEST(HttpRoutes)
+{
+	AslServer server;
+	server.route("GET", "/api/users/:id", [](HttpRequest& request, HttpResponse& response) {
+		response.put("user " + request.param("id"));
+	});
+	server.route("GET", "/api/users/me", [](HttpRequest& request, HttpResponse& response) {
+		response.put("me");
+	});
+	server.route("*", "/api/users/:id/items/:item", [](HttpRequest& request, HttpResponse& response) {
+		response.put(request.method() + " " + request.param("id") + "/" + request.param("item"));
+	});
+	server.route("GET", "/static/*", [](HttpRequest& request, HttpResponse& response) {
+		response.put("file " + request.suffix());
+	});
+	server.route("GET", "/api/users/:uid/posts", [](HttpRequest& request, HttpResponse& response) {
+		response.put("posts of " + request.param("uid") + request.param("id"));
+	});
+	ASL_ASSERT(!server.route("GET", "/files/*/raw", [](HttpRequest& request, HttpResponse& response) {
+		response.put("raw " + request.suffix());
+	}));
+	server.bind("127.0.0.1", 9006);
+	server.start(true);
+	sleep(0.2);
+
+	ASL_CHECK(Http::get("http://127.0.0.1:9006/api/users/42").text(), ==, "user 42");
+	ASL_CHECK(Http::get("http://127.0.0.1:9006/api/users/5/posts").text(), ==, "posts of 5");
+	ASL_CHECK(Http::get("http://127.0.0.1:9006/api/users/me").text(), ==, "me");
+	ASL_CHECK(Http::post("http://127.0.0.1:9006/api/users/7/items/x", "").text(), ==, "POST 7/x");
+	ASL_CHECK(Http::get("http://127.0.0.1:9006/static/css/a.css?v=1").text(), ==, "file css/a.css");
+	ASL_CHECK(Http::get("http://127.0.0.1:9006/?name=R").text(), ==, "Hello R from AslServer!");
+	ASL_CHECK(Http::post("http://127.0.0.1:9006/api/users/42", "").code(), ==, 404);
+	ASL_CHECK(Http::get("http://127.0.0.1:9006/files/a/raw").code(), ==, 404);
+
+	server.stop();
+}
+
+ASL_TEST(HttpStreamBody)
+{
+	AslServer server;
+	server.setMaxUploadSize(100000);
+	server.route("POST", "/upload", [](HttpRequest& request, HttpResponse& response) {
+		byte buffer[1000];
+		int n, total = 0, sum = 0;
+		while ((n = request.readBody(buffer, sizeof(buffer))) > 0)
+		{
+			total += n;
+			for (int i = 0; i < n; i++)
+				sum += buffer[i];
+		}
+		response.put(String(total) + " " + String(sum));
+	}, true);
+	server.route("POST", "/json", [](HttpRequest& request, HttpResponse& response) {
+		Var data = request.json();
+		response.put(String(data["items"].length()) + " " + data["items"][999]["name"].toString());
+	}, true);
+	server.route("POST", "/form", [](HttpRequest& request, HttpResponse& response) {
+		Var data = request.json();
+		response.put(data.ok() ? Json::encode(data) : String("invalid"));
+	}, true);
+	server.route("GET", "/bigjson", [](HttpRequest& request, HttpResponse& response) {
+		Var items = Var::ARRAY;
+		for (int i = 0; i < 20000; i++)
+			items << Var("n", i);
+		response.writeJson(Var("items", items));
+	});
+	server.route("POST", "/ignore", [](HttpRequest& request, HttpResponse& response) {
+		response.put("ignored");
+	}, true);
+	server.bind("127.0.0.1", 9008);
+	server.start(true);
+	sleep(0.2);
+
+	ByteArray data(200000);
+	int sum = 0;
+	for (int i = 0; i < data.length(); i++)
+		sum += data[i] = byte(i * 7);
+
+	Socket client;
+	ASL_ASSERT(client.connect("127.0.0.1", 9008));
+	client << "POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Length: 200000\r\n\r\n";
+	client.write(data.data(), data.length());
+	ASL_CHECK(readReply(client), ==, "200000 " + String(sum));
+
+	client << "POST /upload HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n";
+	ASL_CHECK(readReply(client), ==, "11 1116");
+
+	Var items = Var::ARRAY;
+	for (int i = 0; i < 1000; i++)
+		items << Var("name", "item" + String(i))("value", i * 0.5);
+	String json = Json::encode(Var("items", items));
+	client << "POST /json HTTP/1.1\r\nHost: localhost\r\nContent-Length: " + String(json.length()) + "\r\n\r\n" + json;
+	ASL_CHECK(readReply(client), ==, "1000 item999");
+
+	client << "POST /form HTTP/1.1\r\nHost: localhost\r\nContent-Length: 11\r\n\r\na=1&b=x+%26";
+	ASL_CHECK(Json::decode(readReply(client)), ==, Var("a", "1")("b", "x &"));
+
+	String big = "[" + String::repeat('1', 150000) + "]"; // above the upload limit
+	client << "POST /form HTTP/1.1\r\nHost: localhost\r\nContent-Length: " + String(big.length()) + "\r\n\r\n" + big;
+	ASL_CHECK(readReply(client), ==, "invalid");
+	client.close();
+	ASL_ASSERT(client.connect("127.0.0.1", 9008)); // the rest of that body was not discarded
+
+	client << "POST /ignore HTTP/1.1\r\nHost: localhost\r\nContent-Length: 3000\r\n\r\n";
+	client.write(data.data(), 3000);
+	ASL_CHECK(readReply(client), ==, "ignored");
+
+	client << "GET /?name=S HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	ASL_CHECK(readReply(client), ==, "Hello S from AslServer!");
+	client.close();
+
+	ASL_CHECK(postExpectingContinue(9008, "/upload", "abc"), ==, "3 294");
+
+	// a body that the handler ignores is not solicited with a 100 Continue, and the connection is closed
+	ASL_ASSERT(client.connect("127.0.0.1", 9008));
+	client << "POST /ignore HTTP/1.1\r\nHost: localhost\r\nExpect: 100-continue\r\nContent-Length: 3000\r\n\r\n";
+	ASL_ASSERT(client.waitData(2));
+	ASL_CHECK(readReply(client), ==, "ignored");
+	ASL_ASSERT(client.waitInput(2) && client.disconnected());
+	client.close();
+
+	HttpResponse res = Http::get("http://127.0.0.1:9008/bigjson");
+	ASL_CHECK(res.header("Transfer-Encoding"), ==, "chunked");
+	ASL_CHECK(res.header("Content-Type"), ==, "application/json");
+	ASL_CHECK(res.json()["items"].length(), ==, 20000);
+	ASL_CHECK(res.json()["items"][19999]["n"], ==, 19999);
+
+	ASL_CHECK(Http::post("http://127.0.0.1:9008/post", "abc").text(), ==, "Received: abc");
+	ASL_CHECK(Http::post("http://127.0.0.1:9008/post", String::repeat('x', 200000)).code(), !=, 200);
+
+	server.stop(true);
+}
+
+ASL_TEST(HttpCompression)
+{
+	Var items = Var(Var::ARRAY);
+	for (int i = 0; i < 200; i++)
+		items << Var("id", i)("name", "item" + String(i));
+
+	AslServer server;
+	server.setCompression(6, 100);
+	server.route("GET", "/items", [&](HttpRequest& request, HttpResponse& response) {
+		response.put(items);
+	});
+	server.route("GET", "/stream", [](HttpRequest& request, HttpResponse& response) {
+		response.setHeader("Content-Type", "text/plain");
+		for (int i = 0; i < 1000; i++)
+			response.write(String::f("line %i\n", i));
+	});
+	server.route("GET", "/zeros", [](HttpRequest& request, HttpResponse& response) {
+		response.setHeader("Content-Type", "text/plain");
+		response.put(String::repeat('0', 100000));
+	});
+	server.bind("127.0.0.1", 9009);
+	server.start(true);
+	sleep(0.2);
+
+	HttpResponse res = Http::get("http://127.0.0.1:9009/items");
+	ASL_CHECK(res.json(), ==, items);
+	String text;
+	for (int i = 0; i < 1000; i++)
+		text << String::f("line %i\n", i);
+	HttpResponse res2 = Http::get("http://127.0.0.1:9009/stream");
+	ASL_ASSERT(res2.text() == text);
+#ifdef ASL_ZLIB
+	ASL_CHECK(res.header("Content-Encoding"), ==, "gzip");
+	ASL_CHECK(res2.header("Content-Encoding"), ==, "gzip");
+	ASL_CHECK(res2.header("Transfer-Encoding"), ==, "chunked");
+#endif
+	res = Http::get("http://127.0.0.1:9009/?name=A");
+	ASL_ASSERT(!res.hasHeader("Content-Encoding")); // too small
+
+	HttpRequest req("GET", "http://127.0.0.1:9009/zeros");
+	req.setMaxSize(50000); // the compressed body is small, but inflated it exceeds the limit
+	res = Http::request(req);
+#ifdef ASL_ZLIB
+	ASL_CHECK(res.header("Content-Encoding"), ==, "gzip");
+	ASL_CHECK(res.status(), !=, 0);
+	ASL_CHECK(res.body().length(), <=, 50000);
+#endif
+
+	Socket client;
+	ASL_ASSERT(client.connect("127.0.0.1", 9009));
+	client << "GET /items HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	ASL_CHECK(Json::decode(readReply(client)), ==, items);
+	client.close();
+
+	server.stop(true);
+}
+
+class EchoWsServer : public WebSocketServer
+{
+public:
+	void serve(WebSocket& ws)
+	{
+		while (!ws.closed())
+		{
+			if (!ws.waitData(0.2))
+				continue;
+			ByteArray msg = ws.receive();
+			if (msg.length() > 0)
+				ws.send(msg);
+		}
+	}
+};
+
+ASL_TEST(WebSocketFrames)
+{
+	EchoWsServer server;
+	server.bind("127.0.0.1", 9011);
+	server.start(true);
+	sleep(0.2);
+
+	WebSocket ws;
+	ASL_ASSERT(ws.connect("ws://127.0.0.1:9011"));
+	int sizes[] = { 1, 3, 17, 125, 126, 1000, 65535, 65536, 100003 };
+	for (int i = 0; i < (int)(sizeof(sizes) / sizeof(int)); i++)
+	{
+		ByteArray data(sizes[i]);
+		for (int j = 0; j < data.length(); j++)
+			data[j] = byte(j * 7 + i);
+		ws.send(data);
+		ASL_ASSERT(ws.waitData(2));
+		ByteArray echo = ws.receive();
+		ASL_CHECK(echo.length(), ==, data.length());
+		ASL_ASSERT(echo == data);
+	}
+	ws.close();
+	server.stop(true);
+}
+
+ASL_TEST(WebSocketCompression)
+{
+	EchoWsServer server;
+	server.setCompression(6);
+	server.bind("127.0.0.1", 9012);
+	server.start(true);
+	EchoWsServer server2;
+	server2.setCompression(6, 64, 12, false);
+	server2.bind("127.0.0.1", 9013);
+	server2.start(true);
+	sleep(0.2);
+
+	Var items = Var(Var::ARRAY);
+	for (int i = 0; i < 500; i++)
+		items << Var("id", i)("name", "item " + String(i))("tags", Var(Var::ARRAY) << "a" << "b");
+	ByteArray noise(20000);
+	Random random;
+	for (int i = 0; i < noise.length(); i++)
+		noise[i] = (byte)random(255);
+
+	WebSocket ws;
+	ws.setCompression(6);
+	ASL_ASSERT(ws.connect("ws://127.0.0.1:9012"));
+#ifdef ASL_ZLIB
+	ASL_ASSERT(ws.compressed());
+#endif
+	for (int i = 0; i < 3; i++) // later messages reuse the context of previous ones
+	{
+		ws.send(items);
+		ASL_ASSERT(ws.waitData(2));
+		Var msg = ws.receive();
+		ASL_CHECK(msg, ==, items);
+	}
+	ws.send("hi");
+	ASL_ASSERT(ws.waitData(2));
+	String hi = ws.receive();
+	ASL_CHECK(hi, ==, "hi");
+	ws.send(noise, false);
+	ASL_ASSERT(ws.waitData(2));
+	ByteArray echo = ws.receive();
+	ASL_ASSERT(echo == noise);
+	ws.close();
+
+	WebSocket ws2, plain;
+	ws2.setCompression(9, 0);
+	ASL_ASSERT(ws2.connect("ws://127.0.0.1:9013"));
+	ASL_ASSERT(plain.connect("ws://127.0.0.1:9013"));
+#ifdef ASL_ZLIB
+	ASL_ASSERT(ws2.compressed());
+#endif
+	ASL_ASSERT(!plain.compressed());
+	for (int i = 0; i < 50 && server2.clients().length() < 2; i++)
+		sleep(0.05);
+
+	ws2.send(items);
+	ASL_ASSERT(ws2.waitData(2));
+	Var msg2 = ws2.receive();
+	ASL_CHECK(msg2, ==, items);
+
+	ASL_CHECK(server2.broadcast(items), ==, 2);
+	ASL_ASSERT(ws2.waitData(2));
+	Var msg3 = ws2.receive();
+	ASL_CHECK(msg3, ==, items);
+	ASL_ASSERT(plain.waitData(2));
+	Var msg4 = plain.receive();
+	ASL_CHECK(msg4, ==, items);
+
+	ws2.close();
+	plain.close();
+	server.stop(true);
+	server2.stop(true);
+}
+
+// reads messages in parts as they arrive and replies with their size, checksum and type
+
+class StreamWsServer : public WebSocketServer
+{
+public:
+	void serve(WebSocket& ws)
+	{
+		while (!ws.closed())
+		{
+			if (!ws.waitData(0.2))
+				continue;
+			byte buffer[1000];
+			int n, total = 0;
+			unsigned sum = 0;
+			while ((n = ws.receive(buffer, sizeof(buffer))) > 0)
+			{
+				total += n;
+				for (int i = 0; i < n; i++)
+					sum = sum * 31 + buffer[i];
+			}
+			if (n < 0)
+				break;
+			ws.send(String::f("%i %u %i", total, sum, (int)ws.messageType()));
+		}
+	}
+};
+
+static unsigned checksum(const byte* p, int n)
+{
+	unsigned sum = 0;
+	for (int i = 0; i < n; i++)
+		sum = sum * 31 + p[i];
+	return sum;
+}
+
+ASL_TEST(WebSocketStreaming)
+{
+	StreamWsServer server;
+	server.setCompression(6);
+	server.setMaxMessageSize(50000); // does not apply to streamed messages
+	server.bind("127.0.0.1", 9016);
+	server.start(true);
+	EchoWsServer echo;
+	echo.setMaxMessageSize(10000);
+	echo.bind("127.0.0.1", 9017);
+	echo.start(true);
+	sleep(0.2);
+
+	// a fragmented binary message with a ping in between
+
+	Socket raw;
+	ASL_ASSERT(raw.connect("127.0.0.1", 9016));
+	raw << "GET / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	while (raw.readLine() != "\r") {}
+	WebSocket ws(raw);
+	ByteArray data(73000);
+	for (int i = 0; i < data.length(); i++)
+		data[i] = byte(i * 13 + i / 256);
+	byte head1[] = { 0x02, 0x7e, 0x0b, 0xb8 };                   // 3000 bytes, not final
+	byte ping[] = { 0x89, 0x00 };
+	byte head2[] = { 0x80, 0x7f, 0, 0, 0, 0, 0, 1, 0x11, 0x70 }; // 70000 bytes, final
+	raw.write(head1, sizeof(head1));
+	raw.write(data.data(), 3000);
+	raw.write(ping, sizeof(ping));
+	raw.write(head2, sizeof(head2));
+	for (int i = 3000; i < data.length(); i += 10000)
+		raw.write(data.data() + i, min(10000, data.length() - i));
+	String reply;
+	for (int i = 0; i < 5 && reply == ""; i++) // the pong comes first
+	{
+		ASL_ASSERT(ws.waitData(2));
+		reply = ws.receive();
+	}
+	ASL_CHECK(reply, ==, String::f("73000 %u 2", checksum(data.data(), data.length())));
+	ws.close();
+
+	// compressed messages are inflated progressively
+
+	String text;
+	for (int i = 0; i < 3000; i++)
+		text << "item " << i << ", ";
+	WebSocket wsc;
+	wsc.setCompression(6);
+	ASL_ASSERT(wsc.connect("ws://127.0.0.1:9016"));
+#ifdef ASL_ZLIB
+	ASL_ASSERT(wsc.compressed());
+#endif
+	for (int i = 0; i < 2; i++)
+	{
+		wsc.send(text);
+		ASL_ASSERT(wsc.waitData(2));
+		String reply2 = wsc.receive();
+		ASL_CHECK(reply2, ==, String::f("%i %u 1", text.length(), checksum((const byte*)*text, text.length())));
+	}
+	wsc.close();
+
+	// messages over the limit close the connection with status 1009, on both sides
+
+	WebSocket ws2;
+	ASL_ASSERT(ws2.connect("ws://127.0.0.1:9017"));
+	ws2.send(ByteArray(5000, 'a'));
+	ASL_ASSERT(ws2.waitData(2));
+	ByteArray echo1 = ws2.receive();
+	ASL_CHECK(echo1.length(), ==, 5000);
+	ws2.send(ByteArray(20000, 'a'));
+	ASL_ASSERT(ws2.waitData(2));
+	ByteArray echo2 = ws2.receive();
+	ASL_CHECK(echo2.length(), ==, 0);
+	ASL_ASSERT(ws2.closed());
+	ASL_CHECK(ws2.code(), ==, 1009);
+
+	WebSocket ws3;
+	ws3.setMaxMessageSize(1000);
+	ASL_ASSERT(ws3.connect("ws://127.0.0.1:9017"));
+	ws3.send(ByteArray(5000, 'a'));
+	ASL_ASSERT(ws3.waitData(2));
+	ByteArray echo3 = ws3.receive();
+	ASL_CHECK(echo3.length(), ==, 0);
+	ASL_CHECK(ws3.code(), ==, 1009);
+
+	server.stop(true);
+	echo.stop(true);
+}
+
+class AsyncWsServer : public WebSocketServer
+{
+public:
+	AtomicCount opened, closed;
+	AsyncWsServer() : opened(0), closed(0) {}
+	void onOpen(WebSocket& ws) { ++opened; }
+	void onMessage(WebSocket& ws, const WebSocketMsg& msg)
+	{
+		String text = msg;
+		ws.send("echo " + text);
+	}
+	void onClose(WebSocket& ws) { ++closed; }
+};
+
+ASL_TEST(WebSocketAsync)
+{
+	AsyncWsServer server;
+	server.setReactor(2);
+	server.bind("127.0.0.1", 9014);
+	server.start(true);
+	sleep(0.2);
+
+	const int N = 50;
+	WebSocket clients[N];
+	for (int i = 0; i < N; i++)
+		ASL_ASSERT(clients[i].connect("ws://127.0.0.1:9014"));
+	for (int i = 0; i < N; i++)
+		clients[i].send("hi " + String(i));
+	for (int i = 0; i < N; i++)
+	{
+		ASL_ASSERT(clients[i].waitData(2));
+		String msg = clients[i].receive();
+		ASL_CHECK(msg, ==, "echo hi " + String(i));
+	}
+	ASL_CHECK(server.clients().length(), ==, N);
+
+	// a frame arriving in pieces is parsed when complete, and client messages are dispatched to callbacks
+
+	Socket raw;
+	ASL_ASSERT(raw.connect("127.0.0.1", 9014));
+	raw << "GET / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	while (raw.readLine() != "\r") {}
+	WebSocket ws(raw);
+	String text = String::repeat('x', 300);
+	byte frame[310] = { 0x81, 0xfe, 0x01, 0x2c, 0, 0, 0, 0 };
+	memcpy(frame + 8, *text, 300);
+	for (int i = 0; i < 308; i += 100)
+	{
+		raw.write(frame + i, min(100, 308 - i));
+		sleep(0.05);
+	}
+	String received;
+	ws.onMessage([&](const WebSocketMsg& msg) { received = msg; });
+	int code = 0;
+	ws.onClose([&](int c) { code = c; });
+	for (int i = 0; i < 40 && received == ""; i++)
+		if (ws.waitData(0.05))
+			ws.poll();
+	ASL_CHECK(received, ==, "echo " + text);
+
+	for (int i = 0; i < N; i++)
+		clients[i].close();
+	for (int i = 0; i < 40 && server.closed < N; i++)
+		sleep(0.05);
+	ASL_CHECK(server.opened, ==, N + 1);
+	ASL_CHECK(server.closed, ==, N);
+	server.stop(true);
+	ASL_CHECK(server.closed, ==, N + 1);
+
+	for (int i = 0; i < 40 && ws.poll(); i++)
+		ws.wait(0.05);
+	ASL_ASSERT(!ws.poll());
+	ASL_CHECK(code, ==, 1006);
+
+	// upgraded from a linked HTTP server in reactor mode, and not subject to its idle timeout
+
+	AsyncWsServer wsserver;
+	AslServer http;
+	http.setReactor(2);
+	http.setKeepAlive(0.5);
+	http.link(wsserver);
+	http.bind("127.0.0.1", 9015);
+	http.start(true);
+	sleep(0.2);
+
+	WebSocket ws2;
+	ASL_ASSERT(ws2.connect("ws://127.0.0.1:9015"));
+	ASL_CHECK(Http::get("http://127.0.0.1:9015/?name=A").text(), ==, "Hello A from AslServer!");
+	sleep(2);
+	ws2.send("a");
+	ASL_ASSERT(ws2.waitData(2));
+	String echo = ws2.receive();
+	ASL_CHECK(echo, ==, "echo a");
+	ws2.close();
+	http.stop(true);
+	ASL_CHECK(wsserver.closed, ==, 1);
+}
+
+#ifdef ASL_TLS
+ASL_TEST(WebSocketTls)
+{
+	AsyncWsServer server;
+	server.setReactor(2);
+	server.bindTLS("127.0.0.1", 9025);
+	server.start(true);
+	sleep(0.2);
+
+	// records decrypt to fewer bytes than arrive encrypted: polling must not wait for that many on either side
+
+	WebSocket ws;
+	ASL_ASSERT(ws.connect("wss://127.0.0.1:9025"));
+	Array<String> received;
+	ws.onMessage([&](const WebSocketMsg& msg) { String text = msg; received << text; });
+	for (int i = 0; i < 3; i++)
+	{
+		String text = String::repeat('a' + i, i < 2 ? 100 : 40000);
+		ws.send(text);
+		for (int j = 0; j < 40 && received.length() <= i; j++)
+			if (ws.waitData(0.05))
+				ws.poll();
+		ASL_ASSERT(received.length() == i + 1);
+		ASL_CHECK(received[i], ==, "echo " + text);
+	}
+	ws.close();
+	server.stop(true);
+	ASL_CHECK(server.closed, ==, 1);
+
+	// a client that does not read must not stall the broadcast sender, which writes while the serving threads read
+
+	EchoWsServer echo;
+	echo.setSendQueue(64 * 1024);
+	echo.bindTLS("127.0.0.1", 9026);
+	echo.start(true);
+	sleep(0.2);
+
+	WebSocket clients[3];
+	for (int i = 0; i < 3; i++)
+		ASL_ASSERT(clients[i].connect("wss://127.0.0.1:9026"));
+	for (int i = 0; i < 50 && echo.clients().length() < 3; i++)
+		sleep(0.05);
+	ByteArray block(16000);
+	double t0 = now();
+	for (int i = 0; i < 2000; i++)
+	{
+		echo.broadcast(block);
+		if (i % 100 == 0)
+			clients[0].send("ping");
+	}
+	ASL_CHECK(now() - t0, <, 3.0);
+	echo.broadcast("end");
+
+	for (int i = 0; i < 3; i++)
+	{
+		bool ended = false;
+		int pings = 0;
+		while ((!ended || (i == 0 && pings < 20)) && clients[i].waitData(2))
+		{
+			String msg = clients[i].receive();
+			if (msg == "end")
+				ended = true;
+			else if (msg == "ping")
+				pings++;
+		}
+		ASL_ASSERT(ended);
+		if (i == 0) // echoed, maybe after the end
+			ASL_CHECK(pings, ==, 20);
+	}
+	for (int i = 0; i < 3; i++)
+		clients[i].close();
+	echo.stop(true);
+}
+#endif
+
+ASL_TEST(WebSocketBroadcast)
+{
+	EchoWsServer server;
+	server.setSendQueue(64 * 1024);
+	server.bind("127.0.0.1", 9010);
+	server.start(true);
+	sleep(0.2);
+
+	WebSocket clients[3];
+	for (int i = 0; i < 3; i++)
+		ASL_ASSERT(clients[i].connect("ws://127.0.0.1:9010"));
+	for (int i = 0; i < 50 && server.clients().length() < 3; i++)
+		sleep(0.05);
+
+	ASL_CHECK(server.broadcast(Var("n", 1)), ==, 3);
+	for (int i = 0; i < 3; i++)
+	{
+		ASL_ASSERT(clients[i].waitData(2));
+		Var msg = clients[i].receive();
+		ASL_CHECK(msg["n"], ==, 1);
+	}
+
+	// client 2 does not read: the publisher must not block and that client's queue drops old messages
+	ByteArray block(16000);
+	double t0 = now();
+	for (int i = 0; i < 2000; i++)
+		server.broadcast(block);
+	ASL_CHECK(now() - t0, <, 3.0);
+	server.broadcast("end");
+
+	for (int i = 0; i < 3; i++)
+	{
+		String last;
+		while (last != "end" && clients[i].waitData(2))
+			last = clients[i].receive();
+		ASL_CHECK(last, ==, "end");
+	}
+	{
+		Lock _(server.mutex());
+		int dropped = 0;
+		foreach(WebSocket* ws, server.clients())
+			dropped += ws->dropped();
+		ASL_CHECK(dropped, >, 0);
+	}
+
+	for (int i = 0; i < 3; i++)
+		clients[i].close();
+	server.stop(true);
+}
+
+ASL_TEST(HttpClientPool)
+{
+	AslServer server;
+	server.setThreadPool(2);
+	server.setKeepAlive(0.5);
+	server.bind("127.0.0.1", 9007);
+	server.start(true);
+	sleep(0.2);
+
+	Http::setConnectionPool(4, 10);
+	for (int i = 0; i < 3; i++)
+		ASL_CHECK(Http::get("http://127.0.0.1:9007/?name=" + String(i)).text(), ==, "Hello " + String(i) + " from AslServer!");
+	ASL_CHECK(server.stats().dispatched, ==, 1);
+
+	sleep(2); // the server closes the idle connection
+	ASL_CHECK(Http::get("http://127.0.0.1:9007/?name=X").text(), ==, "Hello X from AslServer!");
+	ASL_CHECK(server.stats().dispatched, ==, 2);
+
+	Http::setConnectionPool(0);
+	server.stop(true);
+}
+
+ASL_TEST(HttpReactor)
+{
+	AslServer server;
+	server.setReactor(2);
+	server.bind("127.0.0.1", 9002);
+	server.start(true);
+
+	sleep(0.2);
+	for (int i = 0; i < 4; i++)
+	{
+		HttpResponse res = Http::get("http://127.0.0.1:9002/?name=" + String(i));
+		ASL_CHECK(res.code(), ==, 200);
+		ASL_CHECK(res.text(), ==, "Hello " + String(i) + " from AslServer!");
+	}
+
+	Socket client;
+	ASL_ASSERT(client.connect("127.0.0.1", 9002));
+	for (int i = 0; i < 3; i++)
+	{
+		client << "GET /?name=KA HTTP/1.1\r\nHost: localhost\r\n\r\n";
+		ASL_ASSERT(client.readLine().startsWith("HTTP/1.1 200"));
+		while (client.readLine() != "\r") {}
+		ASL_CHECK(client.readString(24), ==, "Hello KA from AslServer!");
+	}
+	client.close();
+
+	ASL_CHECK(pipelinedRequests(9002), ==, 5);
+	ASL_CHECK(postExpectingContinue(9002, "/post", "later"), ==, "Received: later");
+
+	server.stop(true);
+}
+
+ASL_TEST(HttpPool)
+{
+	AslServer server;
+	server.setThreadPool(2, 4);
+	server.bind("127.0.0.1", 9003);
+	server.start(true);
+
+	sleep(0.2);
+	for (int i = 0; i < 4; i++)
+	{
+		HttpResponse res = Http::get("http://127.0.0.1:9003/?name=" + String(i));
+		ASL_CHECK(res.code(), ==, 200);
+		ASL_CHECK(res.text(), ==, "Hello " + String(i) + " from AslServer!");
+	}
+
+	server.stop(true);
+	SocketServerStats stats = server.stats();
+	ASL_CHECK(stats.dispatched, ==, 4);
+	ASL_CHECK(stats.rejected, ==, 0);
+	ASL_CHECK(stats.queued, ==, 0);
+}
@@ -8,7 +8,9 @@
 #include <asl/File.h>
 #include <asl/TextFile.h>
 #include <asl/util.h>
+#include <asl/Random.h>
 #include <stdio.h>
+#include <locale.h>
 #include <asl/testing.h>
 
 ASL_TEST_ENABLE()
@@ -525,6 +527,267 @@ ASL_TEST(JSON)
 #endif
 }
 
+// true if both values have the same structure, types and values
+
+static bool sameVar(const Var& a, const Var& b)
+{
+	if (a.type() != b.type() || a.length() != b.length())
+		return false;
+	if (a.is(Var::NONE))
+		return true;
+	if (a.is(Var::ARRAY))
+	{
+		for (int i = 0; i < a.length(); i++)
+			if (!sameVar(a[i], b[i]))
+				return false;
+		return true;
+	}
+	if (a.is(Var::OBJ))
+	{
+		foreach2(String& k, Var& x, a)
+			if (!b.has(k) || !sameVar(x, b[k]))
+				return false;
+		return true;
+	}
+	return a == b && (!a.is(Var::NUMBER) || (double)a == (double)b);
+}
+
+ASL_TEST(JsonFast)
+{
+	const char* docs[] = {
+		"{\"a\":1,\"b\":[true,false,null],\"c\":{\"d\":\"x\\ty\\u20ac\\ud83d\\ude00\"}}",
+		" \n\t[ 0, -0, 123456789, -12345678, 1234567890, -123456789, 1.5, -0.25, 1e3, 1E-3, 2.5e+10, 0.1, 3.141592653589793 ] ",
+		"[1.7976931348623157e308, 5e-324, 123456789012345678901234567890, 0.30000000000000004, 1e400]",
+		"[\"\", \"a long string that does not fit in the small string buffer of a var\", \"q\\\"b\\\\s\\/\\b\\f\\n\\r\"]",
+		"{}", "[]", "[[], {}, [[1]]]", "{\"a\":1,\"a\":2}", "\"\\u0041\\u00e9\"",
+		// not strict JSON, decoded by XdlParser
+		"[1, 2, ]", "{\"a\": 1 // comment\n}", "/*x*/[1]", "{a=1, b=Y}", "A{x=01.5}", "[1 2]", "[1,\n2\n3]",
+		// invalid
+		"[1,2", "{\"a\" 1}", "[01]", "[1.]", "[.5]", "[-]", "\"\t\"", "[tru]", "[\"\\x\"]", "", "  "
+	};
+	for (int i = 0; i < (int)(sizeof(docs) / sizeof(docs[0])); i++)
+	{
+		XdlParser parser;
+		Var expected = parser.decode(docs[i]);
+		Var v = Json::decode(docs[i]);
+		ASL_ASSERT(sameVar(v, expected));
+	}
+
+	Var v = Json::decode("[12345678, 123456789, 1234567890, 2.5]");
+	ASL_ASSERT(v[0].is(Var::INT) && v[1].is(Var::INT) && v[2].is(Var::NUMBER) && v[3].is(Var::NUMBER));
+	ASL_CHECK((double)Json::decode("0.1"), ==, 0.1);
+	ASL_CHECK((double)Json::decode("-2.2250738585072014e-308"), ==, -2.2250738585072014e-308);
+
+	String deep = String::repeat('[', 2000) + String::repeat(']', 2000);
+	ASL_ASSERT(Json::decode(deep).is(Var::ARRAY));
+
+	Var big;
+	for (int i = 0; i < 1000; i++)
+		big << Var("id", i)("x", i * 0.37)("name", "item " + String(i))("tags", array<Var>("a", "\"b\"", Var::NUL));
+	String json = Json::encode(big, Json::PRETTY);
+	XdlParser parser;
+	ASL_ASSERT(sameVar(Json::decode(json), parser.decode(json)));
+	ASL_ASSERT(Json::decode(json) == big);
+}
+
+// Records the events of a JSON document, stops at a property named "stop"
+
+struct JsonLog : public JsonHandler
+{
+	String log;
+	bool begin_object() { log << '{'; return true; }
+	bool end_object() { log << '}'; return true; }
+	bool begin_array() { log << '['; return true; }
+	bool end_array() { log << ']'; return true; }
+	bool new_property(const JsonStr& name) { log << name.toString() << ':'; return name != "stop"; }
+	bool new_string(const JsonStr& s) { log << '\'' << s.toString() << '\''; return true; }
+	bool new_number(int x) { log << 'i' << x; return true; }
+	bool new_number(double x) { log << 'd' << x; return true; }
+	bool new_bool(bool x) { log << (x ? 'T' : 'F'); return true; }
+	bool new_null() { log << 'N'; return true; }
+};
+
+ASL_TEST(JsonHandler)
+{
+	JsonLog h1;
+	ASL_ASSERT(Json::parse("{\"a\": [1, 2.5, \"x\\ny\", true, null], \"b\": {}, \"c\\u0041\": 1234567890}", h1));
+	ASL_CHECK(h1.log, ==, "{a:[i1d2.5'x\ny'TN]b:{}cA:d1234567890}");
+
+	JsonLog h2;
+	ASL_ASSERT(!Json::parse("[{\"x\": 1, \"stop\": 2, \"y\": 3}]", h2));
+	ASL_CHECK(h2.log, ==, "[{x:i1stop:");
+
+	JsonLog h3;
+	ASL_ASSERT(!Json::parse("[1, 2,]", h3));
+	ASL_ASSERT(!Json::parse("{a: 1}", h3));
+
+	JsonStr s = { "abc", 3 };
+	ASL_ASSERT(s == "abc" && s != "ab" && s != "abcd");
+}
+
+// Collects what it is given, counting the writes, and fails after `limit` writes
+
+struct PieceSink : public XdlSink
+{
+	String text;
+	int writes, limit, maxPiece;
+	PieceSink(int flushSize, int limit = 1000000) : XdlSink(flushSize), writes(0), limit(limit), maxPiece(0) {}
+	bool write(String& s)
+	{
+		if (++writes > limit)
+			return false;
+		maxPiece = max(maxPiece, s.length());
+		text << s;
+		s.clear();
+		return true;
+	}
+};
+
+ASL_TEST(XdlSink)
+{
+	Var big;
+	for (int i = 0; i < 3000; i++)
+		big << Var("i", i)("x", i / 4.0)("s", "text " + String(i))("a", array<Var>(1, true, Var::NUL));
+
+	PieceSink sink(1000);
+	ASL_ASSERT(Json::write(big, sink));
+	ASL_CHECK(sink.text, ==, Json::encode(big));
+	ASL_CHECK(sink.writes, >, 100);
+	ASL_CHECK(sink.maxPiece, <, 1200);
+
+	PieceSink sink2(1000);
+	ASL_ASSERT(Json::write(big, sink2, Json::PRETTY));
+	ASL_CHECK(sink2.text, ==, Json::encode(big, Json::PRETTY));
+
+	PieceSink sink3(1000);
+	ASL_ASSERT(Xdl::write(big, sink3));
+	ASL_CHECK(sink3.text, ==, Xdl::encode(big));
+
+	PieceSink failing(1000, 3);
+	ASL_ASSERT(!Json::write(big, failing));
+	ASL_CHECK(failing.writes, ==, 4);
+}
+
+ASL_TEST(XdlChunks)
+{
+	String doc = "{\"num\": [-12.5e-3, 1234567890, 42], \"s\": \"a\\\"b\\n\\u20ac\\ud83d\\ude00\", \"t\": true, \"n\": null} ";
+	Var expected = Json::decode(doc);
+	ASL_ASSERT(expected.ok());
+
+	for (int i = 0; i <= doc.length(); i++) // split in two at every position
+	{
+		XdlParser parser;
+		parser.parse(*doc, i);
+		parser.parse(*doc + i, doc.length() - i);
+		ASL_ASSERT(parser.end() == expected);
+	}
+
+	XdlParser parser;
+	for (int i = 0; i < doc.length(); i++)
+		parser.parse(*doc + i, 1);
+	ASL_ASSERT(!parser.failed());
+	ASL_ASSERT(parser.end() == expected);
+
+	parser.reset();
+	parser.parse("[1, 2", 5);
+	ASL_ASSERT(!parser.end().ok());
+	parser.reset();
+	parser.parse("[1, x]", 6);
+	ASL_ASSERT(parser.failed());
+
+#ifndef __ANDROID__
+	Var big;
+	for (int i = 0; i < 5000; i++)
+		big << Var("i", i)("x", i / 8.0)("s", String::repeat('z', i % 20));
+	ASL_ASSERT(Json::write(big, "chunks.json"));
+	ASL_ASSERT(Json::read("chunks.json") == big);
+	{
+		File file("chunks.json", File::READ);
+		XdlParser parser2;
+		ASL_ASSERT(parser2.read(file, 7) == big);
+	}
+	{
+		File file("chunks.json", File::WRITE);
+		file.write("\xef\xbb\xbf[1, 2.5]", 11);
+	}
+	ASL_ASSERT(Json::read("chunks.json") == Var(array<Var>(1, 2.5)));
+	File("chunks.json").remove();
+#endif
+}
+
+ASL_TEST(DoubleFormat)
+{
+	char s[32];
+	double values[] = { 0.1, 0.3, 1.0 / 3, 2.5, 1e21, 1e22, 1e23, 1e-5, 1e-7, 123456789012345678.0, 9007199254740993.0,
+		1.7976931348623157e308, 2.2250738585072014e-308, 2.225073858507201e-308, 5e-324, 3.141592653589793, -0.0 };
+	for (int i = 0; i < (int)(sizeof(values) / sizeof(values[0])); i++)
+	{
+		double x = values[i];
+		ASL_ASSERT(mydtoa(x, s) > 0);
+		ASL_CHECK(myatof(s), ==, x);
+		ASL_CHECK(strtod(s, NULL), ==, x);
+	}
+
+	Random random(false);
+	for (int i = 0; i < 100000; i++)
+	{
+		ULong bits = random.getLong();
+		double x;
+		memcpy(&x, &bits, 8);
+		if (x != x || x - x != 0)
+			continue;
+		mydtoa(x, s);
+		ASL_ASSERT(myatof(s) == x && strtod(s, NULL) == x);
+		float f = (float)random(-1e6, 1e6);
+		myftoa(f, s);
+		ASL_ASSERT((float)strtod(s, NULL) == f);
+	}
+
+	mydtoa(0.1, s);
+	ASL_CHECK(String(s), ==, "0.1");
+	mydtoa(-1.5e-7, s);
+	ASL_CHECK(String(s), ==, "-1.5e-07");
+	mydtoa(1e100, s);
+	ASL_CHECK(String(s), ==, "1e+100");
+	mydtoa(123456.0, s);
+	ASL_CHECK(String(s), ==, "123456");
+	mydtoa(-0.0, s);
+	ASL_CHECK(String(s), ==, "-0");
+	ASL_CHECK(mydtoa(0.1 + 0.2, s, 15), ==, 0);
+	myftoa(0.1f, s);
+	ASL_CHECK(String(s), ==, "0.1");
+
+	ASL_CHECK(String(0.1), ==, "0.1");
+	ASL_CHECK(String(0.1 + 0.2), ==, "0.3");
+	ASL_CHECK(String(1e15), ==, "1e+15");
+	ASL_CHECK(Json::encode(0.1), ==, "0.1");
+	ASL_CHECK(Json::encode(0.1 + 0.2), ==, "0.30000000000000004");
+	ASL_CHECK(Json::encode(array<Var>(1.5, 0.1f, 1e-300)), ==, "[1.5,0.1,1e-300]");
+
+	ASL_CHECK(myatof("1.25e2"), ==, 125.0);
+	ASL_CHECK(myatof("-0.5x"), ==, -0.5);
+	ASL_CHECK(myatof("12345678901234567890123"), ==, 12345678901234567890123.0);
+	ASL_CHECK(myatof("0.000000000000000000000000001"), ==, 1e-27);
+	ASL_CHECK(myatof("2.4703282292062328e-324"), ==, 5e-324);
+
+	// with a decimal comma, only the number is given to strtod, not what follows it
+	String locale = setlocale(LC_NUMERIC, NULL);
+	const char* commaLocales[] = { "de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "es_ES.UTF-8", "German_Germany.1252" };
+	for (int i = 0; i < (int)(sizeof(commaLocales) / sizeof(commaLocales[0])); i++)
+	{
+		if (!setlocale(LC_NUMERIC, commaLocales[i]) || *localeconv()->decimal_point != ',')
+			continue;
+		ASL_CHECK(myatof("0.30000000000000004"), ==, 0.30000000000000004);
+		ASL_CHECK(myatof("9007199254740993,5"), ==, 9007199254740992.0);
+		Var v = Json::decode("[9007199254740993,5, 1.5]");
+		ASL_CHECK((double)v[0], ==, 9007199254740992.0);
+		ASL_CHECK(v[1], ==, 5);
+		ASL_CHECK(Json::encode(0.1 + 0.2), ==, "0.30000000000000004");
+		break;
+	}
+	setlocale(LC_NUMERIC, *locale);
+}
+
 ASL_TEST(Var)
 {
 	Var b = Var("x", 3);
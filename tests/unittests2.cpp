@@ -315,6 +315,13 @@ ASL_TEST(HashMap)
 	m2[100] = 5.5f;
 
 	ASL_ASSERT(m2 != m);
+
+	HashMap<int, int> m3; // keys in the same bin: removing the first one keeps the others
+	for (int i = 0; i < 3; i++)
+		m3[i << 20] = i;
+	m3.remove(0);
+	ASL_ASSERT(m3.length() == 2);
+	ASL_ASSERT(m3.has(1 << 20) && m3.has(2 << 20));
 }
 
 String join1(const Dic<String>& a)